@@ -0,0 +1,56 @@
+#ifndef BENCHOBJECT_H
+#define BENCHOBJECT_H
+
+#include <QObject>
+#include <QString>
+#include <QVariantMap>
+
+/**
+ * @brief The object exposed by the benchmarks, one property of each shape commonly seen in practice.
+ */
+class BenchObject : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("Version", "1.0")
+    Q_PROPERTY(int value READ value WRITE setValue NOTIFY valueChanged)
+    Q_PROPERTY(QString text READ text WRITE setText NOTIFY textChanged)
+    Q_PROPERTY(QVariantMap record READ record NOTIFY recordChanged)
+
+public:
+    explicit BenchObject(QObject *parent=0): QObject(parent), _value(0), _text("The quick brown fox"){
+        _record["id"]=1234;
+        _record["name"]="sensor-été";
+        _record["enabled"]=true;
+        _record["reading"]=21.5;
+        _record["tags"]=QStringList() << "a" << "b" << "c";
+    }
+
+    int value() const { return _value; }
+    QString text() const { return _text; }
+    QVariantMap record() const { return _record; }
+
+signals:
+    void valueChanged(int value);
+    void textChanged(QString text);
+    void recordChanged(QVariantMap record);
+
+public slots:
+    void setValue(int value){
+        if(_value==value) return;
+        _value=value;
+        emit valueChanged(_value);
+    }
+
+    void setText(const QString &text){
+        if(_text==text) return;
+        _text=text;
+        emit textChanged(_text);
+    }
+
+private:
+    int _value;
+    QString _text;
+    QVariantMap _record;
+};
+
+#endif // BENCHOBJECT_H
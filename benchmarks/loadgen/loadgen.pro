@@ -0,0 +1,18 @@
+QT += core network websockets
+QT -= gui
+
+include(../../src/qwebapi.pri)
+
+TARGET = loadgen
+CONFIG += console
+CONFIG -= app_bundle
+
+HEADERS += \
+    ../benchobject.h
+
+SOURCES += \
+    main.cpp
+
+DESTDIR=$$PWD/../build
+MOC_DIR=$$PWD/.moc
+OBJECTS_DIR=$$PWD/.obj
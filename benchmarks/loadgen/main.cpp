@@ -0,0 +1,323 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QThread>
+#include <QTcpSocket>
+#include <QWebSocket>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QUrl>
+
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+
+#include "restapi.h"
+#include "websocketapi.h"
+#include "../benchobject.h"
+
+/**
+ * @brief Latency samples and error count for one scenario.
+ */
+typedef struct Stats {
+    Stats(): errors(0){}
+    void record(qint64 nsecs, bool ok){
+        if(ok) latencies << nsecs;
+        else errors++;
+    }
+    QVector<qint64> latencies;
+    quint64 errors;
+} Stats;
+
+/**
+ * @brief Hosts the APIs under test on their own thread so that server and load generator don't share an event loop.
+ */
+class Server : public QObject
+{
+    Q_OBJECT
+public slots:
+    void start(int restPort, int socketPort, int workerThreads){
+        _object=new BenchObject(this);
+        ApiRegistry *registry=new ApiRegistry(this);
+        registry->addObject<BenchObject*>(_object);
+
+        RestApi *restApi=new RestApi(QHostAddress::LocalHost, qint16(restPort), this);
+        restApi->setRegistry(registry);
+        if(workerThreads>0) restApi->setWorkerThreads(workerThreads);
+
+        // Fan-out measures delivery, so nothing may be held back from clients that fall behind
+        WebSocketApi *socketApi=new WebSocketApi(QHostAddress::LocalHost, qint16(socketPort), this);
+        socketApi->setMaxPendingBytes(0);
+        socketApi->setRegistry(registry);
+    }
+
+    void emitChanges(int count){
+        for(int i=0; i<count; i++) _object->setValue(_object->value()+1);
+    }
+
+private:
+    BenchObject *_object;
+};
+
+/**
+ * @brief A keep-alive HTTP connection issuing one request at a time for as long as running is true.
+ */
+class RestClient : public QObject
+{
+    Q_OBJECT
+public:
+    RestClient(bool put, Stats *stats, const bool *running, QObject *parent=0):
+        QObject(parent), _socket(new QTcpSocket(this)), _put(put), _stats(stats), _running(running), _sent(0)
+    {
+        connect(_socket, SIGNAL(connected()), SLOT(_send()));
+        connect(_socket, SIGNAL(readyRead()), SLOT(_readyRead()));
+    }
+
+    void connectToHost(const QString &host, quint16 port){ _socket->connectToHost(host, port); }
+
+private slots:
+    void _send(){
+        if(_put){
+            QByteArray body=QByteArray::number(++_sent);
+            _socket->write("PUT /BenchObject/value HTTP/1.1\r\nHost: localhost\r\nContent-Length: "
+                           +QByteArray::number(body.size())+"\r\n\r\n"+body);
+        } else {
+            _socket->write("GET /BenchObject/value HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        }
+        _timer.start();
+    }
+
+    void _readyRead(){
+        _buffer+=_socket->readAll();
+        forever {
+            int end=_buffer.indexOf("\r\n\r\n");
+            if(end<0) return;
+            int length=0;
+            int header=_buffer.indexOf("Content-Length:");
+            if(header>=0 && header<end) length=_buffer.mid(header+15, end-header-15).split('\r').first().trimmed().toInt();
+            if(_buffer.size()<end+4+length) return;
+
+            bool ok=_buffer.startsWith("HTTP/1.1 200");
+            _buffer.remove(0, end+4+length);
+            _stats->record(_timer.nsecsElapsed(), ok);
+            if(*_running) _send();
+        }
+    }
+
+private:
+    QTcpSocket *_socket;
+    bool _put;
+    Stats *_stats;
+    const bool *_running;
+    int _sent;
+    QByteArray _buffer;
+    QElapsedTimer _timer;
+};
+
+/**
+ * @brief A JSON RPC client issuing one read at a time for as long as running is true.
+ */
+class RpcClient : public QObject
+{
+    Q_OBJECT
+public:
+    RpcClient(Stats *stats, const bool *running, QObject *parent=0):
+        QObject(parent), _socket(new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this)),
+        _stats(stats), _running(running), _id(0)
+    {
+        connect(_socket, SIGNAL(connected()), SLOT(_send()));
+        connect(_socket, SIGNAL(textMessageReceived(QString)), SLOT(_received(QString)));
+    }
+
+    void open(const QUrl &url){ _socket->open(url); }
+
+private slots:
+    void _send(){
+        _socket->sendTextMessage(QString("{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.value\",\"id\":%1}").arg(++_id));
+        _timer.start();
+    }
+
+    void _received(QString message){
+        if(message.contains("\"method\"")) return; // A notification, not our response
+        _stats->record(_timer.nsecsElapsed(), message.contains("\"result\""));
+        if(*_running) _send();
+    }
+
+private:
+    QWebSocket *_socket;
+    Stats *_stats;
+    const bool *_running;
+    int _id;
+    QElapsedTimer _timer;
+};
+
+/**
+ * @brief A subscribed WebSocket client which only counts the notifications it receives.
+ */
+class FanoutClient : public QObject
+{
+    Q_OBJECT
+public:
+    FanoutClient(int *connected, quint64 *received, QObject *parent=0):
+        QObject(parent), _socket(new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this)),
+        _connected(connected), _received(received)
+    {
+        connect(_socket, SIGNAL(connected()), SLOT(_onConnected()));
+        connect(_socket, SIGNAL(textMessageReceived(QString)), SLOT(_onReceived()));
+    }
+
+    void open(const QUrl &url){ _socket->open(url); }
+
+private slots:
+    void _onConnected(){ (*_connected)++; }
+    void _onReceived(){ (*_received)++; }
+
+private:
+    QWebSocket *_socket;
+    int *_connected;
+    quint64 *_received;
+};
+
+static bool waitUntil(const std::function<bool()> &done, int timeoutMs){
+    QElapsedTimer timer;
+    timer.start();
+    QTimer tick;
+    tick.start(5); // Wakes the event loop so the condition is re-checked
+    while(!done()){
+        if(timer.elapsed()>timeoutMs) return false;
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    return true;
+}
+
+static void report(const char *name, int concurrency, Stats &stats, qint64 elapsedNs){
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    int n=stats.latencies.size();
+    double p50=n ? stats.latencies.at(n*50/100)/1e6 : 0;
+    double p99=n ? stats.latencies.at(qMin(n-1, n*99/100))/1e6 : 0;
+    printf("%-10s %6d  %12.0f ops/s  p50 %8.3f ms  p99 %8.3f ms  errors %llu\n", name, concurrency,
+           n*1e9/qMax(Q_INT64_C(1), elapsedNs), p50, p99, static_cast<unsigned long long>(stats.errors));
+    fflush(stdout);
+}
+
+static void runRest(bool put, const QString &host, quint16 port, int connections, int seconds){
+    Stats stats;
+    bool running=true;
+    QList<RestClient*> clients;
+    QElapsedTimer timer;
+    timer.start();
+    for(int i=0; i<connections; i++){
+        RestClient *client=new RestClient(put, &stats, &running);
+        client->connectToHost(host, port);
+        clients << client;
+    }
+    waitUntil([&]{ return timer.elapsed()>=seconds*1000; }, seconds*1000+1000);
+    running=false;
+    qint64 elapsed=timer.nsecsElapsed();
+    report(put ? "rest-put" : "rest-get", connections, stats, elapsed);
+    qDeleteAll(clients);
+}
+
+static void runRpc(const QUrl &url, int connections, int seconds){
+    Stats stats;
+    bool running=true;
+    QList<RpcClient*> clients;
+    QElapsedTimer timer;
+    timer.start();
+    for(int i=0; i<connections; i++){
+        RpcClient *client=new RpcClient(&stats, &running);
+        client->open(url);
+        clients << client;
+    }
+    waitUntil([&]{ return timer.elapsed()>=seconds*1000; }, seconds*1000+1000);
+    running=false;
+    qint64 elapsed=timer.nsecsElapsed();
+    report("rpc", connections, stats, elapsed);
+    qDeleteAll(clients);
+}
+
+static void runFanout(Server *server, const QUrl &url, int count, quint64 deliveries){
+    int connected=0;
+    quint64 received=0;
+    QList<FanoutClient*> clients;
+    for(int i=0; i<count; i++){
+        FanoutClient *client=new FanoutClient(&connected, &received);
+        client->open(url);
+        clients << client;
+    }
+    if(!waitUntil([&]{ return connected==count; }, 60000)){
+        printf("fanout     %6d  only %d clients connected, raise the open file limit (ulimit -n)\n", count, connected);
+        qDeleteAll(clients);
+        return;
+    }
+
+    // Roughly the same number of messages delivered whatever the client count
+    int changes=int(qMax(quint64(10), deliveries/quint64(count)));
+    quint64 expected=quint64(changes)*quint64(count);
+    received=0;
+    QElapsedTimer timer;
+    timer.start();
+    QMetaObject::invokeMethod(server, "emitChanges", Qt::QueuedConnection, Q_ARG(int, changes));
+    bool complete=waitUntil([&]{ return received>=expected; }, 120000);
+    qint64 elapsed=timer.nsecsElapsed();
+
+    printf("fanout     %6d  %12.0f msg/s  %d notifications in %.1f ms%s\n", count, received*1e9/qMax(Q_INT64_C(1), elapsed),
+           changes, elapsed/1e6, complete ? "" : "  (timed out)");
+    fflush(stdout);
+    qDeleteAll(clients);
+    waitUntil([]{ return false; }, 500); // Let the server clean up before the next round
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Loopback load generator for RestApi and WebSocketApi.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("scenarios", "Any of rest-get, rest-put, rpc and fanout, all by default.");
+    QCommandLineOption durationOption("duration", "Seconds to run each timed scenario.", "seconds", "5");
+    QCommandLineOption connectionsOption("connections", "Concurrent REST connections.", "count", "64");
+    QCommandLineOption rpcOption("rpc-clients", "Concurrent JSON RPC clients.", "count", "16");
+    QCommandLineOption fanoutOption("fanout-clients", "Comma separated subscriber counts.", "counts", "1,100,10000");
+    QCommandLineOption deliveriesOption("deliveries", "Notifications to deliver per fan-out round.", "count", "1000000");
+    QCommandLineOption workersOption("workers", "RestApi worker threads.", "count", "0");
+    QCommandLineOption restPortOption("rest-port", "RestApi port.", "port", "45678");
+    QCommandLineOption socketPortOption("ws-port", "WebSocketApi port.", "port", "45679");
+    parser.addOptions(QList<QCommandLineOption>() << durationOption << connectionsOption << rpcOption << fanoutOption
+                      << deliveriesOption << workersOption << restPortOption << socketPortOption);
+    parser.process(a);
+
+    QStringList scenarios=parser.positionalArguments();
+    if(scenarios.isEmpty()) scenarios << "rest-get" << "rest-put" << "rpc" << "fanout";
+    int seconds=parser.value(durationOption).toInt();
+    quint16 restPort=quint16(parser.value(restPortOption).toUInt());
+    quint16 socketPort=quint16(parser.value(socketPortOption).toUInt());
+    QUrl url(QString("ws://127.0.0.1:%1").arg(socketPort));
+
+    QThread serverThread;
+    Server *server=new Server;
+    server->moveToThread(&serverThread);
+    serverThread.start();
+    QMetaObject::invokeMethod(server, "start", Qt::BlockingQueuedConnection, Q_ARG(int, restPort), Q_ARG(int, socketPort),
+                              Q_ARG(int, parser.value(workersOption).toInt()));
+
+    printf("%-10s %6s\n", "scenario", "conc");
+    foreach(const QString &scenario, scenarios){
+        if(scenario=="rest-get") runRest(false, "127.0.0.1", restPort, parser.value(connectionsOption).toInt(), seconds);
+        else if(scenario=="rest-put") runRest(true, "127.0.0.1", restPort, parser.value(connectionsOption).toInt(), seconds);
+        else if(scenario=="rpc") runRpc(url, parser.value(rpcOption).toInt(), seconds);
+        else if(scenario=="fanout"){
+            foreach(const QString &count, parser.value(fanoutOption).split(','))
+                runFanout(server, url, count.toInt(), parser.value(deliveriesOption).toULongLong());
+        }
+        else printf("Unknown scenario %s\n", qPrintable(scenario));
+    }
+
+    QMetaObject::invokeMethod(server, "deleteLater");
+    serverThread.quit();
+    serverThread.wait();
+    return 0;
+}
+
+#include "main.moc"
@@ -0,0 +1,21 @@
+QT += core testlib
+QT -= gui
+
+# Grants the benchmarks access to the internals they measure
+DEFINES += QWEBAPI_TESTING
+
+include(../../src/qwebapi.pri)
+
+TARGET = tst_micro
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+HEADERS += \
+    ../benchobject.h
+
+SOURCES += \
+    tst_micro.cpp
+
+DESTDIR=$$PWD/../build
+MOC_DIR=$$PWD/.moc
+OBJECTS_DIR=$$PWD/.obj
@@ -0,0 +1,261 @@
+#include <QtTest>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QCborValue>
+
+#include "restapi.h"
+#include "websocketapi.h"
+#include "routetable.h"
+#include "jsonwriter.h"
+#include "timerwheel.h"
+#include "../benchobject.h"
+
+/**
+ * @brief Microbenchmarks of the per-request hot paths, run without any sockets involved.
+ */
+class QWebApiBenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void parseRequest();
+    void handleGet();
+    void handleGetNotModified();
+    void writeResponse_data();
+    void writeResponse();
+    void parseMessage_data();
+    void parseMessage();
+    void routeLookup();
+    void restartTimeouts();
+    void addObjects();
+    void notifySignal();
+
+    void serializeJsonWriter_data(){ _serializeData(); }
+    void serializeJsonWriter();
+    void serializeResponse_data(){ _serializeData(); }
+    void serializeResponse();
+    void serializeQJsonDocument_data(){ _serializeData(); }
+    void serializeQJsonDocument();
+    void serializeCbor_data(){ _serializeData(); }
+    void serializeCbor();
+
+private:
+    void _serializeData();
+
+    BenchObject *_object;
+    RestApi *_restApi;
+    WebSocketApi *_socketApi;
+};
+
+static const char GetRequest[]=
+        "GET /BenchObject/value HTTP/1.1\r\n"
+        "Host: localhost:45678\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0 Safari/537.36\r\n"
+        "Accept: text/plain,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept-Language: en-GB,en;q=0.9\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+void QWebApiBenchmark::initTestCase(){
+    _object=new BenchObject(this);
+    _restApi=new RestApi(QHostAddress::LocalHost, 0, this);
+    _restApi->addObject<BenchObject*>(_object);
+    _socketApi=new WebSocketApi(QHostAddress::LocalHost, 0, this);
+    _socketApi->setRegistry(_restApi->registry());
+}
+
+void QWebApiBenchmark::cleanupTestCase(){
+    delete _socketApi;
+    delete _restApi;
+}
+
+void QWebApiBenchmark::parseRequest(){
+    HttpRequest request;
+    bool chunked=false;
+    int size=int(sizeof(GetRequest))-1;
+    QBENCHMARK {
+        QCOMPARE(HttpWorker::_parse(GetRequest, size, 0, &request, &chunked), size);
+    }
+}
+
+void QWebApiBenchmark::handleGet(){
+    HttpRequest request;
+    bool chunked=false;
+    HttpWorker::_parse(GetRequest, int(sizeof(GetRequest))-1, 0, &request, &chunked);
+
+    HttpResponse response;
+    QBENCHMARK {
+        response=HttpResponse();
+        _restApi->_handle(request, &response);
+    }
+    QCOMPARE(response.code, 200);
+}
+
+void QWebApiBenchmark::handleGetNotModified(){
+    HttpRequest request;
+    bool chunked=false;
+    HttpWorker::_parse(GetRequest, int(sizeof(GetRequest))-1, 0, &request, &chunked);
+    HttpResponse first;
+    QByteArray etag;
+    int metricsSlot=-1;
+    _restApi->_handleRoute(request, &first, &etag, &metricsSlot);
+
+    // Same request again, this time revalidating the ETag just received
+    QByteArray conditional=QByteArray(GetRequest).replace("\r\n\r\n", "\r\nIf-None-Match: "+etag+"\r\n\r\n");
+    HttpWorker::_parse(conditional.constData(), conditional.size(), 0, &request, &chunked);
+    HttpResponse response;
+    QBENCHMARK {
+        response=HttpResponse();
+        _restApi->_handle(request, &response);
+    }
+    QCOMPARE(response.code, 304);
+}
+
+void QWebApiBenchmark::writeResponse_data(){
+    QTest::addColumn<int>("bodySize");
+    QTest::newRow("small") << 16;
+    QTest::newRow("large") << 64*1024;
+}
+
+void QWebApiBenchmark::writeResponse(){
+    QFETCH(int, bodySize);
+    HttpResponseWriter writer("RestApi/0.1");
+    HttpResponse response;
+    response.body=QByteArray(bodySize, 'x');
+    response.headers="ETag: \"jf3k2x1a-1\"\r\nCache-Control: no-cache\r\n";
+
+    // Only the headers are formatted, a large body goes out as is
+    QBENCHMARK {
+        bool withBody;
+        QByteArray head=writer.head(response, true, &withBody);
+        Q_UNUSED(head)
+    }
+}
+
+void QWebApiBenchmark::parseMessage_data(){
+    QTest::addColumn<QString>("message");
+    QTest::newRow("read") << "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.value\",\"id\":1}";
+    QTest::newRow("read record") << "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.record\",\"id\":1}";
+    QTest::newRow("call") << "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.setText\",\"params\":[\"fox\"],\"id\":1}";
+    QTest::newRow("call by name") << "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.setText\","
+                                     "\"params\":{\"text\":\"fox\"},\"id\":1}";
+    QTest::newRow("unknown method") << "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.missing\",\"id\":1}";
+    QTest::newRow("batch") << "[{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.value\",\"id\":1},"
+                              "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.text\",\"id\":2},"
+                              "{\"jsonrpc\":\"2.0\",\"method\":\"BenchObject.record\",\"id\":3}]";
+}
+
+void QWebApiBenchmark::parseMessage(){
+    QFETCH(QString, message);
+    QBENCHMARK {
+        QByteArray response=_socketApi->_parseMessage(Q_NULLPTR, message);
+        Q_UNUSED(response)
+    }
+}
+
+void QWebApiBenchmark::routeLookup(){
+    // A realistically sized table, a few hundred properties over a few dozen classes
+    RouteTable table;
+    for(int i=0; i<512; i++) table.insert("Class"+QByteArray::number(i/16)+".property"+QByteArray::number(i), i);
+    const char path[]="Class17/property283";
+    QBENCHMARK {
+        QCOMPARE(table.find(path, int(sizeof(path))-1), 283);
+    }
+}
+
+void QWebApiBenchmark::restartTimeouts(){
+    // The idle timeout of every connection is restarted on each read, here for 10k connections
+    TimerWheel wheel(250);
+    QVector<QObject*> keys;
+    for(int i=0; i<10000; i++) keys << new QObject(&wheel);
+    int i=0, msecs=30000;
+    QBENCHMARK {
+        wheel.start(keys.at(i), msecs+i%1000);
+        i=(i+1)%keys.size();
+    }
+}
+
+void QWebApiBenchmark::addObjects(){
+    // Thousands of identical instances, as a device with many channels exposes them
+    QList<BenchObject*> objects;
+    for(int i=0; i<10000; i++){
+        BenchObject *object=new BenchObject;
+        object->setObjectName("ch"+QString::number(i));
+        objects << object;
+    }
+
+    QBENCHMARK_ONCE {
+        WebSocketApi api(QHostAddress::LocalHost, 0);
+        foreach(BenchObject *object, objects) api.addObject<BenchObject*>(object);
+    }
+    qDeleteAll(objects);
+}
+
+void QWebApiBenchmark::notifySignal(){
+    // From the setter's emit, through the cache update, to the notification with nobody subscribed
+    int value=_object->value();
+    QBENCHMARK {
+        _object->setValue(++value);
+    }
+}
+
+void QWebApiBenchmark::_serializeData(){
+    QTest::addColumn<QVariant>("value");
+    QTest::newRow("int") << QVariant(123456);
+    QTest::newRow("double") << QVariant(21.5);
+    QTest::newRow("string") << QVariant(_object->text());
+    QTest::newRow("map") << QVariant(_object->record());
+
+    QVariantList list;
+    for(int i=0; i<100; i++) list << _object->record();
+    QTest::newRow("list of 100 maps") << QVariant(list);
+}
+
+void QWebApiBenchmark::serializeJsonWriter(){
+    QFETCH(QVariant, value);
+    QByteArray buffer;
+    buffer.reserve(16*1024);
+    QBENCHMARK {
+        buffer.resize(0);
+        JsonWriter(&buffer).value(value);
+    }
+}
+
+void QWebApiBenchmark::serializeResponse(){
+    // A whole JSON RPC response as it is sent now, comparable to the baseline below
+    QFETCH(QVariant, value);
+    QBENCHMARK {
+        QString message=QString::fromUtf8(_socketApi->_toResponse(WebSocketApi::_toJson(value), 1, WebSocketApi::Json));
+        Q_UNUSED(message)
+    }
+}
+
+void QWebApiBenchmark::serializeQJsonDocument(){
+    // What the serializer replaced, kept as the baseline: the response object, indented by toJson()'s default, and
+    // the QString it was returned as for sendTextMessage()
+    QFETCH(QVariant, value);
+    QBENCHMARK {
+        QJsonObject jresponse;
+        jresponse["jsonrpc"]="2.0";
+        jresponse["id"]=1;
+        jresponse["result"]=QJsonValue::fromVariant(value);
+        QString message=QString::fromUtf8(QJsonDocument(jresponse).toJson());
+        Q_UNUSED(message)
+    }
+}
+
+void QWebApiBenchmark::serializeCbor(){
+    QFETCH(QVariant, value);
+    QBENCHMARK {
+        QByteArray cbor=WebSocketApi::_toCbor(value);
+        Q_UNUSED(cbor)
+    }
+}
+
+QTEST_GUILESS_MAIN(QWebApiBenchmark)
+
+#include "tst_micro.moc"
@@ -1,30 +1,124 @@
 #include"abstractapi.h"
 
-#include <QString>
+AbstractApi::AbstractApi(QObject *parent): QObject(parent), _metrics(Q_NULLPTR), _registry(new ApiRegistry(this)), _concurrent(false){
+    connect(_registry, SIGNAL(_signalEmitted(QString,QStringList,QVariant)), SIGNAL(_signalEmitted(QString,QStringList,QVariant)));
+    connect(_registry, SIGNAL(_routesNotified(int)), SIGNAL(_routesNotified(int)));
+}
+
+AbstractApi::~AbstractApi(){
+    // A shared registry outlives the API and may be given more objects once nothing serves it from other threads
+    if(_concurrent && _registry->parent()!=this) _registry->_concurrentApis--;
+}
+
+ApiMetrics *AbstractApi::metrics() const { return _metrics; }
+
+void AbstractApi::setMetrics(ApiMetrics *metrics){
+    if(metrics==_metrics) return;
+    _metrics=metrics;
+    _registry->_setMetrics(_metricsApi(), metrics);
+}
+
+ApiRegistry *AbstractApi::registry() const { return _registry; }
+
+void AbstractApi::setRegistry(ApiRegistry *registry){
+    if(registry && registry==_registry) return;
+
+    // Another API may still be using the old registry, only this API's part in it is undone
+    disconnect(_registry, Q_NULLPTR, this, Q_NULLPTR);
+    if(_registry->parent()==this) delete _registry;
+    else {
+        if(_metrics) _registry->_setMetrics(_metricsApi(), Q_NULLPTR);
+        if(_concurrent) _registry->_concurrentApis--;
+    }
+
+    _registry=registry ? registry : new ApiRegistry(this);
+    connect(_registry, SIGNAL(_signalEmitted(QString,QStringList,QVariant)), SIGNAL(_signalEmitted(QString,QStringList,QVariant)));
+    connect(_registry, SIGNAL(_routesNotified(int)), SIGNAL(_routesNotified(int)));
+    if(_metrics) _registry->_setMetrics(_metricsApi(), _metrics);
+    if(_concurrent) _registry->_concurrentApis++;
+}
+
+const AbstractApi::ApiRoute *AbstractApi::_route(const char *name, int len) const { return _registry->_route(name, len); }
+
+const AbstractApi::ApiRoute *AbstractApi::_route(const QString &name) const { return _registry->_route(name); }
+
+const AbstractApi::ApiObject *AbstractApi::_object(const char *name, int len) const { return _registry->_object(name, len); }
+
+const AbstractApi::ApiObject *AbstractApi::_object(const QString &name) const { return _registry->_object(name); }
+
+const AbstractApi::ApiCall *AbstractApi::_call(const char *name, int len) const { return _registry->_call(name, len); }
+
+const AbstractApi::ApiCall *AbstractApi::_call(const QString &name) const { return _registry->_call(name); }
+
+const AbstractApi::ApiInfo *AbstractApi::_classInfo(const QString &className) const {
+    auto it=_registry->_apiInfo.constFind(className);
+    return it==_registry->_apiInfo.constEnd() ? Q_NULLPTR : &it.value();
+}
+
+int AbstractApi::_routeCount() const { return _registry->_routes.size(); }
+
+const AbstractApi::ApiRoute *AbstractApi::_routeAt(int id) const { return &_registry->_routes.at(id); }
+
+const QVector<int> &AbstractApi::_notifiedRoutes(int notifier) const {
+    return _registry->_notifiers.at(notifier).routes;
+}
+
+int AbstractApi::_metricsSlot(const ApiRoute *route) const { return route->metricsSlots[_metricsApi()]; }
+
+int AbstractApi::_metricsSlot(const ApiObject *object) const { return object->metricsSlots[_metricsApi()]; }
+
+int AbstractApi::_metricsSlot(const ApiCall *call) const { return call->metricsSlots[_metricsApi()]; }
+
+QVariant AbstractApi::_read(QObject *obj, const QMetaProperty &prop) const { return _registry->_read(obj, prop); }
+
+bool AbstractApi::_write(QObject *obj, const QMetaProperty &prop, const QVariant &value) const {
+    return _registry->_write(obj, prop, value);
+}
+
+QFuture<QVariant> AbstractApi::_readDeferred(const ApiRoute *route) const { return _registry->_readDeferred(route); }
+
+QFuture<QVariant> AbstractApi::_writeDeferred(const ApiRoute *route, const QVariant &value) const {
+    return _registry->_writeDeferred(route, value);
+}
+
+QByteArray AbstractApi::_readText(const ApiRoute *route, quint64 *version) const {
+    return _registry->_readText(route, version);
+}
+
+quint64 AbstractApi::_version(const ApiRoute *route) const { return _registry->_version(route); }
+
+QByteArray AbstractApi::_readJson(const ApiRoute *route) const { return _registry->_readJson(route); }
+
+bool AbstractApi::_cachedJson(const ApiRoute *route, QByteArray *json) const { return _registry->_cachedJson(route, json); }
+
+QByteArray AbstractApi::_readCbor(const ApiRoute *route) const { return _registry->_readCbor(route); }
+
+QByteArray AbstractApi::_readObjectJson(const ApiObject *object) const { return _registry->_readObjectJson(object); }
 
-AbstractApi::AbstractApi(QObject *parent): QObject(parent){}
+QVariantMap AbstractApi::_readObject(const ApiObject *object) const { return _registry->_readObject(object); }
 
-void AbstractApi::_connect(QObject *obj, int index){
-    QMetaObject::connect(obj, index, this, metaObject()->indexOfMethod("_changedSignal()"));
+bool AbstractApi::_writeObject(const ApiObject *object, const QVariantMap &values) const {
+    return _registry->_writeObject(object, values);
 }
 
-void AbstractApi::_changedSignal(){
-    QObject *obj=sender();
-    const QMetaObject *mobj=obj->metaObject();
-    int signalId=senderSignalIndex();
-    QString className=mobj->className();
-    QString signalName=mobj->method(signalId).name();
-    QString methodName=QString("%1.%2").arg(className).arg(signalName);
+bool AbstractApi::_invoke(const ApiCall *call, const QVariantList &args, QVariant *result) const {
+    return _registry->_invoke(call, args, result);
+}
 
-    if(!_apiInfo.contains(className)) return;
-    ApiInfo info=_apiInfo[className];
+bool AbstractApi::_invoke(const ApiCall *call, const QVariantMap &args, QVariant *result) const {
+    return _registry->_invoke(call, args, result);
+}
 
-    if(!info.sig2Prop.contains(signalName)) return;
-    QString propName=info.sig2Prop[signalName];
-    QMetaProperty prop=info.properties[propName].prop;
-    if(!prop.isReadable()) return;
-    QVariant value=prop.read(obj);
+void AbstractApi::_setConcurrent(bool concurrent){
+    if(concurrent==_concurrent) return;
+    _concurrent=concurrent;
+    _registry->_concurrentApis+=concurrent ? 1 : -1;
+}
 
-    if(!value.isValid()) return;
-    emit _signalEmitted(methodName, value);
+bool AbstractApi::_isDeferred(const QVariant &result, QFuture<QVariant> *future){
+    return ApiRegistry::_isDeferred(result, future);
 }
+
+QByteArray AbstractApi::_toJson(const QVariant &value){ return ApiRegistry::_toJson(value); }
+
+QByteArray AbstractApi::_toCbor(const QVariant &value){ return ApiRegistry::_toCbor(value); }
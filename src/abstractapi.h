@@ -3,10 +3,7 @@
 
 #include <QObject>
 
-#include <QMetaObject>
-#include <QMetaClassInfo>
-#include <QMetaProperty>
-#include <QDebug>
+#include "apiregistry.h"
 
 /**
  * @brief An abstract base class on which to base other APIs.
@@ -17,74 +14,138 @@ class AbstractApi : public QObject
 public:
 
     /// @private
-    typedef struct ApiProp {
-        QMetaProperty prop;
-    } ApiProp;
-
+    typedef ApiRegistry::ApiRoute ApiRoute;
+    /// @private
+    typedef ApiRegistry::ApiObject ApiObject;
     /// @private
-    typedef struct ApiInfo {
-        QString version;
-        QHash<QString,ApiProp> properties;
-        QHash<QString,QString> sig2Prop;
-        QVariant obj;
-    } ApiInfo;
+    typedef ApiRegistry::ApiInfo ApiInfo;
+    /// @private
+    typedef ApiRegistry::ApiCall ApiCall;
 
     /**
      * @brief Construct a AbstractApi object.
      * @param parent A parent object.
      */
     explicit AbstractApi(QObject *parent=0);
+    ~AbstractApi();
+
+    /**
+     * @brief The metrics this API records to, if any.
+     */
+    ApiMetrics *metrics() const;
+
+    /**
+     * @brief Record request, latency and connection statistics.
+     * @details Set the metrics before the API starts serving, they may be shared with other APIs and must outlive
+     * them. Nothing is recorded, or timed, without metrics.
+     * @param metrics The metrics to record to or Q_NULLPTR to stop recording.
+     */
+    virtual void setMetrics(ApiMetrics *metrics);
+
+    /**
+     * @brief The registry of the objects this API exposes.
+     */
+    ApiRegistry *registry() const;
+
+    /**
+     * @brief Expose the objects of a registry which may be shared with other APIs.
+     * @details Every API has a registry of its own to begin with. Set the registry before the API starts serving, it
+     * must outlive the API. Objects added to the API's own registry are no longer exposed once it is replaced.
+     * Objects must be added to the registry before the API starts worker threads.
+     * @param registry The registry or Q_NULLPTR to go back to a registry of the API's own.
+     */
+    void setRegistry(ApiRegistry *registry);
 
     /**
      * @brief Add an object to be exposed to the API.
-     * @details Adds a QObject derived class to the API and exposes its properties. Example usage is as follows:
+     * @details Adds the object to the API's registry(), see ApiRegistry::addObject(). Objects must be added before
+     * any worker threads are started. Example usage is as follows:
      * @code
      * TestClass *testClass=new TestClass; // QObject based class to expose
      * api.addObject<TestClass*>(testClass);
      * @endcode
      * @param obj The object to be exposed.
      */
-    template<class T> void addObject(T obj){
-        const QMetaObject *mobj=obj->metaObject();
-        ApiInfo info;
-        info.obj=QVariant::fromValue(obj);
-
-        info.version="unknown";
-        for(int i=0; i<mobj->classInfoCount(); i++){
-            if(QString(mobj->classInfo(i).name()).toLower()=="version"){
-                info.version=mobj->classInfo(i).value();
-                break;
-            }
-        }
-
-        QString className=mobj->className();
-        for(int i=mobj->propertyOffset(); i<mobj->propertyCount(); i++){
-            ApiProp prop;
-            prop.prop=mobj->property(i);
-            info.properties[mobj->property(i).name()]=prop;
-            if(prop.prop.hasNotifySignal()){
-                info.sig2Prop[prop.prop.notifySignal().name()]=prop.prop.name();
-                _connect(obj, prop.prop.notifySignalIndex());
-            }
-        }
-        _apiInfo[mobj->className()]=info;
-    }
+    template<class T> void addObject(T obj){ _registry->addObject<T>(obj); }
 
 signals:
     /// @private
-    void _signalEmitted(QString methodName, QVariant value);
-
-private slots:
-    void _changedSignal();
-
-private:
-    void _connect(QObject* obj, int index);
+    void _signalEmitted(QString methodName, QStringList topics, QVariant value);
+    /// @private
+    void _routesNotified(int notifier);
 
 protected:
     /// @private
-    QHash<QString, ApiInfo> _apiInfo;
-};
+    virtual ApiMetrics::Api _metricsApi() const=0;
+    /// @private
+    const ApiRoute *_route(const char *name, int len) const;
+    /// @private
+    const ApiRoute *_route(const QString &name) const;
+    /// @private
+    const ApiObject *_object(const char *name, int len) const;
+    /// @private
+    const ApiObject *_object(const QString &name) const;
+    /// @private
+    const ApiCall *_call(const char *name, int len) const;
+    /// @private
+    const ApiCall *_call(const QString &name) const;
+    /// @private
+    const ApiInfo *_classInfo(const QString &className) const;
+    /// @private
+    int _routeCount() const;
+    /// @private
+    const ApiRoute *_routeAt(int id) const;
+    /// @private
+    const QVector<int> &_notifiedRoutes(int notifier) const;
+    /// @private
+    int _metricsSlot(const ApiRoute *route) const;
+    /// @private
+    int _metricsSlot(const ApiObject *object) const;
+    /// @private
+    int _metricsSlot(const ApiCall *call) const;
+    /// @private
+    QVariant _read(QObject *obj, const QMetaProperty &prop) const;
+    /// @private
+    bool _write(QObject *obj, const QMetaProperty &prop, const QVariant &value) const;
+    /// @private
+    QFuture<QVariant> _readDeferred(const ApiRoute *route) const;
+    /// @private
+    QFuture<QVariant> _writeDeferred(const ApiRoute *route, const QVariant &value) const;
+    /// @private
+    QByteArray _readText(const ApiRoute *route, quint64 *version=Q_NULLPTR) const;
+    /// @private
+    quint64 _version(const ApiRoute *route) const;
+    /// @private
+    QByteArray _readJson(const ApiRoute *route) const;
+    /// @private
+    bool _cachedJson(const ApiRoute *route, QByteArray *json) const;
+    /// @private
+    QByteArray _readCbor(const ApiRoute *route) const;
+    /// @private
+    QByteArray _readObjectJson(const ApiObject *object) const;
+    /// @private
+    QVariantMap _readObject(const ApiObject *object) const;
+    /// @private
+    bool _writeObject(const ApiObject *object, const QVariantMap &values) const;
+    /// @private
+    bool _invoke(const ApiCall *call, const QVariantList &args, QVariant *result) const;
+    /// @private
+    bool _invoke(const ApiCall *call, const QVariantMap &args, QVariant *result) const;
+    /// @private
+    void _setConcurrent(bool concurrent);
+    /// @private
+    static bool _isDeferred(const QVariant &result, QFuture<QVariant> *future);
+    /// @private
+    static QByteArray _toJson(const QVariant &value);
+    /// @private
+    static QByteArray _toCbor(const QVariant &value);
 
-#endif // ABSTRACTAPI_H
+    /// @private
+    ApiMetrics *_metrics;
 
+private:
+    ApiRegistry *_registry;
+    bool _concurrent;
+};
 
+#endif // ABSTRACTAPI_H
@@ -0,0 +1,306 @@
+#include "apimetrics.h"
+
+#include <QMutexLocker>
+#include <QDebug>
+
+// Upper bounds of the latency buckets, the last bucket is +Inf
+static const qint64 BucketBounds[]={
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000
+};
+static const char *const BucketLabels[]={
+    "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025", "0.0005",
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "+Inf"
+};
+static const char *const ApiLabels[]={ "rest", "websocket" };
+static const char *const StageLabels[]={ "parse", "dispatch", "read", "write", "invoke", "serialize", "send" };
+static const char *const RejectionLabels[]={ "max_connections", "max_per_host" };
+static const char *const EvictionLabels[]={ "header_timeout", "idle_timeout", "too_large" };
+static const int RpcErrorCodes[]={ -32700, -32600, -32601, -32602, -32603, -32000 };
+
+static void appendHeader(QByteArray &out, const char *name, const char *type, const char *help){
+    out+="# HELP ";
+    out+=name;
+    out+=' ';
+    out+=help;
+    out+="\n# TYPE ";
+    out+=name;
+    out+=' ';
+    out+=type;
+    out+='\n';
+}
+
+// Label values are quoted, so backslashes, quotes and line feeds in user chosen names must be escaped
+static QByteArray escapeLabel(const QByteArray &value){
+    QByteArray escaped;
+    escaped.reserve(value.size());
+    for(char c : value){
+        if(c=='\\') escaped+="\\\\";
+        else if(c=='"') escaped+="\\\"";
+        else if(c=='\n') escaped+="\\n";
+        else escaped+=c;
+    }
+    return escaped;
+}
+
+static void appendSample(QByteArray &out, const char *name, const QByteArray &labels, quint64 value){
+    out+=name;
+    if(!labels.isEmpty()) out+="{"+labels+"}";
+    out+=' ';
+    out+=QByteArray::number(value);
+    out+='\n';
+}
+
+ApiMetrics::ApiMetrics(): _routesExhausted(false){}
+
+ApiMetrics::~ApiMetrics(){
+    for(int i=0; i<MaxShards; i++){
+        Shard *shard=_shards[i].load();
+        if(!shard) continue;
+        for(int j=0; j<MaxRoutePages; j++){
+            RoutePage *page=shard->routes[j].load();
+            if(!page) continue;
+            for(int k=0; k<RouteBlocksPerPage; k++) delete[] page->blocks[k].load();
+            delete page;
+        }
+        delete shard;
+    }
+}
+
+int ApiMetrics::registerRoute(Api api, const QByteArray &name){
+    QMutexLocker locker(&_lock);
+
+    // Registering again, for another object of the same name or from another setMetrics(), reuses the series
+    auto it=_routeSlots[api].constFind(name);
+    if(it!=_routeSlots[api].constEnd()) return it.value();
+
+    if(_routeNames.size()>=RouteBlockSize*RouteBlocksPerPage*MaxRoutePages){
+        if(!_routesExhausted) qWarning() << "ApiMetrics: too many routes, statistics are not recorded from" << name;
+        _routesExhausted=true;
+        return -1;
+    }
+    _routeApis << api;
+    _routeNames << escapeLabel(name);
+    _routeSlots[api].insert(name, _routeNames.size()-1);
+    return _routeNames.size()-1;
+}
+
+void ApiMetrics::recordStage(Stage stage, qint64 nsecs){ _record(_shard()->stages[stage], nsecs); }
+
+void ApiMetrics::recordRoute(int slot, qint64 nsecs, bool error){
+    if(slot<0) return;
+    RouteStats *route=_route(_shard(), slot);
+    _record(route->latency, nsecs);
+    if(error) _add(route->errors);
+}
+
+void ApiMetrics::recordHttpStatus(int code){
+    if(code>=0 && code<HttpCodeCount) _add(_shard()->http[code]);
+}
+
+void ApiMetrics::recordRpcError(int code){
+    int i=0;
+    while(i<RpcErrorCount-1 && RpcErrorCodes[i]!=code) i++;
+    _add(_shard()->rpc[i]);
+}
+
+void ApiMetrics::connectionOpened(Api api){ _shard()->connections[api].fetchAndAddRelaxed(1); }
+
+void ApiMetrics::connectionClosed(Api api){ _shard()->connections[api].fetchAndAddRelaxed(-1); }
+
+void ApiMetrics::connectionRejected(Api api, Rejection reason){ _add(_shard()->rejected[api][reason]); }
+
+void ApiMetrics::connectionEvicted(Api api, Eviction reason){ _add(_shard()->evicted[api][reason]); }
+
+void ApiMetrics::notificationsSent(int count){ _add(_shard()->sent, quint64(count)); }
+
+void ApiMetrics::notificationsDropped(int count){ _add(_shard()->dropped, quint64(count)); }
+
+void ApiMetrics::setOutboundBytes(qint64 bytes){ _outboundBytes.store(bytes); }
+
+ApiMetrics::Shard *ApiMetrics::_shard(){
+    int &index=_shardIndex.localData();
+    if(index) return _shards[index-1].load();
+
+    // First use on this thread, threads beyond MaxShards share, which the atomic counters tolerate
+    int i=(_shardCount.fetchAndAddRelaxed(1))%MaxShards;
+    Shard *shard=_shards[i].loadAcquire();
+    if(!shard){
+        shard=new Shard;
+        if(!_shards[i].testAndSetOrdered(Q_NULLPTR, shard)){
+            delete shard;
+            shard=_shards[i].loadAcquire();
+        }
+    }
+    index=i+1;
+    return shard;
+}
+
+ApiMetrics::RouteStats *ApiMetrics::_route(Shard *shard, int slot){
+    // Pages and blocks are only allocated for the routes a thread actually serves
+    QAtomicPointer<RoutePage> &pagePointer=shard->routes[slot/(RouteBlockSize*RouteBlocksPerPage)];
+    RoutePage *page=pagePointer.loadAcquire();
+    if(!page){
+        RoutePage *allocated=new RoutePage;
+        if(pagePointer.testAndSetOrdered(Q_NULLPTR, allocated)) page=allocated;
+        else {
+            delete allocated;
+            page=pagePointer.loadAcquire();
+        }
+    }
+
+    QAtomicPointer<RouteStats> &block=page->blocks[(slot/RouteBlockSize)%RouteBlocksPerPage];
+    RouteStats *routes=block.loadAcquire();
+    if(!routes){
+        RouteStats *allocated=new RouteStats[RouteBlockSize];
+        if(block.testAndSetOrdered(Q_NULLPTR, allocated)) routes=allocated;
+        else {
+            delete[] allocated;
+            routes=block.loadAcquire();
+        }
+    }
+    return &routes[slot%RouteBlockSize];
+}
+
+const ApiMetrics::RouteStats *ApiMetrics::_findRoute(const Shard *shard, int slot){
+    const RoutePage *page=shard->routes[slot/(RouteBlockSize*RouteBlocksPerPage)].loadAcquire();
+    if(!page) return Q_NULLPTR;
+    const RouteStats *routes=page->blocks[(slot/RouteBlockSize)%RouteBlocksPerPage].loadAcquire();
+    return routes ? &routes[slot%RouteBlockSize] : Q_NULLPTR;
+}
+
+void ApiMetrics::_record(Histogram &histogram, qint64 nsecs){
+    int i=0;
+    while(i<BucketCount-1 && nsecs>BucketBounds[i]) i++;
+    _add(histogram.buckets[i]);
+    _add(histogram.sum, quint64(qMax(Q_INT64_C(0), nsecs)));
+}
+
+void ApiMetrics::_add(Counter &counter, quint64 value){ counter.fetchAndAddRelaxed(value); }
+
+QByteArray ApiMetrics::toPrometheus() const {
+    QVector<Api> routeApis;
+    QVector<QByteArray> routeNames;
+    {
+        QMutexLocker locker(&_lock);
+        routeApis=_routeApis;
+        routeNames=_routeNames;
+    }
+
+    QVector<const Shard*> shards;
+    for(int i=0; i<MaxShards; i++){
+        const Shard *shard=_shards[i].loadAcquire();
+        if(shard) shards << shard;
+    }
+
+    QByteArray out;
+    out.reserve(4096);
+
+    // Per route request counts, errors and latency
+    QByteArray requests, errors, durations;
+    for(int slot=0; slot<routeNames.size(); slot++){
+        quint64 buckets[BucketCount]={0}, sum=0, errorCount=0;
+        foreach(const Shard *shard, shards){
+            const RouteStats *route=_findRoute(shard, slot);
+            if(!route) continue;
+            for(int i=0; i<BucketCount; i++) buckets[i]+=route->latency.buckets[i].load();
+            sum+=route->latency.sum.load();
+            errorCount+=route->errors.load();
+        }
+        quint64 count=0;
+        for(int i=0; i<BucketCount; i++) count+=buckets[i];
+        if(!count) continue;
+
+        QByteArray labels=QByteArray("api=\"")+ApiLabels[routeApis.at(slot)]+"\",route=\""+routeNames.at(slot)+"\"";
+        appendSample(requests, "qwebapi_requests_total", labels, count);
+        appendSample(errors, "qwebapi_request_errors_total", labels, errorCount);
+        quint64 cumulative=0;
+        for(int i=0; i<BucketCount; i++){
+            cumulative+=buckets[i];
+            appendSample(durations, "qwebapi_request_duration_seconds_bucket", labels+",le=\""+BucketLabels[i]+"\"", cumulative);
+        }
+        durations+="qwebapi_request_duration_seconds_sum{"+labels+"} "+QByteArray::number(sum/1e9, 'g', 9)+"\n";
+        appendSample(durations, "qwebapi_request_duration_seconds_count", labels, count);
+    }
+    appendHeader(out, "qwebapi_requests_total", "counter", "Requests handled per route.");
+    out+=requests;
+    appendHeader(out, "qwebapi_request_errors_total", "counter", "Requests per route which failed.");
+    out+=errors;
+    appendHeader(out, "qwebapi_request_duration_seconds", "histogram", "Time taken to handle a request per route.");
+    out+=durations;
+
+    appendHeader(out, "qwebapi_stage_duration_seconds", "histogram", "Time spent in each stage of request handling.");
+    for(int stage=0; stage<StageCount; stage++){
+        quint64 buckets[BucketCount]={0}, sum=0, count=0;
+        foreach(const Shard *shard, shards){
+            for(int i=0; i<BucketCount; i++) buckets[i]+=shard->stages[stage].buckets[i].load();
+            sum+=shard->stages[stage].sum.load();
+        }
+        QByteArray labels=QByteArray("stage=\"")+StageLabels[stage]+"\"";
+        for(int i=0; i<BucketCount; i++){
+            count+=buckets[i];
+            appendSample(out, "qwebapi_stage_duration_seconds_bucket", labels+",le=\""+BucketLabels[i]+"\"", count);
+        }
+        out+="qwebapi_stage_duration_seconds_sum{"+labels+"} "+QByteArray::number(sum/1e9, 'g', 9)+"\n";
+        appendSample(out, "qwebapi_stage_duration_seconds_count", labels, count);
+    }
+
+    appendHeader(out, "qwebapi_http_responses_total", "counter", "HTTP responses sent per status code.");
+    for(int code=0; code<HttpCodeCount; code++){
+        quint64 count=0;
+        foreach(const Shard *shard, shards) count+=shard->http[code].load();
+        if(count) appendSample(out, "qwebapi_http_responses_total", "code=\""+QByteArray::number(code)+"\"", count);
+    }
+
+    appendHeader(out, "qwebapi_jsonrpc_errors_total", "counter", "JSON RPC error responses sent per error code.");
+    for(int i=0; i<RpcErrorCount; i++){
+        quint64 count=0;
+        foreach(const Shard *shard, shards) count+=shard->rpc[i].load();
+        if(count) appendSample(out, "qwebapi_jsonrpc_errors_total", "code=\""+QByteArray::number(RpcErrorCodes[i])+"\"", count);
+    }
+
+    appendHeader(out, "qwebapi_open_connections", "gauge", "Connections currently open.");
+    for(int api=0; api<ApiCount; api++){
+        qint64 count=0;
+        foreach(const Shard *shard, shards) count+=shard->connections[api].load();
+        appendSample(out, "qwebapi_open_connections", QByteArray("api=\"")+ApiLabels[api]+"\"", quint64(qMax(Q_INT64_C(0), count)));
+    }
+
+    appendHeader(out, "qwebapi_connections_rejected_total", "counter", "Connections refused on arrival per limit exceeded.");
+    for(int api=0; api<ApiCount; api++){
+        for(int reason=0; reason<RejectionCount; reason++){
+            quint64 count=0;
+            foreach(const Shard *shard, shards) count+=shard->rejected[api][reason].load();
+            if(count) appendSample(out, "qwebapi_connections_rejected_total",
+                                   QByteArray("api=\"")+ApiLabels[api]+"\",reason=\""+RejectionLabels[reason]+"\"", count);
+        }
+    }
+
+    appendHeader(out, "qwebapi_connections_evicted_total", "counter", "Connections closed by the server per reason.");
+    for(int api=0; api<ApiCount; api++){
+        for(int reason=0; reason<EvictionCount; reason++){
+            quint64 count=0;
+            foreach(const Shard *shard, shards) count+=shard->evicted[api][reason].load();
+            if(count) appendSample(out, "qwebapi_connections_evicted_total",
+                                   QByteArray("api=\"")+ApiLabels[api]+"\",reason=\""+EvictionLabels[reason]+"\"", count);
+        }
+    }
+
+    quint64 sent=0, dropped=0;
+    foreach(const Shard *shard, shards){
+        sent+=shard->sent.load();
+        dropped+=shard->dropped.load();
+    }
+    appendHeader(out, "qwebapi_notifications_sent_total", "counter", "Notifications sent to clients.");
+    appendSample(out, "qwebapi_notifications_sent_total", QByteArray(), sent);
+    appendHeader(out, "qwebapi_notifications_dropped_total", "counter", "Notifications dropped, or superseded while held back, for slow clients.");
+    appendSample(out, "qwebapi_notifications_dropped_total", QByteArray(), dropped);
+
+    // Only the WebSocketApi samples what is queued for its clients, a REST series would always read 0
+    appendHeader(out, "qwebapi_outbound_queued_bytes", "gauge", "Bytes waiting to be written to WebSocket clients.");
+    appendSample(out, "qwebapi_outbound_queued_bytes", QByteArray("api=\"")+ApiLabels[WebSocket]+"\"",
+                 quint64(qMax(Q_INT64_C(0), _outboundBytes.load())));
+    return out;
+}
@@ -0,0 +1,151 @@
+#ifndef APIMETRICS_H
+#define APIMETRICS_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QThreadStorage>
+
+/**
+ * @brief Request, latency and connection statistics shared by any number of APIs.
+ * @details Metrics are opt-in, nothing is recorded until an ApiMetrics is given to an API with
+ * AbstractApi::setMetrics(). A RestApi with metrics serves them in the Prometheus text format on its metricsPath().
+ * @code
+ * ApiMetrics metrics;
+ * restApi.setMetrics(&metrics);
+ * socketApi.setMetrics(&metrics);
+ * @endcode
+ *
+ * Every thread which records gets its own set of counters, so recording never takes a lock and never contends with
+ * another thread. The sets are only summed when the metrics are rendered.
+ */
+class ApiMetrics
+{
+public:
+    /// @brief The front end a measurement came from.
+    enum Api { Rest, WebSocket, ApiCount };
+
+    /// @brief The stage of request handling a duration was measured over.
+    enum Stage {
+        Parse,     ///< Parsing an HTTP request or JSON RPC message.
+        Dispatch,  ///< Routing and handling a request, including any of the stages below.
+        Read,      ///< Reading a property on the thread of its object.
+        Write,     ///< Writing a property on the thread of its object.
+        Invoke,    ///< Calling a method on the thread of its object.
+        Serialize, ///< Serialising a value or notification.
+        Send,      ///< Assembling and queueing a response or notification for writing.
+        StageCount
+    };
+
+    /// @brief Why a connection was refused as soon as it was accepted.
+    enum Rejection {
+        TooManyConnections, ///< The API already had maxConnections open.
+        TooManyFromHost,    ///< The client's address already had maxConnectionsPerHost open.
+        RejectionCount
+    };
+
+    /// @brief Why an open connection was closed by the server.
+    enum Eviction {
+        HeaderTimeout,      ///< A request, or WebSocket handshake, was not received in full in time.
+        IdleTimeout,        ///< Nothing was received for too long.
+        RequestTooLarge,    ///< A request or message exceeded the size limits.
+        EvictionCount
+    };
+
+    ApiMetrics();
+    ~ApiMetrics();
+
+    /**
+     * @brief Render every metric in the Prometheus text exposition format.
+     */
+    QByteArray toPrometheus() const;
+
+    /// @private
+    /// @brief The slot to record a route to, the same one every time a name is registered for api.
+    int registerRoute(Api api, const QByteArray &name);
+    /// @private
+    void recordStage(Stage stage, qint64 nsecs);
+    /// @private
+    void recordRoute(int slot, qint64 nsecs, bool error);
+    /// @private
+    void recordHttpStatus(int code);
+    /// @private
+    void recordRpcError(int code);
+    /// @private
+    void connectionOpened(Api api);
+    /// @private
+    void connectionClosed(Api api);
+    /// @private
+    void connectionRejected(Api api, Rejection reason);
+    /// @private
+    void connectionEvicted(Api api, Eviction reason);
+    /// @private
+    void notificationsSent(int count);
+    /// @private
+    void notificationsDropped(int count);
+    /// @private
+    /// @brief The bytes queued for WebSocket clients, sampled by the WebSocketApi.
+    void setOutboundBytes(qint64 bytes);
+
+private:
+    enum {
+        BucketCount=17,      // 16 bounds and +Inf
+        MaxShards=256,
+        RouteBlockSize=64,
+        RouteBlocksPerPage=256,
+        MaxRoutePages=256,   // Room for 4M routes, pages and blocks are only allocated as routes are served
+        HttpCodeCount=600,
+        RpcErrorCount=6
+    };
+
+    typedef QAtomicInteger<quint64> Counter;
+
+    typedef struct Histogram {
+        Counter buckets[BucketCount];
+        Counter sum;
+    } Histogram;
+
+    typedef struct RouteStats {
+        Histogram latency;
+        Counter errors;
+    } RouteStats;
+
+    typedef struct RoutePage {
+        QAtomicPointer<RouteStats> blocks[RouteBlocksPerPage];
+    } RoutePage;
+
+    // One per recording thread, only ever written by that thread unless there are more than MaxShards threads
+    typedef struct Shard {
+        Histogram stages[StageCount];
+        Counter http[HttpCodeCount];
+        Counter rpc[RpcErrorCount];
+        QAtomicInteger<qint64> connections[ApiCount];
+        Counter rejected[ApiCount][RejectionCount];
+        Counter evicted[ApiCount][EvictionCount];
+        Counter sent;
+        Counter dropped;
+        QAtomicPointer<RoutePage> routes[MaxRoutePages];
+    } Shard;
+
+    Shard *_shard();
+    static RouteStats *_route(Shard *shard, int slot);
+    static const RouteStats *_findRoute(const Shard *shard, int slot);
+    static void _record(Histogram &histogram, qint64 nsecs);
+    static void _add(Counter &counter, quint64 value=1);
+
+    QThreadStorage<int> _shardIndex;
+    QAtomicPointer<Shard> _shards[MaxShards];
+    QAtomicInt _shardCount;
+    QAtomicInteger<qint64> _outboundBytes;
+
+    mutable QMutex _lock;
+    QVector<Api> _routeApis;
+    QVector<QByteArray> _routeNames;       // Escaped for use as a label value
+    QHash<QByteArray, int> _routeSlots[ApiCount];
+    bool _routesExhausted;
+};
+
+#endif // APIMETRICS_H
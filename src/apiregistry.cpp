@@ -0,0 +1,702 @@
+#include "apiregistry.h"
+
+#include <QString>
+#include <QThread>
+#include <QCborValue>
+#include <QElapsedTimer>
+#include <QVarLengthArray>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <limits>
+
+#include "jsonwriter.h"
+
+// JSON has a single number type, so whole numbers arrive as doubles and are only accepted where they fit exactly
+template<typename T> static bool convertInteger(QVariant *value, int type){
+    if(value->userType()==type) return true;
+    if(value->userType()!=QMetaType::Double) return value->convert(type);
+    double number=value->toDouble();
+    if(!(number>=double(std::numeric_limits<T>::min()) && number<double(std::numeric_limits<T>::max())+1.0)) return false;
+    if(double(T(number))!=number) return false;
+    *value=QVariant::fromValue(T(number));
+    return true;
+}
+
+static bool convertDouble(QVariant *value, int type){
+    if(value->userType()==type) return true;
+    bool ok=false;
+    double number=value->toDouble(&ok);
+    if(!ok) return false;
+    *value=number;
+    return true;
+}
+
+static bool convertVariant(QVariant *value, int type){
+    Q_UNUSED(value)
+    Q_UNUSED(type)
+    return true;
+}
+
+static bool convertOther(QVariant *value, int type){
+    return value->userType()==type || value->convert(type);
+}
+
+/**
+ * @private
+ * @brief Receives every NOTIFY signal on behalf of an ApiRegistry.
+ * @details Each signal of each object is connected to its own slot index beyond those QObject declares, which is the
+ * index of its entry in the registry's notifier table. So the entry is found without sender() or any lookup, and
+ * the signal's arguments arrive with it. The relay lives on the registry's thread, so signals from objects on other
+ * threads are queued to it just as they would be to the registry itself.
+ */
+class ApiRelay : public QObject
+{
+public:
+    explicit ApiRelay(ApiRegistry *registry): QObject(registry), _registry(registry){}
+
+    static int slotIndex(int id){ return QObject::staticMetaObject.methodCount()+id; }
+
+    int qt_metacall(QMetaObject::Call call, int id, void **args) override {
+        id=QObject::qt_metacall(call, id, args);
+        if(id<0 || call!=QMetaObject::InvokeMetaMethod) return id;
+        _registry->_notified(id, args);
+        return -1;
+    }
+
+private:
+    ApiRegistry *_registry;
+};
+
+ApiRegistry::ApiRegistry(QObject *parent)
+    : QObject(parent), _relay(new ApiRelay(this)), _threadPool(new QThreadPool(this)), _metrics(Q_NULLPTR),
+      _concurrentApis(0)
+{
+    // Registered by name so that methods declared to return it are recognised when their class is introspected
+    qRegisterMetaType<QFuture<QVariant> >("QFuture<QVariant>");
+    for(int i=0; i<ApiMetrics::ApiCount; i++) _apiMetrics[i]=Q_NULLPTR;
+}
+
+ApiRegistry::~ApiRegistry(){
+    // Work still running on the pool may use the routes
+    _threadPool->waitForDone();
+    foreach(const ApiRoute &route, _routes) delete route.cache;
+}
+
+QThreadPool *ApiRegistry::threadPool() const { return _threadPool; }
+
+void ApiRegistry::_setMetrics(ApiMetrics::Api api, ApiMetrics *metrics){
+    _apiMetrics[api]=metrics;
+    for(int i=0; i<_routes.size(); i++)
+        _routes[i].metricsSlots[api]=metrics ? metrics->registerRoute(api, _routes[i].name) : -1;
+    for(int i=0; i<_objects.size(); i++)
+        _objects[i].metricsSlots[api]=metrics ? metrics->registerRoute(api, _objects[i].name+".*") : -1;
+    for(int i=0; i<_calls.size(); i++)
+        _calls[i].metricsSlots[api]=metrics ? metrics->registerRoute(api, _calls[i].name) : -1;
+
+    // Reads, writes and serialisation happen once for every API, so they are timed once too
+    _metrics=Q_NULLPTR;
+    for(int i=0; i<ApiMetrics::ApiCount && !_metrics; i++) _metrics=_apiMetrics[i];
+}
+
+void ApiRegistry::_addObject(QObject *obj){
+    // Workers hold pointers into the routes and their caches, which adding or replacing an object may move or free
+    if(_concurrentApis){
+        qWarning() << "ApiRegistry: not adding" << obj << "objects must be added before worker threads are started";
+        return;
+    }
+    // Routes and topics are split on these, such a name would be taken for a property or a wildcard
+    if(obj->objectName().contains('.') || obj->objectName().contains('/')){
+        qWarning() << "ApiRegistry: not adding" << obj << "object names must not contain '.' or '/'";
+        return;
+    }
+    _threadPool->waitForDone();
+
+    const QMetaObject *mobj=obj->metaObject();
+    const ApiInfo &info=_addInfo(mobj);
+
+    ApiObject object;
+    object.name=mobj->className();
+    if(!obj->objectName().isEmpty()) object.name+='.'+obj->objectName().toUtf8();
+    object.obj=obj;
+
+    int offset=mobj->propertyOffset();
+    object.routes.reserve(info.propNames.size());
+    for(int i=0; i<info.propNames.size(); i++){
+        const QByteArray &name=info.propNames.at(i);
+        bool threadSafe=info.threadSafe.contains(name);
+        object.routes << _addRoute(object.name+'.'+name, obj, mobj->property(offset+i), threadSafe);
+    }
+    foreach(const ApiMethod &method, info.methods)
+        _addCall(object.name+'.'+method.name, obj, method, info.threadSafe.contains(method.name));
+
+    // Every notification of the object shares its wildcard topics, so they are not built per notification
+    QStringList topics;
+    if(!obj->objectName().isEmpty()) topics << QString::fromUtf8(object.name+".*");
+    topics << QString::fromUtf8(QByteArray(mobj->className())+".*");
+
+    // One connection per NOTIFY signal, however many properties share it
+    foreach(const ApiSignal &signal, info.notifySignals){
+        ApiNotifier notifier;
+        notifier.methodName=QString::fromUtf8(object.name+'.'+signal.name);
+        notifier.topics=topics;
+        notifier.obj=obj;
+        foreach(int prop, signal.props) notifier.routes << object.routes.at(prop);
+        notifier.argType=signal.argType;
+
+        // Only the argument carrying the value is queued across threads, so signals with other arguments of
+        // unregistered types still arrive. Qt takes ownership of the types.
+        int *types=new int[2];
+        types[0]=signal.argType;
+        types[1]=0;
+        int id=_notifiers.size();
+        notifier.connection=QMetaObject::connect(obj, signal.index, _relay, ApiRelay::slotIndex(id), Qt::AutoConnection, types);
+        _notifiers << notifier;
+        object.notifiers << id;
+    }
+
+    int id=_objectTable.find(object.name.constData(), object.name.size());
+    if(id>=0){
+        qWarning() << "Replacing" << object.name << "with another object of the same class and name";
+        for(int i=0; i<ApiMetrics::ApiCount; i++) object.metricsSlots[i]=_objects.at(id).metricsSlots[i];
+
+        // The routes now belong to the new object, the old one must no longer update them
+        foreach(int notifier, _objects.at(id).notifiers){
+            QObject::disconnect(_notifiers.at(notifier).connection);
+            _notifiers[notifier].routes.clear();
+        }
+        _objects[id]=object;
+    }
+    else {
+        for(int i=0; i<ApiMetrics::ApiCount; i++){
+            ApiMetrics *metrics=_apiMetrics[i];
+            object.metricsSlots[i]=metrics ? metrics->registerRoute(ApiMetrics::Api(i), object.name+".*") : -1;
+        }
+        _objectTable.insert(object.name, _objects.size());
+        _objects << object;
+    }
+}
+
+const ApiRegistry::ApiInfo &ApiRegistry::_addInfo(const QMetaObject *mobj){
+    QString className=mobj->className();
+    auto it=_apiInfo.constFind(className);
+    if(it!=_apiInfo.constEnd()) return it.value();
+
+    ApiInfo info;
+    info.version="unknown";
+    for(int i=0; i<mobj->classInfoCount(); i++){
+        QString name=QString(mobj->classInfo(i).name()).toLower();
+        if(name=="version") info.version=mobj->classInfo(i).value();
+        else if(name=="threadsafe"){
+            foreach(const QByteArray &member, QByteArray(mobj->classInfo(i).value()).split(','))
+                if(!member.trimmed().isEmpty()) info.threadSafe << member.trimmed();
+        }
+    }
+
+    for(int i=mobj->propertyOffset(); i<mobj->propertyCount(); i++){
+        ApiProp prop;
+        prop.prop=mobj->property(i);
+        info.properties[prop.prop.name()]=prop;
+        info.propNames << prop.prop.name();
+        if(!prop.prop.hasNotifySignal()) continue;
+        info.sig2Prop[prop.prop.notifySignal().name()]=prop.prop.name();
+
+        int index=prop.prop.notifySignalIndex(), j=0;
+        while(j<info.notifySignals.size() && info.notifySignals.at(j).index!=index) j++;
+        if(j==info.notifySignals.size()){
+            ApiSignal signal;
+            signal.index=index;
+            signal.name=prop.prop.notifySignal().name();
+            signal.argType=0;
+            info.notifySignals << signal;
+        }
+        info.notifySignals[j].props << info.propNames.size()-1;
+    }
+
+    // A signal which notifies a single property and whose first argument has the property's type carries the new
+    // value itself, such as valueChanged(int value), so the property need not be read again
+    for(int i=0; i<info.notifySignals.size(); i++){
+        ApiSignal &signal=info.notifySignals[i];
+        if(signal.props.size()!=1) continue;
+        QMetaMethod method=mobj->method(signal.index);
+        QMetaProperty prop=mobj->property(mobj->propertyOffset()+signal.props.first());
+        int type=prop.userType();
+        if(prop.isReadable() && method.parameterCount()>0 && method.parameterType(0)==type && type!=QMetaType::UnknownType)
+            signal.argType=type;
+    }
+
+    // Everything a call needs is worked out here, so calls never look up a method or parse a signature
+    for(int i=mobj->methodOffset(); i<mobj->methodCount(); i++){
+        QMetaMethod method=mobj->method(i);
+        if(method.access()!=QMetaMethod::Public) continue;
+        if(method.methodType()!=QMetaMethod::Slot && method.methodType()!=QMetaMethod::Method) continue;
+
+        ApiSignature signature;
+        signature.index=i;
+        signature.returnType=method.returnType();
+        bool known=signature.returnType!=QMetaType::UnknownType;
+        QList<QByteArray> names=method.parameterNames();
+        for(int j=0; j<method.parameterCount(); j++){
+            int type=method.parameterType(j);
+            if(type==QMetaType::UnknownType) known=false;
+            signature.types << type;
+            signature.names << QString::fromUtf8(names.value(j));
+            signature.converters << _converter(type);
+        }
+        if(!known) continue;
+
+        int j=0;
+        while(j<info.methods.size() && info.methods.at(j).name!=method.name()) j++;
+        if(j==info.methods.size()){
+            ApiMethod apiMethod;
+            apiMethod.name=method.name();
+            info.methods << apiMethod;
+        }
+        info.methods[j].signatures << signature;
+    }
+    return _apiInfo.insert(className, info).value();
+}
+
+int ApiRegistry::_addRoute(const QByteArray &name, QObject *obj, const QMetaProperty &prop, bool threadSafe){
+    ApiRoute route;
+    route.name=name;
+    route.obj=obj;
+    route.prop=prop;
+    route.cache=Q_NULLPTR;
+    route.threadSafe=threadSafe;
+
+    // Properties with a NOTIFY signal are served from a cache which _notified() keeps up to date. It is only
+    // filled on first use, so adding thousands of objects never waits on a read or serialises a value.
+    if(prop.hasNotifySignal() && prop.isReadable()){
+        route.cache=new ApiCache;
+        route.cache->version=0;
+    }
+
+    int id=_routeTable.find(name.constData(), name.size());
+    if(id>=0){
+        delete _routes[id].cache;
+        for(int i=0; i<ApiMetrics::ApiCount; i++) route.metricsSlots[i]=_routes.at(id).metricsSlots[i];
+        _routes[id]=route;
+        return id;
+    }
+
+    for(int i=0; i<ApiMetrics::ApiCount; i++){
+        ApiMetrics *metrics=_apiMetrics[i];
+        route.metricsSlots[i]=metrics ? metrics->registerRoute(ApiMetrics::Api(i), name) : -1;
+    }
+    _routeTable.insert(name, _routes.size());
+    _routes << route;
+    return _routes.size()-1;
+}
+
+void ApiRegistry::_addCall(const QByteArray &name, QObject *obj, const ApiMethod &method, bool threadSafe){
+    ApiCall call;
+    call.name=name;
+    call.obj=obj;
+    call.signatures=method.signatures;
+    call.threadSafe=threadSafe;
+
+    int id=_callTable.find(name.constData(), name.size());
+    if(id>=0){
+        for(int i=0; i<ApiMetrics::ApiCount; i++) call.metricsSlots[i]=_calls.at(id).metricsSlots[i];
+        _calls[id]=call;
+        return;
+    }
+
+    for(int i=0; i<ApiMetrics::ApiCount; i++){
+        ApiMetrics *metrics=_apiMetrics[i];
+        call.metricsSlots[i]=metrics ? metrics->registerRoute(ApiMetrics::Api(i), name) : -1;
+    }
+    _callTable.insert(name, _calls.size());
+    _calls << call;
+}
+
+const ApiRegistry::ApiRoute *ApiRegistry::_route(const char *name, int len) const {
+    int id=_routeTable.find(name, len);
+    return id<0 ? Q_NULLPTR : &_routes.at(id);
+}
+
+const ApiRegistry::ApiRoute *ApiRegistry::_route(const QString &name) const {
+    int id=_routeTable.find(name);
+    return id<0 ? Q_NULLPTR : &_routes.at(id);
+}
+
+const ApiRegistry::ApiObject *ApiRegistry::_object(const char *name, int len) const {
+    int id=_objectTable.find(name, len);
+    return id<0 ? Q_NULLPTR : &_objects.at(id);
+}
+
+const ApiRegistry::ApiObject *ApiRegistry::_object(const QString &name) const {
+    int id=_objectTable.find(name);
+    return id<0 ? Q_NULLPTR : &_objects.at(id);
+}
+
+const ApiRegistry::ApiCall *ApiRegistry::_call(const char *name, int len) const {
+    int id=_callTable.find(name, len);
+    return id<0 ? Q_NULLPTR : &_calls.at(id);
+}
+
+const ApiRegistry::ApiCall *ApiRegistry::_call(const QString &name) const {
+    int id=_callTable.find(name);
+    return id<0 ? Q_NULLPTR : &_calls.at(id);
+}
+
+QVariant ApiRegistry::_read(QObject *obj, const QMetaProperty &prop) const {
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    // Properties are only ever accessed on the thread of the object they belong to
+    QVariant value;
+    if(obj->thread()==QThread::currentThread()) value=prop.read(obj);
+    else QMetaObject::invokeMethod(obj, [&](){ value=prop.read(obj); }, Qt::BlockingQueuedConnection);
+
+    if(_metrics) _metrics->recordStage(ApiMetrics::Read, timer.nsecsElapsed());
+    return value;
+}
+
+bool ApiRegistry::_write(QObject *obj, const QMetaProperty &prop, const QVariant &value) const {
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    bool ok=false;
+    if(obj->thread()==QThread::currentThread()) ok=prop.write(obj, value);
+    else QMetaObject::invokeMethod(obj, [&](){ ok=prop.write(obj, value); }, Qt::BlockingQueuedConnection);
+
+    if(_metrics) _metrics->recordStage(ApiMetrics::Write, timer.nsecsElapsed());
+    return ok;
+}
+
+QVector<QVariant> ApiRegistry::_readAll(QObject *obj, const QVector<QMetaProperty> &props) const {
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    // One trip to the object's thread for the lot rather than one per property
+    QVector<QVariant> values(props.size());
+    auto read=[&](){ for(int i=0; i<props.size(); i++) values[i]=props.at(i).read(obj); };
+    if(obj->thread()==QThread::currentThread()) read();
+    else QMetaObject::invokeMethod(obj, read, Qt::BlockingQueuedConnection);
+
+    if(_metrics) _metrics->recordStage(ApiMetrics::Read, timer.nsecsElapsed());
+    return values;
+}
+
+QFuture<QVariant> ApiRegistry::_readDeferred(const ApiRoute *route) const {
+    QObject *obj=route->obj;
+    QMetaProperty prop=route->prop;
+    return QtConcurrent::run(_threadPool, [this, obj, prop](){
+        QElapsedTimer timer;
+        if(_metrics) timer.start();
+        QVariant value=prop.read(obj);
+        if(_metrics) _metrics->recordStage(ApiMetrics::Read, timer.nsecsElapsed());
+        return value;
+    });
+}
+
+QFuture<QVariant> ApiRegistry::_writeDeferred(const ApiRoute *route, const QVariant &value) const {
+    QObject *obj=route->obj;
+    QMetaProperty prop=route->prop;
+    return QtConcurrent::run(_threadPool, [this, obj, prop, value](){
+        QElapsedTimer timer;
+        if(_metrics) timer.start();
+        bool ok=prop.write(obj, value);
+        if(_metrics) _metrics->recordStage(ApiMetrics::Write, timer.nsecsElapsed());
+        return QVariant(ok);
+    });
+}
+
+void ApiRegistry::_fillCache(const ApiRoute *route) const {
+    {
+        QMutexLocker locker(&route->cache->lock);
+        if(route->cache->version) return;
+    }
+    _updateCache(route->cache, _read(route->obj, route->prop), true);
+}
+
+void ApiRegistry::_fillObject(const ApiObject *object, QVector<QVariant> *uncached) const {
+    // Empty caches and uncached properties are all read in the same trip
+    QVector<QMetaProperty> props;
+    QVector<const ApiRoute*> fill;
+    foreach(int id, object->routes){
+        const ApiRoute &route=_routes.at(id);
+        if(!route.prop.isReadable()) continue;
+        if(route.cache){
+            QMutexLocker locker(&route.cache->lock);
+            if(route.cache->version) continue;
+            fill << &route;
+        }
+        props << route.prop;
+    }
+    if(props.isEmpty()) return;
+
+    QVector<QVariant> values=_readAll(object->obj, props);
+    for(int i=0, next=0; i<props.size(); i++){
+        if(next<fill.size() && fill.at(next)->prop.propertyIndex()==props.at(i).propertyIndex())
+            _updateCache(fill.at(next++)->cache, values.at(i), true);
+        else *uncached << values.at(i);
+    }
+}
+
+QByteArray ApiRegistry::_readText(const ApiRoute *route, quint64 *version) const {
+    if(route->cache){
+        _fillCache(route);
+        QMutexLocker locker(&route->cache->lock);
+        if(version) *version=route->cache->version;
+        return route->cache->text;
+    }
+    if(version) *version=0;
+    return _read(route->obj, route->prop).toString().toUtf8();
+}
+
+quint64 ApiRegistry::_version(const ApiRoute *route) const {
+    if(!route->cache) return 0;
+    _fillCache(route);
+    QMutexLocker locker(&route->cache->lock);
+    return route->cache->version;
+}
+
+QByteArray ApiRegistry::_readJson(const ApiRoute *route) const {
+    if(route->cache){
+        _fillCache(route);
+        QMutexLocker locker(&route->cache->lock);
+        return route->cache->json;
+    }
+    return _toJson(_read(route->obj, route->prop));
+}
+
+bool ApiRegistry::_cachedJson(const ApiRoute *route, QByteArray *json) const {
+    // Never reads the property, a cache which has not been filled yet has nothing to give
+    if(!route->cache) return false;
+    QMutexLocker locker(&route->cache->lock);
+    if(!route->cache->version) return false;
+    *json=route->cache->json;
+    return true;
+}
+
+QByteArray ApiRegistry::_readCbor(const ApiRoute *route) const {
+    if(route->cache){
+        _fillCache(route);
+
+        // Only CBOR clients need this form, so it is produced on first use after each change
+        QMutexLocker locker(&route->cache->lock);
+        if(route->cache->cbor.isEmpty()) route->cache->cbor=_toCbor(route->cache->value);
+        return route->cache->cbor;
+    }
+    return _toCbor(_read(route->obj, route->prop));
+}
+
+QByteArray ApiRegistry::_readObjectJson(const ApiObject *object) const {
+    // Cached properties are already serialised, only the rest have to be read
+    QVector<QVariant> values;
+    _fillObject(object, &values);
+
+    QByteArray json;
+    JsonWriter writer(&json);
+    writer.beginObject();
+    int next=0;
+    foreach(int id, object->routes){
+        const ApiRoute &route=_routes.at(id);
+        if(!route.prop.isReadable()) continue;
+        writer.key(route.prop.name());
+        if(route.cache){
+            QMutexLocker locker(&route.cache->lock);
+            writer.raw(route.cache->json);
+        }
+        else writer.value(values.at(next++));
+    }
+    writer.endObject();
+    return json;
+}
+
+QVariantMap ApiRegistry::_readObject(const ApiObject *object) const {
+    QVector<QVariant> values;
+    _fillObject(object, &values);
+
+    QVariantMap result;
+    int next=0;
+    foreach(int id, object->routes){
+        const ApiRoute &route=_routes.at(id);
+        if(!route.prop.isReadable()) continue;
+        if(route.cache){
+            QMutexLocker locker(&route.cache->lock);
+            result.insert(route.prop.name(), route.cache->value);
+        }
+        else result.insert(route.prop.name(), values.at(next++));
+    }
+    return result;
+}
+
+bool ApiRegistry::_writeObject(const ApiObject *object, const QVariantMap &values) const {
+    // Everything is checked up front, so a request with any bad member writes nothing at all
+    QVector<QMetaProperty> props;
+    QVector<QVariant> converted;
+    for(auto it=values.constBegin(); it!=values.constEnd(); ++it){
+        QByteArray name=object->name+'.'+it.key().toUtf8();
+        const ApiRoute *route=_route(name.constData(), name.size());
+        if(!route || route->obj!=object->obj || !route->prop.isWritable()) return false;
+
+        QVariant value=it.value();
+        if(!value.convert(route->prop.userType())) return false;
+        props << route->prop;
+        converted << value;
+    }
+    if(props.isEmpty()) return true;
+
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    // Written in a single call on the object's thread, so nothing else runs between the writes and each
+    // property's NOTIFY signal is emitted once, by its own setter. Should a setter still refuse its value, the
+    // properties already written are put back, in reverse order, as far as they can be read.
+    bool ok=true;
+    QObject *obj=object->obj;
+    auto write=[&](){
+        QVector<QVariant> previous;
+        previous.reserve(props.size());
+        foreach(const QMetaProperty &prop, props) previous << (prop.isReadable() ? prop.read(obj) : QVariant());
+        for(int i=0; i<props.size(); i++){
+            if(props.at(i).write(obj, converted.at(i))) continue;
+            ok=false;
+            while(--i>=0) if(previous.at(i).isValid()) props.at(i).write(obj, previous.at(i));
+            return;
+        }
+    };
+    if(obj->thread()==QThread::currentThread()) write();
+    else QMetaObject::invokeMethod(obj, write, Qt::BlockingQueuedConnection);
+
+    if(_metrics) _metrics->recordStage(ApiMetrics::Write, timer.nsecsElapsed());
+    return ok;
+}
+
+bool ApiRegistry::_invoke(const ApiCall *call, const QVariantList &args, QVariant *result) const {
+    // Overloads are told apart by the number of arguments, then by whether the arguments convert
+    foreach(const ApiSignature &signature, call->signatures){
+        if(signature.types.size()==args.size() && _invoke(call, signature, args, result)) return true;
+    }
+    return false;
+}
+
+bool ApiRegistry::_invoke(const ApiCall *call, const QVariantMap &args, QVariant *result) const {
+    foreach(const ApiSignature &signature, call->signatures){
+        if(signature.names.size()!=args.size()) continue;
+        QVariantList ordered;
+        foreach(const QString &name, signature.names){
+            auto it=args.constFind(name);
+            if(it==args.constEnd()) break;
+            ordered << it.value();
+        }
+        if(ordered.size()==args.size() && _invoke(call, signature, ordered, result)) return true;
+    }
+    return false;
+}
+
+bool ApiRegistry::_invoke(const ApiCall *call, const ApiSignature &signature, QVariantList args, QVariant *result) const {
+    for(int i=0; i<args.size(); i++)
+        if(!signature.converters.at(i)(&args[i], signature.types.at(i))) return false;
+
+    // Methods marked thread-safe run on the pool, the caller is handed a future of the result instead
+    QVariant value;
+    if(call->threadSafe){
+        QObject *obj=call->obj;
+        value=QVariant::fromValue(QtConcurrent::run(_threadPool, [this, obj, signature, args](){
+            return _metacall(obj, signature, args, true);
+        }));
+    }
+    else value=_metacall(call->obj, signature, args, false);
+    if(result) *result=value;
+    return true;
+}
+
+QVariant ApiRegistry::_metacall(QObject *obj, const ApiSignature &signature, QVariantList args, bool anyThread) const {
+    // The arguments are passed as the generated qt_metacall() expects them, a pointer to each value
+    QVariant value;
+    bool variant=signature.returnType==QMetaType::QVariant, none=signature.returnType==QMetaType::Void;
+    if(!variant && !none) value=QVariant(signature.returnType, Q_NULLPTR);
+    QVarLengthArray<void*, 11> argv(args.size()+1);
+    argv[0]=none ? Q_NULLPTR : variant ? &value : value.data();
+    for(int i=0; i<args.size(); i++)
+        argv[i+1]=signature.types.at(i)==QMetaType::QVariant ? static_cast<void*>(&args[i]) : args[i].data();
+
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    auto call=[&](){ QMetaObject::metacall(obj, QMetaObject::InvokeMetaMethod, signature.index, argv.data()); };
+    if(anyThread || obj->thread()==QThread::currentThread()) call();
+    else QMetaObject::invokeMethod(obj, call, Qt::BlockingQueuedConnection);
+
+    if(_metrics) _metrics->recordStage(ApiMetrics::Invoke, timer.nsecsElapsed());
+    return value;
+}
+
+bool ApiRegistry::_isDeferred(const QVariant &result, QFuture<QVariant> *future){
+    if(result.userType()!=qMetaTypeId<QFuture<QVariant> >()) return false;
+    *future=result.value<QFuture<QVariant> >();
+    return true;
+}
+
+ApiRegistry::ApiConvert ApiRegistry::_converter(int type){
+    switch(type){
+    case QMetaType::Int: return convertInteger<int>;
+    case QMetaType::UInt: return convertInteger<uint>;
+    case QMetaType::LongLong: return convertInteger<qlonglong>;
+    case QMetaType::ULongLong: return convertInteger<qulonglong>;
+    case QMetaType::Double: return convertDouble;
+    case QMetaType::QVariant: return convertVariant;
+    default: return convertOther;
+    }
+}
+
+QByteArray ApiRegistry::_toCbor(const QVariant &value){
+    return QCborValue::fromVariant(value).toCbor();
+}
+
+QByteArray ApiRegistry::_toJson(const QVariant &value){
+    QByteArray json;
+    JsonWriter(&json).value(value);
+    return json;
+}
+
+void ApiRegistry::_updateCache(ApiCache *cache, const QVariant &value, bool fill) const {
+    // Serialise outside the lock, readers only ever wait for the assignments
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    QByteArray text=value.toString().toUtf8(), json=_toJson(value);
+    if(_metrics) _metrics->recordStage(ApiMetrics::Serialize, timer.nsecsElapsed());
+
+    // A fill read before a concurrent change must not overwrite the newer value
+    QMutexLocker locker(&cache->lock);
+    if(fill && cache->version) return;
+    cache->value=value;
+    cache->text=text;
+    cache->json=json;
+    cache->cbor.clear();
+    cache->version++;
+}
+
+void ApiRegistry::_notified(int id, void **args){
+    // The notifier was chosen by the slot the signal was connected to, nothing is looked up by name
+    if(id>=_notifiers.size()) return;
+    const ApiNotifier &notifier=_notifiers.at(id);
+    if(notifier.routes.isEmpty()) return;
+
+    QVariant value;
+    if(notifier.argType && args[1]){
+        if(notifier.argType==QMetaType::QVariant) value=*static_cast<const QVariant*>(args[1]);
+        else value=QVariant(notifier.argType, args[1]);
+        const ApiRoute &route=_routes.at(notifier.routes.first());
+        if(route.cache) _updateCache(route.cache, value);
+    }
+    else {
+        // Every property the signal notifies is refreshed, the JSON RPC notification carries the last
+        foreach(int routeId, notifier.routes){
+            const ApiRoute &route=_routes.at(routeId);
+            if(!route.prop.isReadable()) continue;
+            QVariant read=_read(notifier.obj, route.prop);
+            if(!read.isValid()) continue;
+            if(route.cache) _updateCache(route.cache, read);
+            value=read;
+        }
+    }
+
+    if(!value.isValid()) return;
+    emit _routesNotified(id);
+    emit _signalEmitted(notifier.methodName, notifier.topics, value);
+}
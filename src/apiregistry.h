@@ -0,0 +1,244 @@
+#ifndef APIREGISTRY_H
+#define APIREGISTRY_H
+
+#include <QObject>
+
+#include <QMetaObject>
+#include <QMetaClassInfo>
+#include <QMetaProperty>
+#include <QVector>
+#include <QStringList>
+#include <QMutex>
+#include <QFuture>
+#include <QThreadPool>
+#include <QDebug>
+
+#include "routetable.h"
+#include "apimetrics.h"
+
+class ApiRelay;
+class AbstractApi;
+
+/**
+ * @brief The objects exposed by one or more APIs.
+ * @details Every API has a registry of its own unless it is given a shared one with AbstractApi::setRegistry(). A
+ * registry shared by a RestApi and a WebSocketApi introspects each class, connects each NOTIFY signal and caches
+ * each value once, and every change is dispatched once however many APIs serve it.
+ * @code
+ * ApiRegistry registry;
+ * registry.addObject<TestClass*>(testClass);
+ * restApi.setRegistry(&registry);
+ * socketApi.setRegistry(&registry);
+ * @endcode
+ * The registry must outlive the APIs it is given to.
+ *
+ * Worker threads look routes and cached values up without taking a lock, so objects must be added before any API
+ * using the registry starts worker threads with RestApi::setWorkerThreads(). Objects added after that are refused
+ * with a warning. Adding an object otherwise waits for any work on threadPool() to finish first.
+ */
+class ApiRegistry : public QObject
+{
+    Q_OBJECT
+    friend class AbstractApi;
+    friend class ApiRelay;
+public:
+
+    /// @private
+    typedef struct ApiProp {
+        QMetaProperty prop;
+    } ApiProp;
+
+    /// @private
+    typedef struct ApiCache {
+        QMutex lock;
+        QVariant value;
+        QByteArray text;
+        QByteArray json;
+        QByteArray cbor;
+        quint64 version;
+    } ApiCache;
+
+    /// @private
+    typedef struct ApiRoute {
+        QByteArray name;
+        QObject *obj;
+        QMetaProperty prop;
+        ApiCache *cache;
+        bool threadSafe;       // Read and written on the thread pool rather than the object's thread
+        int metricsSlots[ApiMetrics::ApiCount];
+    } ApiRoute;
+
+    /// @private
+    typedef struct ApiSignal {
+        int index;             // Method index of the NOTIFY signal
+        QByteArray name;
+        QVector<int> props;    // Indexes of the properties it notifies
+        int argType;           // Type of the argument which carries the new value, or 0 if the property must be read
+    } ApiSignal;
+
+    /// @private
+    typedef bool (*ApiConvert)(QVariant *value, int type);
+
+    /// @private
+    typedef struct ApiSignature {
+        int index;                        // Method index, passed straight to QMetaObject::metacall()
+        int returnType;
+        QVector<int> types;               // Type of each parameter
+        QVector<QString> names;           // Name of each parameter, for params given by name
+        QVector<ApiConvert> converters;   // Chosen for each parameter's type when the class is introspected
+    } ApiSignature;
+
+    /// @private
+    typedef struct ApiMethod {
+        QByteArray name;
+        QVector<ApiSignature> signatures; // Overloads, including those Qt adds for default arguments
+    } ApiMethod;
+
+    /// @private
+    typedef struct ApiInfo {
+        QString version;
+        QHash<QString,ApiProp> properties;
+        QHash<QString,QString> sig2Prop;
+        QVector<QByteArray> propNames;        // Every property, in declaration order
+        QVector<ApiSignal> notifySignals;
+        QVector<ApiMethod> methods;           // Public slots and Q_INVOKABLE methods
+        QList<QByteArray> threadSafe;         // Members named by the "ThreadSafe" class info
+    } ApiInfo;
+
+    /// @private
+    typedef struct ApiCall {
+        QByteArray name;       // "Class.method" or "Class.objectName.method"
+        QObject *obj;
+        QVector<ApiSignature> signatures;
+        bool threadSafe;       // Called on the thread pool rather than the object's thread
+        int metricsSlots[ApiMetrics::ApiCount];
+    } ApiCall;
+
+    /// @private
+    typedef struct ApiObject {
+        QByteArray name;       // "Class", or "Class.objectName" for a named instance
+        QObject *obj;
+        QVector<int> routes;   // Route of every property, in declaration order
+        QVector<int> notifiers;
+        int metricsSlots[ApiMetrics::ApiCount];
+    } ApiObject;
+
+    /// @private
+    typedef struct ApiNotifier {
+        QString methodName;    // "Class.signal" or "Class.objectName.signal", built once
+        QStringList topics;    // The wildcard subscriptions matching it, "Class.objectName.*" and "Class.*"
+        QObject *obj;
+        QVector<int> routes;   // Empty once the object has been replaced
+        int argType;
+        QMetaObject::Connection connection;
+    } ApiNotifier;
+
+    /**
+     * @brief Construct an empty ApiRegistry.
+     * @param parent A parent object.
+     */
+    explicit ApiRegistry(QObject *parent=0);
+    ~ApiRegistry();
+
+    /**
+     * @brief Add an object to be exposed by every API using the registry.
+     * @details Adds a QObject derived class and exposes its properties. Example usage is as follows:
+     * @code
+     * TestClass *testClass=new TestClass; // QObject based class to expose
+     * registry.addObject<TestClass*>(testClass);
+     * @endcode
+     * An object without an objectName() is exposed as "TestClass", so its properties are at "/TestClass/value" and
+     * "TestClass.value". Any number of instances of a class may be added by giving each a distinct objectName(), such
+     * as "ch17", which is then part of the address: "/TestClass/ch17/value" and "TestClass.ch17.value". Object names
+     * must not contain '.' or '/', an object with such a name is refused with a warning. An object with the same
+     * class and name as one already added replaces it.
+     *
+     * Public slots and Q_INVOKABLE methods are exposed too, as "TestClass.reset" in JSON RPC and "POST /TestClass/reset"
+     * in REST. Methods whose parameter or return types are not registered with the meta type system are skipped.
+     *
+     * A method may return a QFuture<QVariant> for work which takes a while, the response is sent once it finishes
+     * without holding up other clients in the meantime. Properties and methods which block but are safe to use from
+     * any thread can be named in a "ThreadSafe" class info, they are then run on threadPool() and answered the same
+     * way:
+     * @code
+     * Q_CLASSINFO("ThreadSafe", "temperature,calibrate")
+     * @endcode
+     *
+     * A class is only introspected for its first instance, every later one shares the same metadata. Objects must be
+     * added before any API using the registry starts worker threads.
+     * @param obj The object to be exposed.
+     */
+    template<class T> void addObject(T obj){ _addObject(obj); }
+
+    /**
+     * @brief The pool which runs the properties and methods a class marks as thread-safe.
+     */
+    QThreadPool *threadPool() const;
+
+signals:
+    /// @private
+    void _signalEmitted(QString methodName, QStringList topics, QVariant value);
+    /// @private
+    void _routesNotified(int notifier);
+
+private:
+    void _notified(int id, void **args);
+    void _addObject(QObject *obj);
+    const ApiInfo &_addInfo(const QMetaObject *mobj);
+    int _addRoute(const QByteArray &name, QObject *obj, const QMetaProperty &prop, bool threadSafe);
+    void _addCall(const QByteArray &name, QObject *obj, const ApiMethod &method, bool threadSafe);
+    void _setMetrics(ApiMetrics::Api api, ApiMetrics *metrics);
+
+    const ApiRoute *_route(const char *name, int len) const;
+    const ApiRoute *_route(const QString &name) const;
+    const ApiObject *_object(const char *name, int len) const;
+    const ApiObject *_object(const QString &name) const;
+    const ApiCall *_call(const char *name, int len) const;
+    const ApiCall *_call(const QString &name) const;
+
+    QVariant _read(QObject *obj, const QMetaProperty &prop) const;
+    bool _write(QObject *obj, const QMetaProperty &prop, const QVariant &value) const;
+    QVector<QVariant> _readAll(QObject *obj, const QVector<QMetaProperty> &props) const;
+    QFuture<QVariant> _readDeferred(const ApiRoute *route) const;
+    QFuture<QVariant> _writeDeferred(const ApiRoute *route, const QVariant &value) const;
+    QByteArray _readText(const ApiRoute *route, quint64 *version=Q_NULLPTR) const;
+    quint64 _version(const ApiRoute *route) const;
+    QByteArray _readJson(const ApiRoute *route) const;
+    bool _cachedJson(const ApiRoute *route, QByteArray *json) const;
+    QByteArray _readCbor(const ApiRoute *route) const;
+    QByteArray _readObjectJson(const ApiObject *object) const;
+    QVariantMap _readObject(const ApiObject *object) const;
+    bool _writeObject(const ApiObject *object, const QVariantMap &values) const;
+    bool _invoke(const ApiCall *call, const QVariantList &args, QVariant *result) const;
+    bool _invoke(const ApiCall *call, const QVariantMap &args, QVariant *result) const;
+    bool _invoke(const ApiCall *call, const ApiSignature &signature, QVariantList args, QVariant *result) const;
+    QVariant _metacall(QObject *obj, const ApiSignature &signature, QVariantList args, bool anyThread) const;
+    static bool _isDeferred(const QVariant &result, QFuture<QVariant> *future);
+
+    void _fillCache(const ApiRoute *route) const;
+    void _fillObject(const ApiObject *object, QVector<QVariant> *uncached) const;
+    void _updateCache(ApiCache *cache, const QVariant &value, bool fill=false) const;
+
+    static QByteArray _toJson(const QVariant &value);
+    static QByteArray _toCbor(const QVariant &value);
+    static ApiConvert _converter(int type);
+
+    QHash<QString, ApiInfo> _apiInfo;
+    QVector<ApiRoute> _routes;
+    RouteTable _routeTable;
+    QVector<ApiObject> _objects;
+    RouteTable _objectTable;
+    QVector<ApiNotifier> _notifiers;
+    QVector<ApiCall> _calls;
+    RouteTable _callTable;
+    ApiRelay *_relay;
+    QThreadPool *_threadPool;
+
+    ApiMetrics *_apiMetrics[ApiMetrics::ApiCount]; // Route statistics are kept per API
+    ApiMetrics *_metrics;                          // Reads, writes and serialisation, shared by all APIs
+    int _concurrentApis;                           // APIs serving the registry from worker threads
+};
+
+Q_DECLARE_METATYPE(QFuture<QVariant>)
+
+#endif // APIREGISTRY_H
@@ -0,0 +1,62 @@
+#include "connectionlimiter.h"
+
+#include <QMutexLocker>
+
+ConnectionLimiter::ConnectionLimiter(): _maxConnections(0), _maxPerHost(0), _count(0){}
+
+int ConnectionLimiter::maxConnections() const {
+    QMutexLocker locker(&_lock);
+    return _maxConnections;
+}
+
+void ConnectionLimiter::setMaxConnections(int count){
+    QMutexLocker locker(&_lock);
+    _maxConnections=qMax(0, count);
+}
+
+int ConnectionLimiter::maxConnectionsPerHost() const {
+    QMutexLocker locker(&_lock);
+    return _maxPerHost;
+}
+
+void ConnectionLimiter::setMaxConnectionsPerHost(int count){
+    QMutexLocker locker(&_lock);
+    _maxPerHost=qMax(0, count);
+}
+
+bool ConnectionLimiter::acquire(const QHostAddress &address, ApiMetrics::Rejection *reason){
+    QHostAddress host=_normalised(address);
+    QMutexLocker locker(&_lock);
+    if(_maxConnections && _count>=_maxConnections){
+        *reason=ApiMetrics::TooManyConnections;
+        return false;
+    }
+    int &hostCount=_hosts[host];
+    if(_maxPerHost && hostCount>=_maxPerHost){
+        *reason=ApiMetrics::TooManyFromHost;
+        return false;
+    }
+    hostCount++;
+    _count++;
+    return true;
+}
+
+void ConnectionLimiter::release(const QHostAddress &address){
+    QHostAddress host=_normalised(address);
+    QMutexLocker locker(&_lock);
+    auto it=_hosts.find(host);
+    if(it==_hosts.end()) return;
+    if(--it.value()<=0) _hosts.erase(it);
+    _count--;
+}
+
+int ConnectionLimiter::count() const {
+    QMutexLocker locker(&_lock);
+    return _count;
+}
+
+QHostAddress ConnectionLimiter::_normalised(const QHostAddress &address){
+    bool ok=false;
+    quint32 ipv4=address.toIPv4Address(&ok);
+    return ok ? QHostAddress(ipv4) : address;
+}
@@ -0,0 +1,51 @@
+#ifndef CONNECTIONLIMITER_H
+#define CONNECTIONLIMITER_H
+
+#include <QHash>
+#include <QMutex>
+#include <QHostAddress>
+
+#include "apimetrics.h"
+
+/**
+ * @private
+ * @brief Counts the open connections of an API, in total and per client address, and refuses those over the limits.
+ * @details IPv4 clients count the same whether they arrive over IPv4 or as IPv4-mapped IPv6 addresses. Only taken
+ * when connections open and close, never per request. Thread-safe.
+ */
+class ConnectionLimiter
+{
+public:
+    ConnectionLimiter();
+
+    int maxConnections() const;
+    /// @brief Set the limit on open connections, 0 for unlimited.
+    void setMaxConnections(int count);
+    int maxConnectionsPerHost() const;
+    /// @brief Set the limit on open connections from any one address, 0 for unlimited.
+    void setMaxConnectionsPerHost(int count);
+
+    /**
+     * @brief Count a connection from address unless it would exceed a limit.
+     * @param reason Set to the limit which would be exceeded when false is returned.
+     * @return Whether the connection may open, if so it must be released when it closes.
+     */
+    bool acquire(const QHostAddress &address, ApiMetrics::Rejection *reason);
+
+    /// @brief Stop counting a connection which was acquired for address.
+    void release(const QHostAddress &address);
+
+    /// @brief The number of connections acquired and not yet released.
+    int count() const;
+
+private:
+    static QHostAddress _normalised(const QHostAddress &address);
+
+    mutable QMutex _lock;
+    int _maxConnections;
+    int _maxPerHost;
+    int _count;
+    QHash<QHostAddress, int> _hosts;
+};
+
+#endif // CONNECTIONLIMITER_H
@@ -0,0 +1,335 @@
+#include "deflatewebsocket.h"
+#include "picohttpparser.h"
+
+#include <QTcpSocket>
+#include <QCryptographicHash>
+#include <QList>
+
+#include <string.h>
+
+static const int MaxHandshakeSize=16*1024;
+static const int DefaultMaxMessageSize=16*1024*1024;
+static const char WebSocketGuid[]="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// Every compressed message ends in an empty stored block which is stripped before sending (RFC 7692 7.2.1)
+static const char FlushTrailer[]={'\x00', '\x00', '\xff', '\xff'};
+
+enum Opcode { Continuation=0x0, Text=0x1, Binary=0x2, Close=0x8, Ping=0x9, Pong=0xa };
+
+static bool headerIs(const phr_header &header, const char *name){
+    return header.name_len==strlen(name) && qstrnicmp(header.name, name, int(header.name_len))==0;
+}
+
+static bool valueContains(const phr_header &header, const char *token){
+    return QByteArray(header.value, int(header.value_len)).toLower().contains(token);
+}
+
+DeflateWebSocket::DeflateWebSocket(QTcpSocket *socket, int windowBits, bool contextTakeover, QObject *parent):
+    QObject(parent),
+    _socket(socket),
+    _state(Handshake),
+    _messageOpcode(0),
+    _messageCompressed(false),
+    _maxMessageSize(DefaultMaxMessageSize),
+    _windowBits(qBound(9, windowBits, 15)),
+    _contextTakeover(contextTakeover),
+    _compressed(false),
+    _resetDeflater(false)
+{
+    _socket->setParent(this);
+    connect(_socket, SIGNAL(readyRead()), SLOT(_readyRead()));
+    connect(_socket, SIGNAL(disconnected()), SLOT(_disconnected()));
+    connect(_socket, SIGNAL(bytesWritten(qint64)), SIGNAL(bytesWritten(qint64)));
+}
+
+DeflateWebSocket::~DeflateWebSocket(){
+    if(_compressed){
+        deflateEnd(&_deflater);
+        inflateEnd(&_inflater);
+    }
+}
+
+bool DeflateWebSocket::isCompressed() const { return _compressed; }
+
+qint64 DeflateWebSocket::sendTextMessage(const QString &message){ return _sendMessage(Text, message.toUtf8()); }
+
+qint64 DeflateWebSocket::sendBinaryMessage(const QByteArray &message){ return _sendMessage(Binary, message); }
+
+qint64 DeflateWebSocket::bytesToWrite() const { return _socket->bytesToWrite(); }
+
+QHostAddress DeflateWebSocket::peerAddress() const { return _socket->peerAddress(); }
+
+quint16 DeflateWebSocket::peerPort() const { return _socket->peerPort(); }
+
+void DeflateWebSocket::close(){
+    if(_state==Open) _fail(1000);
+    else _socket->disconnectFromHost();
+}
+
+void DeflateWebSocket::setMaxMessageSize(qint64 bytes){ _maxMessageSize=qMax(Q_INT64_C(1), bytes); }
+
+void DeflateWebSocket::_readyRead(){
+    _buffer.append(_socket->readAll());
+    if(_state==Handshake && !_handshake()) return;
+    if(_state==Open) _processFrames();
+}
+
+void DeflateWebSocket::_disconnected(){
+    _state=Closed;
+    emit disconnected();
+}
+
+bool DeflateWebSocket::_handshake(){
+    const char *method, *path;
+    size_t methodLen, pathLen, numHeaders=64;
+    int minorVersion;
+    phr_header headers[64];
+    int headerLength=phr_parse_request(_buffer.constData(), size_t(_buffer.size()), &method, &methodLen, &path, &pathLen,
+                                       &minorVersion, headers, &numHeaders, 0);
+    if(headerLength==-2 && _buffer.size()<=MaxHandshakeSize) return false;
+
+    QByteArray key, offers;
+    bool upgrade=false, connection=false, version=false;
+    if(headerLength>0){
+        for(size_t i=0; i<numHeaders; i++){
+            const phr_header &header=headers[i];
+            if(headerIs(header, "upgrade")) upgrade=valueContains(header, "websocket");
+            else if(headerIs(header, "connection")) connection=valueContains(header, "upgrade");
+            else if(headerIs(header, "sec-websocket-version")) version=QByteArray(header.value, int(header.value_len))=="13";
+            else if(headerIs(header, "sec-websocket-key")) key=QByteArray(header.value, int(header.value_len)).trimmed();
+            else if(headerIs(header, "sec-websocket-extensions")){
+                // Repeated headers are equivalent to a single comma separated one
+                if(!offers.isEmpty()) offers.append(',');
+                offers.append(header.value, int(header.value_len));
+            }
+        }
+    }
+    if(headerLength<=0 || methodLen!=3 || memcmp(method, "GET", 3)!=0 || !upgrade || !connection || !version || key.isEmpty()){
+        _socket->write("HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+        _state=Closed;
+        _socket->disconnectFromHost();
+        return false;
+    }
+
+    QByteArray response("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: ");
+    response.append(QCryptographicHash::hash(key+WebSocketGuid, QCryptographicHash::Sha1).toBase64());
+    response.append("\r\n");
+    QByteArray extension;
+    if(!offers.isEmpty() && _negotiate(offers, &extension)){
+        response.append("Sec-WebSocket-Extensions: ");
+        response.append(extension);
+        response.append("\r\n");
+    }
+    response.append("\r\n");
+    _socket->write(response);
+
+    _buffer.remove(0, headerLength);
+    _state=Open;
+    emit connected();
+    return true;
+}
+
+bool DeflateWebSocket::_negotiate(const QByteArray &offers, QByteArray *response){
+    // Offers are listed in order of preference, accept the first permessage-deflate offer we can satisfy
+    foreach(const QByteArray &offer, offers.split(',')){
+        QList<QByteArray> params=offer.split(';');
+        if(params.takeFirst().trimmed()!="permessage-deflate") continue;
+
+        bool ok=true, noContextTakeover=!_contextTakeover;
+        int windowBits=_windowBits;
+        foreach(const QByteArray &param, params){
+            int eq=param.indexOf('=');
+            QByteArray name=param.left(eq).trimmed();
+            QByteArray value=eq<0 ? QByteArray() : param.mid(eq+1).trimmed();
+            if(value.startsWith('"') && value.endsWith('"')) value=value.mid(1, value.size()-2);
+
+            if(name=="server_no_context_takeover") noContextTakeover=true;
+            else if(name=="server_max_window_bits"){
+                int bits=value.toInt(&ok);
+                ok=ok && bits>=8 && bits<=15;
+                windowBits=qMin(windowBits, bits);
+            }
+            else if(name=="client_max_window_bits"){
+                if(!value.isEmpty()){
+                    int bits=value.toInt(&ok);
+                    ok=ok && bits>=8 && bits<=15;
+                }
+            }
+            // Our inflater always has a full window, so the client may or may not keep its context
+            else if(name!="client_no_context_takeover") ok=false;
+            if(!ok) break;
+        }
+        // zlib cannot produce a raw deflate stream with a 256 byte window
+        if(!ok || windowBits<9) continue;
+
+        memset(&_deflater, 0, sizeof(_deflater));
+        memset(&_inflater, 0, sizeof(_inflater));
+        if(deflateInit2(&_deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY)!=Z_OK)
+            return false;
+        if(inflateInit2(&_inflater, -15)!=Z_OK){
+            deflateEnd(&_deflater);
+            return false;
+        }
+        _compressed=true;
+        _resetDeflater=noContextTakeover;
+
+        *response="permessage-deflate";
+        if(noContextTakeover) response->append("; server_no_context_takeover");
+        if(windowBits<15) response->append("; server_max_window_bits="+QByteArray::number(windowBits));
+        return true;
+    }
+    return false;
+}
+
+void DeflateWebSocket::_processFrames(){
+    int offset=0;
+    while(_state==Open){
+        int available=_buffer.size()-offset;
+        if(available<2) break;
+        const uchar *frame=reinterpret_cast<const uchar*>(_buffer.constData())+offset;
+        bool fin=frame[0]&0x80;
+        bool rsv1=frame[0]&0x40;
+        int opcode=frame[0]&0x0f;
+        quint64 length=frame[1]&0x7f;
+        int headerLength=2;
+        if(length==126){
+            if(available<4) break;
+            length=quint64(frame[2])<<8 | frame[3];
+            headerLength=4;
+        } else if(length==127){
+            if(available<10) break;
+            length=0;
+            for(int i=0; i<8; i++) length=length<<8 | frame[2+i];
+            headerLength=10;
+        }
+
+        // Clients must mask every frame, RSV2 and RSV3 have no meaning without an extension defining them
+        if(!(frame[1]&0x80) || (frame[0]&0x30) || (rsv1 && !_compressed)) return _fail(1002);
+        if(length>quint64(_maxMessageSize)) return _fail(1009);
+        if(quint64(available)<headerLength+4+length) break;
+
+        const uchar *mask=frame+headerLength;
+        QByteArray payload(reinterpret_cast<const char*>(mask+4), int(length));
+        char *data=payload.data();
+        for(int i=0; i<int(length); i++) data[i]^=mask[i&3];
+        offset+=headerLength+4+int(length);
+
+        if(opcode&0x8){
+            if(!fin || length>125 || rsv1) return _fail(1002);
+            if(opcode==Close){
+                _sendFrame(Close, payload.left(2), false);
+                _state=Closed;
+                _socket->disconnectFromHost();
+                return;
+            }
+            if(opcode==Ping) _sendFrame(Pong, payload, false);
+            else if(opcode!=Pong) return _fail(1002);
+            continue;
+        }
+
+        if(opcode==Continuation){
+            if(!_messageOpcode || rsv1) return _fail(1002);
+        } else if(opcode==Text || opcode==Binary){
+            if(_messageOpcode) return _fail(1002);
+            _messageOpcode=opcode;
+            _messageCompressed=rsv1;
+        } else return _fail(1002);
+
+        if(_message.size()+payload.size()>_maxMessageSize) return _fail(1009);
+        _message.append(payload);
+        if(!fin) continue;
+
+        QByteArray message;
+        message.swap(_message);
+        opcode=_messageOpcode;
+        _messageOpcode=0;
+        if(_messageCompressed){
+            QByteArray inflated;
+            if(!_inflate(message, &inflated)) return _fail(1007);
+            message.swap(inflated);
+        }
+        if(opcode==Text) emit textMessageReceived(QString::fromUtf8(message));
+        else emit binaryMessageReceived(message);
+    }
+    if(offset) _buffer.remove(0, offset);
+}
+
+qint64 DeflateWebSocket::_sendMessage(int opcode, const QByteArray &message){
+    if(_state!=Open) return 0;
+    // An empty message gains nothing from compression, and the extension allows sending any message uncompressed
+    if(_compressed && !message.isEmpty()){
+        QByteArray deflated;
+        if(_deflate(message, &deflated)) return _sendFrame(opcode, deflated, true);
+    }
+    return _sendFrame(opcode, message, false);
+}
+
+qint64 DeflateWebSocket::_sendFrame(int opcode, const QByteArray &payload, bool compressed){
+    // Server frames are never masked
+    char header[10];
+    int headerLength=2;
+    quint64 length=quint64(payload.size());
+    header[0]=char(0x80 | (compressed ? 0x40 : 0) | opcode);
+    if(length<126) header[1]=char(length);
+    else if(length<=0xffff){
+        header[1]=char(126);
+        header[2]=char(length>>8);
+        header[3]=char(length);
+        headerLength=4;
+    } else {
+        header[1]=char(127);
+        for(int i=0; i<8; i++) header[2+i]=char(length>>(56-8*i));
+        headerLength=10;
+    }
+    _socket->write(header, headerLength);
+    _socket->write(payload);
+    return headerLength+qint64(length);
+}
+
+void DeflateWebSocket::_fail(quint16 code){
+    char status[2]={char(code>>8), char(code)};
+    _sendFrame(Close, QByteArray(status, 2), false);
+    _state=Closed;
+    _socket->disconnectFromHost();
+}
+
+bool DeflateWebSocket::_inflate(const QByteArray &in, QByteArray *out){
+    QByteArray data=in;
+    data.append(FlushTrailer, sizeof(FlushTrailer));
+    _inflater.next_in=reinterpret_cast<Bytef*>(data.data());
+    _inflater.avail_in=uInt(data.size());
+
+    char chunk[16384];
+    forever {
+        _inflater.next_out=reinterpret_cast<Bytef*>(chunk);
+        _inflater.avail_out=sizeof(chunk);
+        int ret=inflate(&_inflater, Z_SYNC_FLUSH);
+        if(ret!=Z_OK && ret!=Z_STREAM_END && ret!=Z_BUF_ERROR) return false;
+        out->append(chunk, int(sizeof(chunk)-_inflater.avail_out));
+        if(out->size()>_maxMessageSize) return false;
+        // A final block ends the stream, the next message starts a new one without any history
+        if(ret==Z_STREAM_END){
+            inflateReset(&_inflater);
+            return true;
+        }
+        if(_inflater.avail_out) return true;
+    }
+}
+
+bool DeflateWebSocket::_deflate(const QByteArray &in, QByteArray *out){
+    _deflater.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(in.constData()));
+    _deflater.avail_in=uInt(in.size());
+    out->reserve(in.size()/2+64);
+
+    char chunk[16384];
+    forever {
+        _deflater.next_out=reinterpret_cast<Bytef*>(chunk);
+        _deflater.avail_out=sizeof(chunk);
+        if(deflate(&_deflater, Z_SYNC_FLUSH)==Z_STREAM_ERROR) return false;
+        out->append(chunk, int(sizeof(chunk)-_deflater.avail_out));
+        if(_deflater.avail_out) break;
+    }
+    if(out->endsWith(QByteArray::fromRawData(FlushTrailer, sizeof(FlushTrailer)))) out->chop(sizeof(FlushTrailer));
+    if(_resetDeflater) deflateReset(&_deflater);
+    return true;
+}
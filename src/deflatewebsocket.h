@@ -0,0 +1,87 @@
+#ifndef DEFLATEWEBSOCKET_H
+#define DEFLATEWEBSOCKET_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHostAddress>
+
+#include <zlib.h>
+
+class QTcpSocket;
+
+/**
+ * @private
+ * @brief A server side WebSocket (RFC 6455) connection supporting the permessage-deflate extension (RFC 7692).
+ * @details QWebSocketServer cannot negotiate extensions, so when compression is enabled WebSocketApi accepts TCP
+ * connections itself and hands them to this class. It performs the opening handshake, negotiates permessage-deflate
+ * with clients that offer it (other clients are served uncompressed) and exposes the subset of the QWebSocket
+ * interface which WebSocketApi uses.
+ */
+class DeflateWebSocket : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Take over a freshly accepted TCP connection.
+     * @param socket The connection, the DeflateWebSocket becomes its parent.
+     * @param windowBits The largest LZ77 window used to compress messages sent to the client, 9 to 15.
+     * @param contextTakeover Whether the compressor keeps its history between messages.
+     * @param parent A parent object.
+     */
+    DeflateWebSocket(QTcpSocket *socket, int windowBits, bool contextTakeover, QObject *parent=0);
+    ~DeflateWebSocket();
+
+    /// @brief Whether permessage-deflate was negotiated with the client.
+    bool isCompressed() const;
+
+    qint64 sendTextMessage(const QString &message);
+    qint64 sendBinaryMessage(const QByteArray &message);
+    qint64 bytesToWrite() const;
+    QHostAddress peerAddress() const;
+    quint16 peerPort() const;
+    void close();
+
+    /// @brief Set the largest message accepted after decompression, larger ones fail the connection with 1009.
+    void setMaxMessageSize(qint64 bytes);
+
+signals:
+    /// @brief Emitted once the opening handshake has completed.
+    void connected();
+    void disconnected();
+    void bytesWritten(qint64 bytes);
+    void textMessageReceived(QString message);
+    void binaryMessageReceived(QByteArray message);
+
+private slots:
+    void _readyRead();
+    void _disconnected();
+
+private:
+    enum State { Handshake, Open, Closed };
+
+    bool _handshake();
+    bool _negotiate(const QByteArray &offers, QByteArray *response);
+    void _processFrames();
+    qint64 _sendMessage(int opcode, const QByteArray &message);
+    qint64 _sendFrame(int opcode, const QByteArray &payload, bool compressed);
+    void _fail(quint16 code);
+    bool _inflate(const QByteArray &in, QByteArray *out);
+    bool _deflate(const QByteArray &in, QByteArray *out);
+
+    QTcpSocket *_socket;
+    State _state;
+    QByteArray _buffer;
+    QByteArray _message;
+    int _messageOpcode;
+    bool _messageCompressed;
+    qint64 _maxMessageSize;
+
+    int _windowBits;
+    bool _contextTakeover;
+    bool _compressed;
+    bool _resetDeflater;
+    z_stream _deflater;
+    z_stream _inflater;
+};
+
+#endif // DEFLATEWEBSOCKET_H
@@ -1,6 +1,676 @@
 #include "httpserver.h"
 
-HttpServer::HttpServer(QObject *parent) : QObject(parent)
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QCoreApplication>
+#include <QEvent>
+#include <QDateTime>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QPointer>
+#include <QDebug>
+
+#include "timerwheel.h"
+
+#include <string.h>
+#include <limits.h>
+
+// Pipelined requests are not processed while more than this many bytes are waiting to be written.
+static const qint64 MaxPendingWrite=256*1024;
+
+// Streams are closed once this many bytes are waiting to be written, a client which reads so slowly has fallen behind.
+static const qint64 MaxStreamBacklog=1024*1024;
+
+// Timeouts fire up to this many milliseconds late, in exchange for costing nothing per connection
+static const int TimeoutResolution=250;
+
+static bool headerIs(const struct phr_header &header, const char *name){
+    size_t len=strlen(name);
+    return header.name && header.name_len==len && qstrnicmp(header.name, name, uint(len))==0;
+}
+
+static bool valueContains(const struct phr_header &header, const char *token){
+    size_t len=strlen(token);
+    for(size_t i=0; i+len<=header.value_len; i++){
+        if(qstrnicmp(header.value+i, token, uint(len))==0) return true;
+    }
+    return false;
+}
+
+static bool expectsContinue(const HttpRequest &request){
+    const struct phr_header *expect=request.header("expect");
+    return expect && valueContains(*expect, "100-continue");
+}
+
+static const char *reasonPhrase(int responseCode){
+    switch(responseCode){
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+static const char *const DayNames[]={ "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+static const char *const MonthNames[]={ "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static void appendNumber(QByteArray *out, int number){
+    char digits[12];
+    int i=int(sizeof(digits));
+    uint value=uint(number);
+    do { digits[--i]=char('0'+value%10); value/=10; } while(value);
+    out->append(digits+i, int(sizeof(digits))-i);
+}
+
+// Hands accepted socket descriptors straight to HttpServer so they can be opened on a worker thread
+class HttpTcpServer : public QTcpServer
 {
+public:
+    HttpTcpServer(std::function<void(qintptr)> handler, QObject *parent)
+        : QTcpServer(parent), _handler(handler){}
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override { _handler(socketDescriptor); }
+
+private:
+    std::function<void(qintptr)> _handler;
+};
+
+const struct phr_header *HttpRequest::header(const char *name) const {
+    for(size_t i=0; i<numHeaders; i++){
+        if(headerIs(headers[i], name)) return &headers[i];
+    }
+    return Q_NULLPTR;
+}
+
+HttpServer::HttpServer(const QByteArray &name, QObject *parent)
+    : QObject(parent), _name(name), _idleTimeout(30000), _headerTimeout(10000), _maxHeaderSize(16*1024),
+      _maxBodySize(1024*1024), _metrics(Q_NULLPTR), _metricsApi(ApiMetrics::Rest), _localWorker(new HttpWorker(this)),
+      _scheduling(LeastConnections), _nextWorker(0)
+{
+    qRegisterMetaType<qintptr>("qintptr");
+    _tcpServer=new HttpTcpServer([this](qintptr socketDescriptor){ _incomingConnection(socketDescriptor); }, this);
+}
+
+HttpServer::~HttpServer(){
+    _tcpServer->close();
+    _stopWorkers();
+}
+
+bool HttpServer::listen(const QHostAddress &address, quint16 port){ return _tcpServer->listen(address, port); }
+
+void HttpServer::close(){ _tcpServer->close(); }
+
+QHostAddress HttpServer::serverAddress() const { return _tcpServer->serverAddress(); }
+
+quint16 HttpServer::serverPort() const { return _tcpServer->serverPort(); }
+
+void HttpServer::addHandler(const QByteArray &prefix, Handler handler){
+    // Longest prefix first, so the first match is the most specific
+    QByteArray normalised=prefix;
+    while(normalised.size()>1 && normalised.endsWith('/')) normalised.chop(1);
+    int i=0;
+    while(i<_handlers.count() && _handlers.at(i).first.size()>=normalised.size()) i++;
+    _handlers.insert(i, qMakePair(normalised, handler));
+}
+
+int HttpServer::idleTimeout() const { return _idleTimeout; }
+
+void HttpServer::setIdleTimeout(int msecs){ _idleTimeout=msecs; }
+
+int HttpServer::headerTimeout() const { return _headerTimeout; }
+
+void HttpServer::setHeaderTimeout(int msecs){ _headerTimeout=msecs; }
+
+int HttpServer::maxConnections() const { return _limiter.maxConnections(); }
+
+void HttpServer::setMaxConnections(int count){ _limiter.setMaxConnections(count); }
+
+int HttpServer::maxConnectionsPerHost() const { return _limiter.maxConnectionsPerHost(); }
+
+void HttpServer::setMaxConnectionsPerHost(int count){ _limiter.setMaxConnectionsPerHost(count); }
+
+int HttpServer::maxHeaderSize() const { return _maxHeaderSize; }
+
+void HttpServer::setMaxHeaderSize(int bytes){ _maxHeaderSize=bytes; }
+
+int HttpServer::maxBodySize() const { return _maxBodySize; }
+
+void HttpServer::setMaxBodySize(int bytes){ _maxBodySize=bytes; }
+
+int HttpServer::workerThreads() const { return _threads.count(); }
+
+void HttpServer::setWorkerThreads(int count, Scheduling scheduling){
+    _stopWorkers();
+    _scheduling=scheduling;
+
+    for(int i=0; i<count; i++){
+        QThread *thread=new QThread(this);
+        HttpWorker *worker=new HttpWorker(this);
+        worker->setParent(Q_NULLPTR);
+        worker->moveToThread(thread);
+        connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+        thread->start();
+
+        _threads << thread;
+        _workers << worker;
+    }
+}
+
+void HttpServer::setMetrics(ApiMetrics *metrics, ApiMetrics::Api api){
+    _metrics=metrics;
+    _metricsApi=api;
+}
+
+int HttpServer::streamCount() const {
+    int count=_localWorker->_streamCount.load();
+    foreach(HttpWorker *worker, _workers) count+=worker->_streamCount.load();
+    return count;
+}
+
+void HttpServer::publish(const QByteArray &topic, const QByteArray &data){
+    // Queued to workers on other threads, only workers with a stream open are woken
+    if(_localWorker->_streamCount.load()) _localWorker->publish(topic, data);
+    foreach(HttpWorker *worker, _workers){
+        if(worker->_streamCount.load())
+            QMetaObject::invokeMethod(worker, "publish", Q_ARG(QByteArray, topic), Q_ARG(QByteArray, data));
+    }
+}
+
+void HttpServer::_stopWorkers(){
+    // Each worker closes its connections, releasing their limits, and quits its own thread. A worker may be blocked
+    // reading a property on this thread meanwhile, so such calls are still answered while waiting for it
+    foreach(HttpWorker *worker, _workers) QMetaObject::invokeMethod(worker, "stop", Qt::QueuedConnection);
+    foreach(QThread *thread, _threads){
+        while(!thread->wait(10)) QCoreApplication::sendPostedEvents(Q_NULLPTR, QEvent::MetaCall);
+        delete thread;
+    }
+    _threads.clear();
+    _workers.clear();
+    _nextWorker=0;
+}
+
+void HttpServer::_incomingConnection(qintptr socketDescriptor){
+    HttpWorker *worker=_localWorker;
+    if(!_workers.isEmpty()){
+        int count=_workers.count();
+        worker=_workers.at(_nextWorker);
+        if(_scheduling==LeastConnections){
+            // Ties go to the next worker in turn so that an idle pool still fills evenly
+            for(int i=1; i<count; i++){
+                HttpWorker *candidate=_workers.at((_nextWorker+i)%count);
+                if(candidate->connectionCount()<worker->connectionCount()) worker=candidate;
+            }
+        }
+        _nextWorker=(_workers.indexOf(worker)+1)%count;
+    }
+
+    // Queued when the worker is on another thread, the socket is opened there
+    QMetaObject::invokeMethod(worker, "addConnection", Q_ARG(qintptr, socketDescriptor));
+}
+
+void HttpServer::_dispatch(const HttpRequest &request, HttpResponse *response) const {
+    const char *path=request.path.data();
+    int pathLen=request.path.size();
+    for(int i=0; i<_handlers.count(); i++){
+        const QByteArray &prefix=_handlers.at(i).first;
+        if(pathLen<prefix.size() || memcmp(path, prefix.constData(), size_t(prefix.size()))!=0) continue;
+
+        // "/events" matches "/events", "/events/x" and "/events?x" but not "/eventsx"
+        char next=pathLen>prefix.size() ? path[prefix.size()] : '\0';
+        if(prefix.endsWith('/') || next=='\0' || next=='/' || next=='?'){
+            _handlers.at(i).second(request, response);
+            return;
+        }
+    }
+    response->code=404;
+    response->body="Not found";
+}
+
+HttpResponseWriter::HttpResponseWriter(const QByteArray &serverName): _serverName(serverName), _dateSecs(-1){}
+
+QByteArray HttpResponseWriter::head(const HttpResponse &response, bool keepAlive, bool *withBody){
+    const QByteArray &prefix=_prefix(response.code);
+    const QByteArray &date=_date();
+    int contentTypeLen=int(strlen(response.contentType));
+    *withBody=!response.body.isEmpty() && response.body.size()<=MaxInlineBody;
+
+    QByteArray head;
+    head.reserve(prefix.size()+date.size()+response.headers.size()+contentTypeLen+80+(*withBody ? response.body.size() : 0));
+    head+=prefix;
+    head+=date;
+    head+=keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    head+=response.headers;
+    if(!response.topics.isEmpty() || response.code!=304){
+        head+="content-type: ";
+        head.append(response.contentType, contentTypeLen);
+        head+="\r\n";
+
+        // Streams have no length, their body runs until the connection closes
+        if(response.topics.isEmpty()){
+            head+="Content-Length: ";
+            appendNumber(&head, response.body.size());
+            head+="\r\n";
+        }
+    }
+    head+="\r\n";
+    if(*withBody) head+=response.body;
+    return head;
+}
+
+void HttpResponseWriter::write(QIODevice *device, const HttpResponse &response, bool keepAlive){
+    // QIODevice::write() only buffers, the data is sent from the event loop
+    bool withBody;
+    device->write(head(response, keepAlive, &withBody));
+    if(!withBody && !response.body.isEmpty()) device->write(response.body);
+}
+
+const QByteArray &HttpResponseWriter::_prefix(int code){
+    auto it=_prefixes.constFind(code);
+    if(it!=_prefixes.constEnd()) return it.value();
+    QByteArray prefix="HTTP/1.1 "+QByteArray::number(code)+" "+reasonPhrase(code)+"\r\nServer: "+_serverName+"\r\n";
+    return _prefixes.insert(code, prefix).value();
+}
+
+const QByteArray &HttpResponseWriter::_date(){
+    qint64 secs=QDateTime::currentSecsSinceEpoch();
+    if(secs!=_dateSecs){
+        // The IMF-fixdate of RFC 7231, always in English and GMT whatever the locale and time zone
+        QDateTime now=QDateTime::fromSecsSinceEpoch(secs, Qt::UTC);
+        QDate date=now.date();
+        QTime time=now.time();
+        char buffer[48];
+        qsnprintf(buffer, sizeof(buffer), "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n", DayNames[date.dayOfWeek()-1],
+                  date.day(), MonthNames[date.month()-1], date.year(), time.hour(), time.minute(), time.second());
+        _dateHeader=buffer;
+        _dateSecs=secs;
+    }
+    return _dateHeader;
+}
+
+HttpWorker::HttpWorker(HttpServer *server)
+    : QObject(server), _server(server), _writer(server->_name), _timeouts(new TimerWheel(TimeoutResolution, this))
+{
+    connect(_timeouts, SIGNAL(expired(QObject*)), SLOT(_expired(QObject*)));
+}
+
+int HttpWorker::connectionCount() const { return _connectionCount.load(); }
+
+void HttpWorker::addConnection(qintptr socketDescriptor){
+    QTcpSocket *socket=new QTcpSocket(this);
+    if(!socket->setSocketDescriptor(socketDescriptor)){
+        qWarning() << "Failed to open connection:" << socket->errorString();
+        delete socket;
+        return;
+    }
+
+    // Refused before anything is read, so an address holding many connections costs no more than the 503
+    QHostAddress peer=socket->peerAddress();
+    ApiMetrics::Rejection reason;
+    if(!_server->_limiter.acquire(peer, &reason)){
+        if(_server->_metrics) _server->_metrics->connectionRejected(_server->_metricsApi, reason);
+        _reject(socket);
+        return;
+    }
+
+    // Unread data stays in the kernel once this is buffered, so a client cannot queue more than a request ahead
+    socket->setReadBufferSize(qint64(_server->maxHeaderSize())+_server->maxBodySize());
+
+    Connection conn;
+    conn.scanned=0;
+    conn.pending=0;
+    conn.chunked=false;
+    conn.decoded=0;
+    conn.continued=false;
+    conn.closing=false;
+    conn.deferred=false;
+    conn.partial=false;
+    conn.expiry=NoExpiry;
+    conn.peer=peer;
+    _connections[socket]=conn;
+    _connectionCount.ref();
+    if(_server->_metrics) _server->_metrics->connectionOpened(_server->_metricsApi);
+
+    connect(socket, SIGNAL(disconnected()), SLOT(_disconnected()));
+    connect(socket, SIGNAL(readyRead()), SLOT(_readyRead()));
+    connect(socket, SIGNAL(bytesWritten(qint64)), SLOT(_bytesWritten(qint64)));
+    _startTimeout(socket, _connections[socket]);
+}
+
+void HttpWorker::publish(const QByteArray &topic, const QByteArray &data){
+    // Copies, a stream which falls behind is aborted and removed from _streams while they are walked
+    const QList<QTcpSocket*> streams=_streams.value(topic)+_streams.value("*");
+    foreach(QTcpSocket *socket, streams){
+        if(socket->bytesToWrite()>MaxStreamBacklog){
+            if(_server->_metrics) _server->_metrics->notificationsDropped(1);
+            socket->abort();
+            continue;
+        }
+        socket->write(data);
+    }
+    if(_server->_metrics && !streams.isEmpty()) _server->_metrics->notificationsSent(streams.count());
+}
+
+void HttpWorker::stop(){
+    foreach(QTcpSocket *socket, _connections.keys()){
+        disconnect(socket, Q_NULLPTR, this, Q_NULLPTR);
+        _removeConnection(socket);
+        socket->abort();
+    }
+    QThread::currentThread()->quit();
+}
+
+void HttpWorker::_readyRead(){
+    QTcpSocket *socket=dynamic_cast<QTcpSocket*>(sender());
+    if(!socket || !_connections.contains(socket)) return;
+    _processRequests(socket);
+}
+
+void HttpWorker::_bytesWritten(qint64 bytes){
+    Q_UNUSED(bytes);
+    QTcpSocket *socket=dynamic_cast<QTcpSocket*>(sender());
+    if(!socket || !_connections.contains(socket)) return;
+
+    // Resume any pipelined requests which were held back while the write buffer drained
+    if(socket->bytesToWrite()<MaxPendingWrite) _processRequests(socket);
+}
+
+void HttpWorker::_disconnected(){
+    QTcpSocket *socket=dynamic_cast<QTcpSocket*>(sender());
+    if(!socket) return;
+    _removeConnection(socket);
+    socket->deleteLater();
+}
+
+void HttpWorker::_removeConnection(QTcpSocket *socket){
+    if(_connections.contains(socket)){
+        foreach(const QByteArray &topic, _connections.value(socket).topics){
+            QList<QTcpSocket*> &streams=_streams[topic];
+            streams.removeOne(socket);
+            if(streams.isEmpty()) _streams.remove(topic);
+        }
+        if(!_connections.value(socket).topics.isEmpty()) _streamCount.deref();
+
+        _server->_limiter.release(_connections.value(socket).peer);
+        _connections.remove(socket);
+        _connectionCount.deref();
+        if(_server->_metrics) _server->_metrics->connectionClosed(_server->_metricsApi);
+    }
+    _timeouts->stop(socket);
+}
+
+void HttpWorker::_expired(QObject *key){
+    QTcpSocket *socket=static_cast<QTcpSocket*>(key);
+    auto it=_connections.find(socket);
+    if(it==_connections.end()) return;
+
+    Connection &conn=it.value();
+    bool header=conn.expiry==HeaderExpiry;
+    conn.expiry=NoExpiry;
+    ApiMetrics *metrics=_server->_metrics;
+    if(metrics) metrics->connectionEvicted(_server->_metricsApi, header ? ApiMetrics::HeaderTimeout : ApiMetrics::IdleTimeout);
+
+    if(header){
+        conn.closing=true;
+        _error(socket, 408);
+        socket->disconnectFromHost();
+    } else if(socket->bytesToWrite()>0){
+        // A client which has not read its responses in all this time would hold the connection open while they drain
+        socket->abort();
+    } else socket->disconnectFromHost();
+}
+
+void HttpWorker::_startTimeout(QTcpSocket *socket, Connection &conn){
+    if(!conn.topics.isEmpty() || conn.deferred){
+        // Streams and deferred responses may rightly go quiet for a long time
+        _timeouts->stop(socket);
+        conn.expiry=NoExpiry;
+    } else if(conn.partial && _server->headerTimeout()>0){
+        // Armed once when the request starts, headers trickled in a byte at a time do not put it off
+        if(conn.expiry!=HeaderExpiry){
+            _timeouts->start(socket, _server->headerTimeout());
+            conn.expiry=HeaderExpiry;
+        }
+    } else {
+        _timeouts->start(socket, _server->idleTimeout());
+        conn.expiry=IdleExpiry;
+    }
+}
+
+void HttpWorker::_processRequests(QTcpSocket *socket){
+    bool close=false, more=false;
+    {
+        Connection &conn=_connections[socket];
+        if(conn.closing || conn.deferred) return;
+        if(!conn.topics.isEmpty()){
+            // Streams only ever send, anything the client sends is ignored
+            socket->readAll();
+            conn.buffer.clear();
+            return;
+        }
+
+        ApiMetrics *metrics=_server->_metrics;
+        int maxHeaderSize=_server->maxHeaderSize(), maxBodySize=_server->maxBodySize();
+
+        // Only a request's worth is buffered, anything more waits in the socket until earlier requests are answered
+        qint64 room=qint64(maxHeaderSize)+maxBodySize-conn.buffer.size();
+        if(room>0 && socket->bytesAvailable()>0) conn.buffer.append(socket->read(room));
+        int buffered=conn.buffer.size();
+        conn.partial=false;
+
+        // Requests are parsed in place, the buffer is only compacted once all complete requests are answered
+        int offset=0;
+        while(offset<conn.buffer.size() && socket->bytesToWrite()<MaxPendingWrite){
+            int size=conn.buffer.size();
+            if(conn.pending>size-offset) break; // Still waiting for the rest of the body
+
+            HttpRequest request;
+            bool chunked=false;
+            QElapsedTimer timer;
+            if(metrics) timer.start();
+            int ret=_parse(conn.buffer.constData()+offset, size-offset, conn.scanned, &request, &chunked);
+            if(metrics) metrics->recordStage(ApiMetrics::Parse, timer.nsecsElapsed());
+            if(ret==-2 && size-offset<=maxHeaderSize){
+                // Incomplete headers, only the new data needs scanning next time
+                conn.scanned=size_t(size-offset);
+                conn.partial=true;
+                break;
+            }
+            conn.scanned=0;
+
+            int error=0;
+            if(ret==-2 || ret>maxHeaderSize) error=431;
+            else if(ret<0) error=400;
+            else if(request.bodyLength>maxBodySize) error=413;
+            if(error){
+                if(metrics && error!=400) metrics->connectionEvicted(_server->_metricsApi, ApiMetrics::RequestTooLarge);
+                _error(socket, error);
+                offset=conn.buffer.size();
+                close=true;
+                break;
+            }
+
+            int length;
+            if(chunked){
+                if(!conn.chunked){
+                    conn.chunked=true;
+                    conn.decoded=0;
+                    memset(&conn.decoder, 0, sizeof(conn.decoder));
+                    conn.decoder.consume_trailer=1;
+                }
+
+                // Decoding compacts the body in place, anything already decoded is not passed again
+                char *body=conn.buffer.data()+offset+ret;
+                size_t available=size_t(size-offset-ret-conn.decoded);
+                ssize_t left=phr_decode_chunked(&conn.decoder, body+conn.decoded, &available);
+                conn.decoded+=int(available);
+                if(left==-1 || conn.decoded>maxBodySize){
+                    if(metrics && left!=-1) metrics->connectionEvicted(_server->_metricsApi, ApiMetrics::RequestTooLarge);
+                    _error(socket, left==-1 ? 400 : 413);
+                    offset=conn.buffer.size();
+                    close=true;
+                    break;
+                }
+                if(left==-2){
+                    // Everything after the decoded data has been consumed
+                    conn.buffer.truncate(offset+ret+conn.decoded);
+                    if(!conn.continued && expectsContinue(request)){
+                        socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+                        conn.continued=true;
+                    }
+                    break;
+                }
+
+                // Any following request was moved down to just after the decoded body
+                length=ret+conn.decoded;
+                conn.buffer.truncate(offset+length+int(left));
+                request.body=conn.buffer.constData()+offset+ret;
+                request.bodyLength=conn.decoded;
+                conn.chunked=false;
+            } else {
+                length=ret+request.bodyLength;
+                if(length>size-offset){
+                    conn.pending=length;
+                    if(!conn.continued && expectsContinue(request)){
+                        socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+                        conn.continued=true;
+                    }
+                    break;
+                }
+            }
+            conn.pending=0;
+            conn.continued=false;
+
+            HttpResponse response;
+            _server->_dispatch(request, &response);
+            if(!response.topics.isEmpty()){
+                // The stream's body runs until the connection closes, so nothing after it is answered
+                _respond(socket, response, false);
+                conn.topics=response.topics;
+                foreach(const QByteArray &topic, conn.topics) _streams[topic] << socket;
+                _streamCount.ref();
+                offset=conn.buffer.size();
+                break;
+            }
+            offset+=length;
+            if(response.complete){
+                // Responses go out in order, so nothing more is answered until this one is complete
+                conn.deferred=true;
+                _defer(socket, response, request.keepAlive);
+                break;
+            }
+            _respond(socket, response, request.keepAlive);
+
+            if(!request.keepAlive){
+                close=true;
+                break;
+            }
+        }
+
+        if(offset>0) conn.buffer.remove(0, offset);
+        conn.closing=close;
+        more=!close && !conn.deferred && conn.topics.isEmpty() && conn.buffer.size()<buffered
+             && socket->bytesAvailable()>0;
+        if(!close) _startTimeout(socket, conn);
+    }
+
+    // Any queued response data is flushed before the connection is closed
+    if(close) socket->disconnectFromHost();
+    else if(more) _processRequests(socket); // Room was made for data the socket is still holding
+}
+
+void HttpWorker::_defer(QTcpSocket *socket, const HttpResponse &response, bool keepAlive){
+    QPointer<QTcpSocket> guard(socket);
+    QFutureWatcher<QVariant> *watcher=new QFutureWatcher<QVariant>(this);
+    connect(watcher, &QFutureWatcherBase::finished, this, [this, watcher, guard, response, keepAlive](){
+        watcher->deleteLater();
+        if(!guard || !_connections.contains(guard)) return; // The client has gone
+
+        HttpResponse completed=response;
+        completed.complete=Q_NULLPTR;
+        response.complete(watcher->future().resultCount() ? watcher->result() : QVariant(), &completed);
+        _respond(guard, completed, keepAlive);
+        _connections[guard].deferred=false;
+
+        if(keepAlive) _processRequests(guard);
+        else {
+            _connections[guard].closing=true;
+            guard->disconnectFromHost();
+        }
+    });
+    watcher->setFuture(response.future);
+}
+
+void HttpWorker::_error(QTcpSocket *socket, int responseCode){
+    HttpResponse response;
+    response.code=responseCode;
+    response.body=reasonPhrase(responseCode);
+    _respond(socket, response, false);
+}
+
+void HttpWorker::_reject(QTcpSocket *socket){
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    _error(socket, 503);
+    socket->disconnectFromHost();
+}
+
+void HttpWorker::_respond(QTcpSocket *socket, const HttpResponse &response, bool keepAlive){
+    ApiMetrics *metrics=_server->_metrics;
+    QElapsedTimer timer;
+    if(metrics){
+        timer.start();
+        metrics->recordHttpStatus(response.code);
+    }
+
+    _writer.write(socket, response, keepAlive);
+    if(metrics) metrics->recordStage(ApiMetrics::Send, timer.nsecsElapsed());
+}
+
+int HttpWorker::_parse(const char *data, int size, size_t lastLen, HttpRequest *request, bool *chunked){
+    const char *method, *path;
+    size_t methodLen, pathLen;
+    request->numHeaders=sizeof(request->headers)/sizeof(request->headers[0]);
+
+    int ret=phr_parse_request(data, size_t(size), &method, &methodLen, &path, &pathLen,
+                              &request->minorVersion, request->headers, &request->numHeaders, lastLen);
+
+    if(ret==-2) return -2;
+    if(ret<0) return -1;
+
+    request->method=QLatin1String(method, int(methodLen));
+    request->path=QLatin1String(path, int(pathLen));
+    request->body=data+ret;
+    request->bodyLength=0;
+    request->keepAlive=request->minorVersion>=1;
+    *chunked=false;
 
+    for(size_t i=0; i<request->numHeaders; i++){
+        const struct phr_header &header=request->headers[i];
+        if(headerIs(header, "content-length")){
+            bool ok=header.value_len>0;
+            qlonglong length=0;
+            for(size_t j=0; ok && j<header.value_len; j++){
+                if(header.value[j]<'0' || header.value[j]>'9') ok=false;
+                else length=length*10+(header.value[j]-'0');
+                if(length>INT_MAX-ret) ok=false;
+            }
+            if(!ok) return -1;
+            request->bodyLength=int(length);
+        } else if(headerIs(header, "transfer-encoding")){
+            // Chunked takes precedence over any Content-Length
+            *chunked=valueContains(header, "chunked");
+        } else if(headerIs(header, "connection")){
+            if(valueContains(header, "close")) request->keepAlive=false;
+            else if(valueContains(header, "keep-alive")) request->keepAlive=true;
+        }
+    }
+    if(*chunked) request->bodyLength=0;
+    return ret;
 }
@@ -2,17 +2,268 @@
 #define HTTPSERVER_H
 
 #include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QAtomicInt>
+#include <QHostAddress>
+#include <QLatin1String>
+#include <QVariant>
+#include <QFuture>
 
-/// @private
-class HttpServer : public QObject
+#include <functional>
+
+#include "picohttpparser.h"
+#include "apimetrics.h"
+#include "connectionlimiter.h"
+
+class QTcpServer;
+class QTcpSocket;
+class QIODevice;
+class QThread;
+class TimerWheel;
+class HttpServer;
+
+/**
+ * @private
+ * @brief A parsed HTTP request, its strings point into the connection's receive buffer.
+ */
+typedef struct HttpRequest {
+    QLatin1String method;
+    QLatin1String path;
+    const char *body;
+    int bodyLength;
+    struct phr_header headers[64];
+    size_t numHeaders;
+    int minorVersion;
+    bool keepAlive;
+
+    /// @brief The first header called name, compared case insensitively, or Q_NULLPTR if there is none.
+    const struct phr_header *header(const char *name) const;
+} HttpRequest;
+
+/**
+ * @private
+ * @brief The response a handler fills in.
+ */
+typedef struct HttpResponse {
+    HttpResponse(): code(200), contentType("text/plain;charset=UTF-8"){}
+    int code;
+    QByteArray body;
+    const char *contentType;
+    QByteArray headers; ///< Any additional header lines, each terminated by "\r\n".
+    QList<QByteArray> topics; ///< When not empty the response is a stream of whatever is published to these topics.
+
+    /**
+     * @brief When set the response is deferred until future finishes.
+     * @details complete is then called on the worker's thread with the future's result, or an invalid QVariant if it
+     * was cancelled, to finish filling in the response before it is sent. Later requests on the same connection wait
+     * for it, other connections do not.
+     */
+    std::function<void(const QVariant &result, HttpResponse *response)> complete;
+    QFuture<QVariant> future; ///< The work a deferred response waits for.
+} HttpResponse;
+
+/**
+ * @private
+ * @brief Writes responses from header lines formatted ahead of time.
+ * @details The status line and Server header of each status code are formatted once, and the Date header at most once
+ * a second. A body of any size is handed to the device as the QByteArray it already is, so cached values go out
+ * without being copied; only small bodies are appended to the headers, sparing a separate write. Not thread-safe,
+ * every worker has its own.
+ */
+class HttpResponseWriter
+{
+public:
+    explicit HttpResponseWriter(const QByteArray &serverName);
+
+    /// @brief The status line and headers for response, followed by its body if *withBody is set on return.
+    QByteArray head(const HttpResponse &response, bool keepAlive, bool *withBody);
+    void write(QIODevice *device, const HttpResponse &response, bool keepAlive);
+
+private:
+    enum { MaxInlineBody=1024 }; // Bodies up to this size are cheaper to copy than to write separately
+
+    const QByteArray &_prefix(int code);
+    const QByteArray &_date();
+
+    QByteArray _serverName;
+    QHash<int, QByteArray> _prefixes;
+    QByteArray _dateHeader;
+    qint64 _dateSecs;
+};
+
+/**
+ * @private
+ * @brief Owns the connections handed to it by an HttpServer and services them on the thread it lives in.
+ */
+class HttpWorker : public QObject
 {
     Q_OBJECT
+    friend class HttpServer;
+#ifdef QWEBAPI_TESTING
+    friend class QWebApiBenchmark;
+    friend class QWebApiTest;
+#endif
 public:
-    explicit HttpServer(QObject *parent = 0);
+    explicit HttpWorker(HttpServer *server);
 
-signals:
+    /// @brief The number of connections currently open on this worker, safe to call from any thread.
+    int connectionCount() const;
 
 public slots:
+    void addConnection(qintptr socketDescriptor);
+    void publish(const QByteArray &topic, const QByteArray &data);
+    /// @brief Close every connection and quit the worker's thread.
+    void stop();
+
+private slots:
+    void _readyRead();
+    void _bytesWritten(qint64 bytes);
+    void _disconnected();
+    void _expired(QObject *key);
+
+private:
+    enum Expiry { NoExpiry, HeaderExpiry, IdleExpiry };
+
+    typedef struct Connection {
+        QByteArray buffer;
+        size_t scanned;      // Bytes of incomplete headers already scanned
+        int pending;         // Length of a request still waiting for the rest of its Content-Length body
+        bool chunked;        // Whether the request at the front of the buffer has a chunked body being decoded
+        int decoded;         // Bytes of that body decoded in place so far
+        struct phr_chunked_decoder decoder;
+        bool continued;      // Whether 100 Continue has been sent for the request at the front of the buffer
+        bool partial;        // Whether the buffer ends in a request whose headers are incomplete
+        Expiry expiry;       // Which timeout is running
+        QHostAddress peer;   // Counted against the server's limits until the connection closes
+        bool closing;
+        QList<QByteArray> topics; // Topics streamed to the connection, which then takes no further requests
+        bool deferred;       // Whether a deferred response is outstanding, later requests wait for it
+    } Connection;
+
+    static int _parse(const char *data, int size, size_t lastLen, HttpRequest *request, bool *chunked);
+    void _processRequests(QTcpSocket *socket);
+    void _respond(QTcpSocket *socket, const HttpResponse &response, bool keepAlive);
+    void _defer(QTcpSocket *socket, const HttpResponse &response, bool keepAlive);
+    void _error(QTcpSocket *socket, int responseCode);
+    void _reject(QTcpSocket *socket);
+    void _startTimeout(QTcpSocket *socket, Connection &conn);
+    void _removeConnection(QTcpSocket *socket);
+
+    HttpServer *_server;
+    HttpResponseWriter _writer;
+    TimerWheel *_timeouts;
+    QHash<QTcpSocket*, Connection> _connections;
+    QAtomicInt _connectionCount;
+    QHash<QByteArray, QList<QTcpSocket*> > _streams;
+    QAtomicInt _streamCount;
+};
+
+/**
+ * @private
+ * @brief An event driven HTTP/1.1 server which hands requests to the handlers registered with it.
+ * @details Connections are persistent (keep-alive) and pipelined requests are answered in order. Request headers and
+ * bodies are parsed in place with picohttpparser, bodies may be sent with Content-Length or chunked encoding, and
+ * requests which exceed maxHeaderSize() or maxBodySize() are refused. No more than one request's worth of data is
+ * read ahead of the request being answered, the rest is left to TCP flow control.
+ *
+ * Connections over maxConnections() or maxConnectionsPerHost() are answered 503 and closed as soon as they are
+ * accepted. A connection whose request headers have not arrived in full within headerTimeout() of the request
+ * starting is answered 408 and closed however slowly they trickle in, and one which sends nothing for idleTimeout()
+ * is closed. Timeouts are kept on a timer wheel per worker rather than a timer per connection.
+ *
+ * Connections are serviced on the server's own thread or spread over a pool of worker threads, handlers are called on
+ * whichever thread serviced the request.
+ *
+ * A handler which sets HttpResponse::topics turns its connection into a stream, such as a text/event-stream: the body
+ * is sent without a length and everything later given to publish() for one of the topics is appended to it until
+ * the client disconnects. The topic "*" receives everything published.
+ *
+ * A handler whose work would block may instead defer its response with HttpResponse::complete and
+ * HttpResponse::future, the worker goes on servicing other connections until the future finishes.
+ */
+class HttpServer : public QObject
+{
+    Q_OBJECT
+    friend class HttpWorker;
+public:
+    /// @brief Fills in the response to a request, called on a worker thread.
+    typedef std::function<void(const HttpRequest &request, HttpResponse *response)> Handler;
+
+    /// @brief How accepted connections are shared out between worker threads.
+    enum Scheduling { RoundRobin, LeastConnections };
+
+    /**
+     * @brief Construct an HttpServer.
+     * @param name The value of the Server header sent with every response.
+     * @param parent A parent object.
+     */
+    explicit HttpServer(const QByteArray &name, QObject *parent=0);
+    ~HttpServer();
+
+    bool listen(const QHostAddress &address, quint16 port);
+    void close();
+    QHostAddress serverAddress() const;
+    quint16 serverPort() const;
+
+    /**
+     * @brief Register a handler for every path starting with prefix.
+     * @details The handler with the longest matching prefix is chosen, a prefix only matches whole path segments.
+     * Handlers must be registered before the server starts serving requests.
+     * @param prefix A path prefix such as "/" or "/events".
+     * @param handler The handler.
+     */
+    void addHandler(const QByteArray &prefix, Handler handler);
+
+    int idleTimeout() const;
+    void setIdleTimeout(int msecs);
+    int headerTimeout() const;
+    void setHeaderTimeout(int msecs);
+    int maxConnections() const;
+    void setMaxConnections(int count);
+    int maxConnectionsPerHost() const;
+    void setMaxConnectionsPerHost(int count);
+    int maxHeaderSize() const;
+    void setMaxHeaderSize(int bytes);
+    int maxBodySize() const;
+    void setMaxBodySize(int bytes);
+    int workerThreads() const;
+    void setWorkerThreads(int count, Scheduling scheduling);
+
+    /// @brief Record connections, parsing, response codes and sending to metrics, under api.
+    void setMetrics(ApiMetrics *metrics, ApiMetrics::Api api);
+
+    /// @brief The number of streams currently open, safe to call from any thread.
+    int streamCount() const;
+
+    /**
+     * @brief Append data to every stream of topic, safe to call from any thread.
+     * @details Streams whose client is not reading are closed rather than buffered without bound.
+     */
+    void publish(const QByteArray &topic, const QByteArray &data);
+
+private:
+    void _incomingConnection(qintptr socketDescriptor);
+    void _dispatch(const HttpRequest &request, HttpResponse *response) const;
+    void _stopWorkers();
+
+    QTcpServer *_tcpServer;
+    QByteArray _name;
+    QList<QPair<QByteArray, Handler> > _handlers;
+    int _idleTimeout;
+    int _headerTimeout;
+    ConnectionLimiter _limiter;
+    int _maxHeaderSize;
+    int _maxBodySize;
+    ApiMetrics *_metrics;
+    ApiMetrics::Api _metricsApi;
+
+    HttpWorker *_localWorker;
+    QList<HttpWorker*> _workers;
+    QList<QThread*> _threads;
+    Scheduling _scheduling;
+    int _nextWorker;
 };
 
 #endif // HTTPSERVER_H
@@ -0,0 +1,238 @@
+#include "jsonwriter.h"
+
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonValue>
+#include <QStringList>
+#include <QLocale>
+
+#include <string.h>
+
+static const char HexDigits[]="0123456789abcdef";
+
+static inline void appendEscaped(QByteArray *buffer, uint c){
+    switch(c){
+    case '"': buffer->append("\\\"", 2); break;
+    case '\\': buffer->append("\\\\", 2); break;
+    case '\b': buffer->append("\\b", 2); break;
+    case '\f': buffer->append("\\f", 2); break;
+    case '\n': buffer->append("\\n", 2); break;
+    case '\r': buffer->append("\\r", 2); break;
+    case '\t': buffer->append("\\t", 2); break;
+    default:
+        if(c<0x20){
+            char escape[6]={'\\', 'u', '0', '0', HexDigits[c>>4], HexDigits[c&0xf]};
+            buffer->append(escape, 6);
+        }
+        else buffer->append(char(c));
+    }
+}
+
+static inline void appendUtf8(QByteArray *buffer, uint c){
+    if(c<0x800){
+        buffer->append(char(0xc0|(c>>6)));
+    } else if(c<0x10000){
+        buffer->append(char(0xe0|(c>>12)));
+        buffer->append(char(0x80|((c>>6)&0x3f)));
+    } else {
+        buffer->append(char(0xf0|(c>>18)));
+        buffer->append(char(0x80|((c>>12)&0x3f)));
+        buffer->append(char(0x80|((c>>6)&0x3f)));
+    }
+    buffer->append(char(0x80|(c&0x3f)));
+}
+
+JsonWriter::JsonWriter(QByteArray *buffer): _buffer(buffer), _start(buffer->size()){}
+
+void JsonWriter::beginObject(){
+    _separate();
+    _buffer->append('{');
+}
+
+void JsonWriter::endObject(){ _buffer->append('}'); }
+
+void JsonWriter::beginArray(){
+    _separate();
+    _buffer->append('[');
+}
+
+void JsonWriter::endArray(){ _buffer->append(']'); }
+
+void JsonWriter::key(const char *key){
+    _separate();
+    _buffer->append('"');
+    _buffer->append(key);
+    _buffer->append("\":", 2);
+}
+
+void JsonWriter::value(const QVariant &value){
+    switch(value.userType()){
+    case QMetaType::UnknownType:
+    case QMetaType::Nullptr:
+    case QMetaType::VoidStar:
+        null();
+        break;
+    case QMetaType::Bool:
+        this->value(value.toBool());
+        break;
+    case QMetaType::Int:
+    case QMetaType::Short:
+    case QMetaType::SChar:
+    case QMetaType::UInt:
+    case QMetaType::UShort:
+    case QMetaType::UChar:
+    case QMetaType::Long:
+    case QMetaType::LongLong:
+        this->value(value.toLongLong());
+        break;
+    case QMetaType::ULong:
+    case QMetaType::ULongLong:
+        this->value(value.toULongLong());
+        break;
+    case QMetaType::Float:
+    case QMetaType::Double:
+        this->value(value.toDouble());
+        break;
+    case QMetaType::QString:
+    case QMetaType::QByteArray:
+    case QMetaType::QChar:
+    case QMetaType::QUrl:
+    case QMetaType::QUuid:
+        this->value(value.toString());
+        break;
+    case QMetaType::QStringList:
+        beginArray();
+        foreach(const QString &item, value.toStringList()) this->value(item);
+        endArray();
+        break;
+    case QMetaType::QVariantList:
+        beginArray();
+        foreach(const QVariant &item, value.toList()) this->value(item);
+        endArray();
+        break;
+    case QMetaType::QVariantMap: {
+        beginObject();
+        const QVariantMap map=value.toMap();
+        for(auto it=map.constBegin(); it!=map.constEnd(); ++it){
+            _separate();
+            _string(it.key().constData(), it.key().size());
+            _buffer->append(':');
+            this->value(it.value());
+        }
+        endObject();
+        break;
+    }
+    case QMetaType::QVariantHash: {
+        beginObject();
+        const QVariantHash hash=value.toHash();
+        for(auto it=hash.constBegin(); it!=hash.constEnd(); ++it){
+            _separate();
+            _string(it.key().constData(), it.key().size());
+            _buffer->append(':');
+            this->value(it.value());
+        }
+        endObject();
+        break;
+    }
+    default: {
+        // Anything unusual goes the long way round, QJsonDocument can only serialise arrays and objects
+        QJsonValue jvalue=QJsonValue::fromVariant(value);
+        if(jvalue.isNull() && value.canConvert<QString>()){
+            this->value(value.toString());
+            break;
+        }
+        QByteArray json=QJsonDocument(QJsonArray() << jvalue).toJson(QJsonDocument::Compact);
+        raw(json.mid(1, json.size()-2));
+    }
+    }
+}
+
+void JsonWriter::value(const QString &value){
+    _separate();
+    _string(value.constData(), value.size());
+}
+
+void JsonWriter::value(const char *value){
+    _separate();
+    _latin1(value, int(strlen(value)));
+}
+
+void JsonWriter::value(bool value){
+    _separate();
+    if(value) _buffer->append("true", 4);
+    else _buffer->append("false", 5);
+}
+
+void JsonWriter::value(int value){ this->value(qlonglong(value)); }
+
+void JsonWriter::value(qlonglong value){
+    if(value<0){
+        _separate();
+        _buffer->append('-');
+        // Negate in unsigned arithmetic so that the minimum value does not overflow
+        qulonglong magnitude=0-qulonglong(value);
+        char digits[20];
+        int i=sizeof(digits);
+        do { digits[--i]=char('0'+magnitude%10); magnitude/=10; } while(magnitude);
+        _buffer->append(digits+i, int(sizeof(digits))-i);
+    }
+    else this->value(qulonglong(value));
+}
+
+void JsonWriter::value(qulonglong value){
+    _separate();
+    char digits[20];
+    int i=sizeof(digits);
+    do { digits[--i]=char('0'+value%10); value/=10; } while(value);
+    _buffer->append(digits+i, int(sizeof(digits))-i);
+}
+
+void JsonWriter::value(double value){
+    // JSON has no representation for NaN or infinity, QJsonDocument writes null too
+    if(!qIsFinite(value)){
+        null();
+        return;
+    }
+    _separate();
+    _buffer->append(QByteArray::number(value, 'g', QLocale::FloatingPointShortest));
+}
+
+void JsonWriter::null(){
+    _separate();
+    _buffer->append("null", 4);
+}
+
+void JsonWriter::raw(const QByteArray &json){
+    _separate();
+    _buffer->append(json);
+}
+
+void JsonWriter::_separate(){
+    if(_buffer->size()<=_start) return;
+    char last=_buffer->at(_buffer->size()-1);
+    if(last!='{' && last!='[' && last!=':') _buffer->append(',');
+}
+
+void JsonWriter::_string(const QChar *data, int len){
+    _buffer->append('"');
+    const ushort *utf16=reinterpret_cast<const ushort*>(data);
+    for(int i=0; i<len; i++){
+        uint c=utf16[i];
+        if(c<0x80) appendEscaped(_buffer, c);
+        else if(QChar::isHighSurrogate(c) && i+1<len && QChar::isLowSurrogate(utf16[i+1]))
+            appendUtf8(_buffer, QChar::surrogateToUcs4(ushort(c), utf16[++i]));
+        else if(QChar::isSurrogate(c)) appendUtf8(_buffer, QChar::ReplacementCharacter);
+        else appendUtf8(_buffer, c);
+    }
+    _buffer->append('"');
+}
+
+void JsonWriter::_latin1(const char *data, int len){
+    _buffer->append('"');
+    for(int i=0; i<len; i++){
+        uint c=uchar(data[i]);
+        if(c<0x80) appendEscaped(_buffer, c);
+        else appendUtf8(_buffer, c);
+    }
+    _buffer->append('"');
+}
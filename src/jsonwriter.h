@@ -0,0 +1,54 @@
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+
+/**
+ * @private
+ * @brief Appends compact UTF-8 JSON directly to a QByteArray.
+ * @details Unlike QJsonDocument no intermediate QJsonObject or QJsonValue is built, common QMetaType values are
+ * written straight into the buffer and strings are transcoded from UTF-16 without a temporary QByteArray. Separators
+ * are inserted automatically, so a value or key can simply follow the previous one.
+ */
+class JsonWriter
+{
+public:
+    /**
+     * @brief Construct a writer which appends to buffer.
+     * @param buffer The buffer to append to, any existing content is left untouched.
+     */
+    explicit JsonWriter(QByteArray *buffer);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    /// @brief Write an object key, key must be plain ASCII which needs no escaping.
+    void key(const char *key);
+
+    void value(const QVariant &value);
+    void value(const QString &value);
+    void value(const char *value);
+    void value(bool value);
+    void value(int value);
+    void value(qlonglong value);
+    void value(qulonglong value);
+    void value(double value);
+    void null();
+
+    /// @brief Write an already serialised JSON value.
+    void raw(const QByteArray &json);
+
+private:
+    void _separate();
+    void _string(const QChar *data, int len);
+    void _latin1(const char *data, int len);
+
+    QByteArray *_buffer;
+    int _start;
+};
+
+#endif // JSONWRITER_H
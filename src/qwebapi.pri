@@ -1,4 +1,4 @@
-QT += network websockets
+QT += network websockets concurrent
 
 INCLUDEPATH += $$PWD
 DEPENDPATH += $$PWD
@@ -8,11 +8,31 @@ SOURCES += \
     $$PWD/picohttpparser.c \
     $$PWD/websocketapi.cpp \
     $$PWD/abstractapi.cpp \
-    $$PWD/httpserver.cpp
+    $$PWD/apiregistry.cpp \
+    $$PWD/httpserver.cpp \
+    $$PWD/routetable.cpp \
+    $$PWD/jsonwriter.cpp \
+    $$PWD/apimetrics.cpp \
+    $$PWD/timerwheel.cpp \
+    $$PWD/connectionlimiter.cpp
 
 HEADERS += \
     $$PWD/restapi.h \
     $$PWD/picohttpparser.h \
     $$PWD/websocketapi.h \
     $$PWD/abstractapi.h \
-    $$PWD/httpserver.h
+    $$PWD/apiregistry.h \
+    $$PWD/httpserver.h \
+    $$PWD/routetable.h \
+    $$PWD/jsonwriter.h \
+    $$PWD/apimetrics.h \
+    $$PWD/timerwheel.h \
+    $$PWD/connectionlimiter.h
+
+# permessage-deflate WebSocket compression, needs zlib
+qwebapi_deflate {
+    DEFINES += QWEBAPI_DEFLATE
+    LIBS += -lz
+    SOURCES += $$PWD/deflatewebsocket.cpp
+    HEADERS += $$PWD/deflatewebsocket.h
+}
@@ -1,121 +1,363 @@
 #include "restapi.h"
 
-#include <QTcpServer>
-#include <QTcpSocket>
 #include <QNetworkSession>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
 
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include "picohttpparser.h"
-
 
+static bool viewIs(QLatin1String view, const char *value){
+    int len=int(strlen(value));
+    return view.size()==len && qstrnicmp(view.data(), value, uint(len))==0;
+}
 
-RestApi::RestApi(QObject *parent){
-    RestApi(QHostAddress::Any, 0, parent);
+static bool valueContains(const struct phr_header &header, const char *token){
+    size_t len=strlen(token);
+    for(size_t i=0; i+len<=header.value_len; i++){
+        if(qstrnicmp(header.value+i, token, uint(len))==0) return true;
+    }
+    return false;
 }
 
+RestApi::RestApi(QObject *parent): RestApi(QHostAddress::Any, 0, parent){}
+
 RestApi::RestApi(QHostAddress address, qint16 port, QObject *parent)
-    : AbstractApi(parent), _tcpServer(Q_NULLPTR), _networkSession(0)
+    : AbstractApi(parent), _server(new HttpServer("RestApi/0.1", this)), _networkSession(0), _metricsPath("metrics")
 {
-    _tcpServer=new QTcpServer(this);
-    if(!_tcpServer->listen(address, port)){
+    // Versions restart when the process does, so the start time keeps old ETags from matching
+    _etagPrefix="\""+QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 36)+"-";
+
+    _server->addHandler("/", [this](const HttpRequest &request, HttpResponse *response){ _handle(request, response); });
+    _server->addHandler("/events", [this](const HttpRequest &request, HttpResponse *response){
+        _handleEvents(request, response);
+    });
+    connect(this, SIGNAL(_routesNotified(int)), SLOT(_publishEvents(int)));
+    if(!_server->listen(address, quint16(port))){
         qCritical() << "Failed to start listening!";
         return;
     }
 
-    qDebug() << "REST:" << _tcpServer->serverAddress() << _tcpServer->serverPort();
+    qDebug() << "REST:" << _server->serverAddress() << _server->serverPort();
+}
 
-    connect(_tcpServer, SIGNAL(newConnection()), SLOT(_newConnection()));
+RestApi::~RestApi(){
+    // Workers call back into this object, so they are stopped before it is destroyed
+    delete _server;
 }
 
-void RestApi::_newConnection(){
-    QTcpSocket *socket=_tcpServer->nextPendingConnection();
-    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
-    connect(socket, SIGNAL(readyRead()), SLOT(_readyRead()));
+int RestApi::idleTimeout() const { return _server->idleTimeout(); }
+
+void RestApi::setIdleTimeout(int msecs){ _server->setIdleTimeout(msecs); }
+
+int RestApi::headerTimeout() const { return _server->headerTimeout(); }
+
+void RestApi::setHeaderTimeout(int msecs){ _server->setHeaderTimeout(msecs); }
+
+int RestApi::maxConnections() const { return _server->maxConnections(); }
+
+void RestApi::setMaxConnections(int count){ _server->setMaxConnections(count); }
+
+int RestApi::maxConnectionsPerHost() const { return _server->maxConnectionsPerHost(); }
+
+void RestApi::setMaxConnectionsPerHost(int count){ _server->setMaxConnectionsPerHost(count); }
+
+int RestApi::maxHeaderSize() const { return _server->maxHeaderSize(); }
+
+void RestApi::setMaxHeaderSize(int bytes){ _server->setMaxHeaderSize(bytes); }
+
+int RestApi::maxBodySize() const { return _server->maxBodySize(); }
+
+void RestApi::setMaxBodySize(int bytes){ _server->setMaxBodySize(bytes); }
+
+int RestApi::workerThreads() const { return _server->workerThreads(); }
+
+void RestApi::setWorkerThreads(int count, Scheduling scheduling){
+    _setConcurrent(count>0);
+    _server->setWorkerThreads(count, scheduling==RoundRobin ? HttpServer::RoundRobin : HttpServer::LeastConnections);
 }
 
-void RestApi::_readyRead(){
-    QTcpSocket *socket=dynamic_cast<QTcpSocket*>(sender());
-    QString request=socket->readAll();
+QString RestApi::metricsPath() const { return "/"+QString::fromUtf8(_metricsPath); }
+
+void RestApi::setMetricsPath(const QString &path){
+    // Kept in the form _handle() compares against, without leading or trailing '/'
+    QByteArray normalised=path.toUtf8();
+    while(normalised.startsWith('/')) normalised.remove(0, 1);
+    while(normalised.endsWith('/')) normalised.chop(1);
+    _metricsPath=normalised;
+}
 
-    int responseCode=200;
-    QString method, path, content, responseText="OK";
-    bool ok=_parse(request, &method, &path, &content);
-    if(!ok) { responseCode=400; responseText="Bad request"; }
+void RestApi::setMetrics(ApiMetrics *metrics){
+    AbstractApi::setMetrics(metrics);
+    _server->setMetrics(metrics, ApiMetrics::Rest);
+}
+
+ApiMetrics::Api RestApi::_metricsApi() const { return ApiMetrics::Rest; }
+
+QByteArray RestApi::_etag(quint64 version) const {
+    return _etagPrefix+QByteArray::number(version, 36)+"\"";
+}
+
+void RestApi::_handle(const HttpRequest &request, HttpResponse *response){
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    int metricsSlot=-1;
+    QByteArray etag;
+    _handleRoute(request, response, &etag, &metricsSlot);
+    if(!etag.isEmpty()){
+        // Clients may cache the value but must revalidate it on every use
+        response->headers="ETag: "+etag+"\r\nCache-Control: no-cache\r\n";
+    }
+
+    if(_metrics){
+        qint64 nsecs=timer.nsecsElapsed();
+        _metrics->recordStage(ApiMetrics::Dispatch, nsecs);
+        if(!response->complete){
+            _metrics->recordRoute(metricsSlot, nsecs, response->code>=400);
+            return;
+        }
+
+        // A deferred response counts towards its route once it is complete
+        ApiMetrics *metrics=_metrics;
+        auto complete=response->complete;
+        response->complete=[metrics, metricsSlot, timer, complete](const QVariant &result, HttpResponse *response){
+            complete(result, response);
+            metrics->recordRoute(metricsSlot, timer.nsecsElapsed(), response->code>=400);
+        };
+    }
+}
+
+void RestApi::_handleEvents(const HttpRequest &request, HttpResponse *response){
+    if(!viewIs(request.method, "GET")){
+        response->code=405;
+        response->body="Method not allowed";
+        return;
+    }
+
+    QList<QByteArray> names;
+    const char *query=static_cast<const char*>(memchr(request.path.data(), '?', size_t(request.path.size())));
+    if(query){
+        const char *end=request.path.data()+request.path.size();
+        foreach(const QByteArray &param, QByteArray(query+1, int(end-query-1)).split('&')){
+            if(!param.startsWith("props=")) continue;
+            foreach(const QByteArray &name, QByteArray::fromPercentEncoding(param.mid(6)).split(','))
+                if(!name.isEmpty()) names << name;
+        }
+    }
+
+    // Every event is queued on the stream, so the body starts out holding the current values. They carry no id, only
+    // changes are numbered.
+    if(names.isEmpty()){
+        // Reading every property could mean thousands of trips to the objects' threads, so only values already
+        // cached are sent, the others follow with their next change
+        response->topics << "*";
+        QByteArray json;
+        for(int i=0; i<_routeCount(); i++){
+            const ApiRoute *route=_routeAt(i);
+            if(_cachedJson(route, &json)) response->body+=_event(route->name, json, 0);
+        }
+    }
     else {
-        if(method.toLower()!="get" && method.toLower()!="put"){
-            responseCode=405; responseText="Method not allowed";
-        } else {
-            if(path.startsWith("/")) path=path.mid(1);
-            auto pathBits=path.split("/");
-            if(pathBits.count()<2){
-                responseCode=404; responseText="Not found";
-            } else {
-                auto clazz=pathBits[0], prop=pathBits[1];
-                if(_apiInfo.contains(clazz)){
-                    ApiInfo info=_apiInfo[clazz];
-                    if(info.properties.contains(prop)){
-                        auto mprop=info.properties[prop].prop;
-                        auto obj=info.obj.value<QObject*>();
-                        if(method.toLower()=="get"){
-                            if(mprop.isReadable())
-                                responseText=mprop.read(obj).toString();
-                        }
-                        else {
-                            if(mprop.isWritable()){
-                                auto value=QVariant(content);
-                                value.convert(mprop.type());
-                                ok=mprop.write(obj, value);
-                                if(mprop.hasNotifySignal()) emit mprop.notifySignal();
-                            }
-                        }
-                    } else { responseCode=404; responseText="Not found"; }
-                } else { responseCode=404; responseText="Not found"; }
+        foreach(const QByteArray &name, names){
+            const ApiRoute *route=_route(name.constData(), name.size());
+            if(!route || !route->prop.isReadable()){
+                response->code=404;
+                response->body="Not found";
+                response->topics.clear();
+                return;
             }
+            // Either separator may be asked for, events always carry the route's own name
+            response->topics << route->name;
+            response->body+=_event(route->name, _readJson(route), 0);
         }
     }
+    response->contentType="text/event-stream";
+    response->headers="Cache-Control: no-cache\r\n";
+}
 
-    auto now=QDateTime::currentDateTime().toString("ddd, dd MMM yyyy HH:mm:ss t");
-    auto response=QString(
-        "HTTP/1.1 %1 OK\r\n"
-        "Server: RestApi/0.1\r\n"
-        "Date: %2\r\n"
-        "Connection: close\r\n"
-        "content-type: text/plain;charset=UTF-8\r\n"
-        "Content-Length: %3\r\n\r\n"
-        "%4"
-    ).arg(responseCode).arg(now).arg(responseText.length()).arg(responseText);
+QByteArray RestApi::_event(const QByteArray &name, const QByteArray &json, quint64 id){
+    // JSON never spans lines, so the value always fits on a single data line
+    QByteArray event;
+    if(id) event="id: "+QByteArray::number(id)+"\n";
+    return event+"event: "+name+"\ndata: "+json+"\n\n";
+}
 
-    socket->write(response.toLocal8Bit());
-    socket->waitForBytesWritten();
-    socket->disconnectFromHost();
+void RestApi::_publishEvents(int notifier){
+    if(!_server->streamCount()) return;
 
-    return;
+    // Every property the signal notifies gets an event. The registry refreshed their caches before notifying, so
+    // nothing is looked up by name or serialised again
+    foreach(int id, _notifiedRoutes(notifier)){
+        const ApiRoute *route=_routeAt(id);
+        if(route->prop.isReadable()) _server->publish(route->name, _event(route->name, _readJson(route), ++_eventId));
+    }
 }
 
-bool RestApi::_parse(QString http, QString *method, QString *path, QString *content){
-    const char *_method, *_path;
-    int minorVersion;
-    size_t methodLen, pathLen;
-    struct phr_header headers[100];
+void RestApi::_handleRoute(const HttpRequest &request, HttpResponse *response, QByteArray *etag, int *metricsSlot){
+    response->code=200;
+    response->body="OK";
 
-    size_t numHeaders=sizeof(headers)/sizeof(headers[0]);
+    bool get=viewIs(request.method, "GET"), put=viewIs(request.method, "PUT"), patch=viewIs(request.method, "PATCH");
+    bool post=viewIs(request.method, "POST");
+    if(!get && !put && !patch && !post){
+        response->code=405;
+        response->body="Method not allowed";
+        return;
+    }
 
-    QByteArray bHttp=http.toLocal8Bit();
-    char *data=new char[bHttp.size()+1];
-    strcpy(data, bHttp.data());
+    // Route on the path itself, less the leading '/', any trailing '/' and any query string
+    const char *path=request.path.data();
+    int pathLen=request.path.size();
+    const char *query=static_cast<const char*>(memchr(path, '?', pathLen));
+    if(query) pathLen=int(query-path);
+    if(pathLen>0 && path[0]=='/'){ path++; pathLen--; }
+    if(pathLen>0 && path[pathLen-1]=='/') pathLen--;
 
-    int ret=phr_parse_request(data, strlen(data), &_method, &methodLen, &_path, &pathLen,
-                              &minorVersion, headers, &numHeaders, 0);
+    if(_metrics && get && pathLen==_metricsPath.size() && memcmp(path, _metricsPath.constData(), size_t(pathLen))==0){
+        response->body=_metrics->toPrometheus();
+        response->contentType="text/plain;version=0.0.4;charset=UTF-8";
+        return;
+    }
 
-    if(ret<=0) return false;
+    const ApiRoute *route=_route(path, pathLen);
+    if(!route){
+        const ApiObject *object=_object(path, pathLen);
+        const ApiCall *call=object ? Q_NULLPTR : _call(path, pathLen);
+        if(object) *metricsSlot=_metricsSlot(object);
+        if(call) *metricsSlot=_metricsSlot(call);
+        if((object && post) || (call && !post)){
+            response->code=405;
+            response->body="Method not allowed";
+            return;
+        }
+        if(object){
+            _handleObject(request, response, object);
+            return;
+        }
+        if(call){
+            _handleCall(request, response, call);
+            return;
+        }
+        response->code=404;
+        response->body="Not found";
+        return;
+    }
+    *metricsSlot=_metricsSlot(route);
+    if(patch || post){
+        response->code=405;
+        response->body="Method not allowed";
+        return;
+    }
+
+    const QMetaProperty &mprop=route->prop;
+    QObject *obj=route->obj;
+    if(get){
+        if(mprop.isReadable()){
+            // Properties with a NOTIFY signal are versioned, an unchanged value needs neither a read nor a body
+            const struct phr_header *ifNoneMatch=request.header("if-none-match");
+            if(ifNoneMatch){
+                quint64 version=_version(route);
+                if(version){
+                    *etag=_etag(version);
+                    bool any=ifNoneMatch->value_len==1 && ifNoneMatch->value[0]=='*';
+                    if(any || valueContains(*ifNoneMatch, etag->constData())){
+                        response->code=304;
+                        response->body.clear();
+                        return;
+                    }
+                }
+            }
+
+            // A getter marked thread-safe is read on the thread pool, without holding up any other request
+            if(route->threadSafe && !route->cache){
+                response->future=_readDeferred(route);
+                response->complete=[](const QVariant &result, HttpResponse *response){
+                    response->body=result.toString().toUtf8();
+                };
+                return;
+            }
 
-    *method=QString(_method);
-    method->truncate(methodLen);
-    *path=QString(_path);
-    path->truncate(pathLen);
-    *content=QString(http).mid(ret);
-    return true;
+            quint64 version=0;
+            response->body=_readText(route, &version);
+            if(version) *etag=_etag(version);
+        }
+    }
+    else {
+        if(!mprop.isWritable()){
+            response->code=405;
+            response->body="Method not allowed";
+            return;
+        }
+        auto value=QVariant(QString::fromUtf8(request.body, request.bodyLength));
+        if(!value.convert(mprop.type())){
+            response->code=400;
+            response->body="Bad request";
+            return;
+        }
+        if(route->threadSafe){
+            response->future=_writeDeferred(route, value);
+            response->complete=[](const QVariant &result, HttpResponse *response){
+                // Work which was cancelled has no result, the value was not written either way
+                if(result.toBool()) return;
+                response->code=500;
+                response->body="Internal server error";
+            };
+            return;
+        }
+        if(!_write(obj, mprop, value)){
+            response->code=500;
+            response->body="Internal server error";
+        }
+    }
+}
+
+void RestApi::_handleObject(const HttpRequest &request, HttpResponse *response, const ApiObject *object){
+    if(viewIs(request.method, "GET")){
+        response->body=_readObjectJson(object);
+        response->contentType="application/json";
+        return;
+    }
+
+    // PUT and PATCH both only touch the properties named, either every one is written or none is
+    QJsonParseError error;
+    QJsonDocument jdoc=QJsonDocument::fromJson(QByteArray::fromRawData(request.body, request.bodyLength), &error);
+    if(error.error!=QJsonParseError::NoError || !jdoc.isObject() || !_writeObject(object, jdoc.object().toVariantMap())){
+        response->code=400;
+        response->body="Bad request";
+    }
+}
+
+void RestApi::_handleCall(const HttpRequest &request, HttpResponse *response, const ApiCall *call){
+    // No body calls a method without arguments, otherwise they are a JSON array in order or an object by name
+    bool ok;
+    QVariant result;
+    if(!request.bodyLength) ok=_invoke(call, QVariantList(), &result);
+    else {
+        QJsonParseError error;
+        QJsonDocument jdoc=QJsonDocument::fromJson(QByteArray::fromRawData(request.body, request.bodyLength), &error);
+        if(error.error!=QJsonParseError::NoError) ok=false;
+        else if(jdoc.isArray()) ok=_invoke(call, jdoc.array().toVariantList(), &result);
+        else ok=_invoke(call, jdoc.object().toVariantMap(), &result);
+    }
+
+    QFuture<QVariant> future;
+    if(!ok){
+        response->code=400;
+        response->body="Bad request";
+    }
+    else if(_isDeferred(result, &future)){
+        response->future=future;
+        response->complete=[](const QVariant &result, HttpResponse *response){
+            if(!result.isValid()) return;
+            response->body=_toJson(result);
+            response->contentType="application/json";
+        };
+    }
+    else if(result.isValid()){
+        response->body=_toJson(result);
+        response->contentType="application/json";
+    }
 }
@@ -2,20 +2,72 @@
 #define WEBAPI_H
 
 #include <QObject>
+#include <QHash>
+#include <QList>
+#include <QAtomicInt>
 #include <QHostAddress>
 
 #include "abstractapi.h"
+#include "httpserver.h"
 
-class QTcpServer;
 class QNetworkSession;
 
 /**
  * @brief The RestApi class exposes a REST API corresponding to a QObjects properties as defined by the use of Q_PROPERTY.
+ * @details Connections are persistent (HTTP/1.1 keep-alive) and pipelined requests are answered in the order in
+ * which they were received. A connection which remains idle for longer than idleTimeout() is closed by the server.
+ *
+ * GET responses for properties with a NOTIFY signal carry an ETag which changes whenever the signal is emitted. A
+ * request with a matching If-None-Match header is answered with 304 Not Modified without reading the property.
+ *
+ * By default all connections are serviced on the thread the RestApi lives in. setWorkerThreads() spreads parsing,
+ * routing and serialisation over a number of I/O threads, each with its own event loop, while property reads and
+ * writes are still performed on the thread of the exposed object.
+ *
+ * A PUT whose body does not convert to the property's type is answered with 400, one on a read-only property with
+ * 405 and one whose write fails with 500.
+ *
+ * PUT bodies may be sent with Content-Length or chunked transfer encoding. Requests whose headers exceed
+ * maxHeaderSize() or whose body exceeds maxBodySize() are refused and the connection is closed.
+ *
+ * Connections beyond maxConnections(), or beyond maxConnectionsPerHost() from one address, are answered with 503 and
+ * closed. A request whose headers are not received in full within headerTimeout() is answered with 408 and its
+ * connection closed, however slowly they keep arriving.
+ *
+ * Public slots and Q_INVOKABLE methods are called with a POST to "/TestClass/method" whose body holds the arguments as
+ * a JSON array, or as an object keyed by parameter name. The return value is sent back as JSON.
+ *
+ * Requests for work which finishes later, a method returning a QFuture<QVariant> or a member the class marks as
+ * thread-safe, hold their connection open without blocking any other; later requests on that connection wait for it.
+ *
+ * Once given an ApiMetrics with setMetrics(), the metrics are served in the Prometheus text format on metricsPath().
+ *
+ * Clients which cannot use WebSockets may follow property changes as Server-Sent Events rather than polling.
+ * A GET of "/events?props=TestClass.value,TestClass.text" opens a text/event-stream which starts with the current value
+ * of each property and then carries every change, as an event named after the property with its value as JSON data
+ * and an increasing id. Without props every property is streamed, starting with the values already cached so that
+ * opening the stream never waits on the objects; the others are sent with their next change.
+ *
+ * The current values at the start of a stream carry no id. Last-Event-ID is not supported, a client which reconnects
+ * starts over from the current values rather than being sent the changes it missed.
  */
 class RestApi : public AbstractApi
 {
     Q_OBJECT
-public:   
+#ifdef QWEBAPI_TESTING
+    friend class QWebApiBenchmark;
+    friend class QWebApiTest;
+#endif
+public:
+    /**
+     * @brief How accepted connections are shared out between worker threads.
+     */
+    enum Scheduling {
+        RoundRobin,      ///< Each worker is given the next connection in turn.
+        LeastConnections ///< The worker with the fewest open connections is given the next connection.
+    };
+    Q_ENUMS(Scheduling)
+
     /**
      * @brief Constructs a RestApi object.
      * @details This constructor will create an object with address QHostAddress::Any and the next available port.
@@ -31,16 +83,130 @@ public:
      * @param parent A parent object.
      */
     RestApi(QHostAddress address, qint16 port, QObject* parent=0);
+    ~RestApi();
+
+    /**
+     * @brief The time in milliseconds after which an idle keep-alive connection is closed.
+     */
+    int idleTimeout() const;
+
+    /**
+     * @brief Set the time in milliseconds after which an idle keep-alive connection is closed.
+     * @param msecs The idle timeout, the default is 30000.
+     */
+    void setIdleTimeout(int msecs);
+
+    /**
+     * @brief The time in milliseconds within which the headers of a request must be received in full.
+     */
+    int headerTimeout() const;
+
+    /**
+     * @brief Set the time in milliseconds within which the headers of a request must be received in full.
+     * @details The timeout starts with the first byte of a request and is not extended as more bytes arrive, so a
+     * client trickling headers in cannot hold a connection open. Such requests are answered with 408.
+     * @param msecs The header timeout, the default is 10000. 0 leaves it to idleTimeout().
+     */
+    void setHeaderTimeout(int msecs);
+
+    /**
+     * @brief The number of connections which may be open at once, 0 if unlimited.
+     */
+    int maxConnections() const;
+
+    /**
+     * @brief Set the number of connections which may be open at once, any more are answered with 503 and closed.
+     * @param count The limit, the default is 0 for unlimited.
+     */
+    void setMaxConnections(int count);
+
+    /**
+     * @brief The number of connections which may be open at once from any one address, 0 if unlimited.
+     */
+    int maxConnectionsPerHost() const;
+
+    /**
+     * @brief Set the number of connections which may be open at once from any one address.
+     * @details Any more are answered with 503 and closed. Bear in mind that many clients may share an address behind
+     * a proxy or NAT.
+     * @param count The limit, the default is 0 for unlimited.
+     */
+    void setMaxConnectionsPerHost(int count);
+
+    /**
+     * @brief The largest request line and headers accepted, in bytes.
+     */
+    int maxHeaderSize() const;
+
+    /**
+     * @brief Set the largest request line and headers accepted, larger requests are answered with 431.
+     * @param bytes The limit, the default is 16384.
+     */
+    void setMaxHeaderSize(int bytes);
+
+    /**
+     * @brief The largest request body accepted, in bytes.
+     */
+    int maxBodySize() const;
+
+    /**
+     * @brief Set the largest request body accepted, larger requests are answered with 413.
+     * @param bytes The limit, the default is 1048576.
+     */
+    void setMaxBodySize(int bytes);
+
+    /**
+     * @brief The number of I/O worker threads, 0 if connections are serviced on the RestApi's own thread.
+     */
+    int workerThreads() const;
+
+    /**
+     * @brief Service connections on a pool of I/O worker threads.
+     * @details Each worker runs its own event loop. Exposed objects must live on a thread with a running event
+     * loop as their properties are accessed with blocking queued calls. Connections already open on a previous
+     * set of workers are closed. Objects must be added before worker threads are started, see ApiRegistry.
+     * @param count The number of worker threads, use QThread::idealThreadCount() for one per core or 0 to
+     * service connections on the RestApi's own thread.
+     * @param scheduling How new connections are assigned to workers.
+     */
+    void setWorkerThreads(int count, Scheduling scheduling=LeastConnections);
+
+    /**
+     * @brief The path on which metrics are served, "/metrics" by default.
+     */
+    QString metricsPath() const;
+
+    /**
+     * @brief Set the path on which metrics are served.
+     * @details Nothing is served on the path unless metrics have been set with setMetrics(). The path takes
+     * precedence over any property route of the same name.
+     * @param path The path, such as "/metrics".
+     */
+    void setMetricsPath(const QString &path);
+
+    void setMetrics(ApiMetrics *metrics) override;
+
+protected:
+    /// @private
+    ApiMetrics::Api _metricsApi() const override;
 
 private slots:
-    void _newConnection();
-    void _readyRead();
+    void _publishEvents(int notifier);
 
 private:
-    bool _parse(QString http, QString *method, QString *path, QString *content);
+    void _handle(const HttpRequest &request, HttpResponse *response);
+    void _handleEvents(const HttpRequest &request, HttpResponse *response);
+    static QByteArray _event(const QByteArray &name, const QByteArray &json, quint64 id);
+    void _handleRoute(const HttpRequest &request, HttpResponse *response, QByteArray *etag, int *metricsSlot);
+    void _handleObject(const HttpRequest &request, HttpResponse *response, const ApiObject *object);
+    void _handleCall(const HttpRequest &request, HttpResponse *response, const ApiCall *call);
+    QByteArray _etag(quint64 version) const;
 
-    QTcpServer *_tcpServer;
+    HttpServer *_server;
     QNetworkSession *_networkSession;
+    QByteArray _etagPrefix;
+    QByteArray _metricsPath;
+    QAtomicInteger<quint64> _eventId;
 };
 
 #endif // WEBAPI_H
@@ -0,0 +1,97 @@
+#include "routetable.h"
+
+// '/' and '.' are interchangeable separators, neither can appear in a C++ identifier
+static inline uint normalise(uint c){ return c=='/' ? '.' : c; }
+
+RouteTable::RouteTable(): _count(0){}
+
+template<typename C> uint RouteTable::_hash(const C *name, int len){
+    // FNV-1a
+    uint h=2166136261u;
+    for(int i=0; i<len; i++){
+        h^=normalise(uint(name[i]));
+        h*=16777619u;
+    }
+    return h;
+}
+
+template<typename C> bool RouteTable::_equals(const QByteArray &key, const C *name, int len){
+    if(key.size()!=len) return false;
+    const char *k=key.constData();
+    for(int i=0; i<len; i++){
+        if(uint(uchar(k[i]))!=normalise(uint(name[i]))) return false;
+    }
+    return true;
+}
+
+template<typename C> int RouteTable::_find(const C *name, int len) const {
+    if(_entries.isEmpty()) return -1;
+
+    uint h=_hash(name, len);
+    int mask=_entries.size()-1;
+    for(int i=int(h)&mask; ; i=(i+1)&mask){
+        const Entry &entry=_entries.at(i);
+        if(entry.id<0) return -1;
+        if(entry.hash==h && _equals(entry.name, name, len)) return entry.id;
+    }
+}
+
+void RouteTable::insert(const QByteArray &name, int id){
+    // Keep the load factor at or below one half so probe sequences stay short
+    if((_count+1)*2>_entries.size()) _rehash(qMax(16, _entries.size()*2));
+
+    const uchar *data=reinterpret_cast<const uchar*>(name.constData());
+    uint h=_hash(data, name.size());
+    int mask=_entries.size()-1;
+    for(int i=int(h)&mask; ; i=(i+1)&mask){
+        Entry &entry=_entries[i];
+        if(entry.id<0){
+            entry.name=name;
+            entry.hash=h;
+            entry.id=id;
+            _count++;
+            return;
+        }
+        if(entry.hash==h && _equals(entry.name, data, name.size())){
+            entry.id=id;
+            return;
+        }
+    }
+}
+
+int RouteTable::find(const char *name, int len) const { return _find(reinterpret_cast<const uchar*>(name), len); }
+
+int RouteTable::find(const QString &name) const {
+    // Keys are UTF-8, so only ASCII names compare code unit for code unit, any other is converted first
+    const ushort *data=name.utf16();
+    for(int i=0; i<name.size(); i++){
+        if(data[i]>=0x80){
+            QByteArray utf8=name.toUtf8();
+            return _find(reinterpret_cast<const uchar*>(utf8.constData()), utf8.size());
+        }
+    }
+    return _find(data, name.size());
+}
+
+int RouteTable::count() const { return _count; }
+
+void RouteTable::clear(){
+    _entries.clear();
+    _count=0;
+}
+
+void RouteTable::_rehash(int capacity){
+    QVector<Entry> old=_entries;
+    Entry empty;
+    empty.hash=0;
+    empty.id=-1;
+    _entries=QVector<Entry>(capacity, empty);
+
+    int mask=capacity-1;
+    for(const Entry &entry: old){
+        if(entry.id<0) continue;
+        int i=int(entry.hash)&mask;
+        while(_entries.at(i).id>=0) i=(i+1)&mask;
+        _entries[i]=entry;
+    }
+}
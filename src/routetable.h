@@ -0,0 +1,61 @@
+#ifndef ROUTETABLE_H
+#define ROUTETABLE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+/**
+ * @private
+ * @brief An open addressing hash table mapping "Class.member" names to integer route ids.
+ * @details Names are stored once at registration time. Lookups accept either '.' or '/' as the separator,
+ * so the same table serves JSON RPC method names and REST paths, and never allocate unless a UTF-16 name is not
+ * ASCII.
+ */
+class RouteTable
+{
+public:
+    RouteTable();
+
+    /**
+     * @brief Add or replace a route.
+     * @param name The route name, segments separated by '.'.
+     * @param id The id returned by find().
+     */
+    void insert(const QByteArray &name, int id);
+
+    /**
+     * @brief Find a route from a Latin-1 name such as "Class/prop" or "Class.prop".
+     * @return The route id or -1 if there is no such route.
+     */
+    int find(const char *name, int len) const;
+
+    /**
+     * @brief Find a route from a UTF-16 name such as "Class.prop", matched against the UTF-8 encoded route names.
+     * @return The route id or -1 if there is no such route.
+     */
+    int find(const QString &name) const;
+
+    /// @brief The number of routes in the table.
+    int count() const;
+
+    /// @brief Remove all routes.
+    void clear();
+
+private:
+    typedef struct Entry {
+        QByteArray name;
+        uint hash;
+        int id;
+    } Entry;
+
+    template<typename C> static uint _hash(const C *name, int len);
+    template<typename C> static bool _equals(const QByteArray &key, const C *name, int len);
+    template<typename C> int _find(const C *name, int len) const;
+    void _rehash(int capacity);
+
+    QVector<Entry> _entries;
+    int _count;
+};
+
+#endif // ROUTETABLE_H
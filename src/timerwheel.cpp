@@ -0,0 +1,70 @@
+#include "timerwheel.h"
+
+#include <QTimer>
+
+TimerWheel::TimerWheel(int resolution, QObject *parent)
+    : QObject(parent), _resolution(qMax(1, resolution)), _timer(new QTimer(this)), _current(0), _slots(SlotCount)
+{
+    _timer->setInterval(_resolution);
+    connect(_timer, SIGNAL(timeout()), SLOT(_tick()));
+    _clock.start();
+}
+
+void TimerWheel::start(QObject *key, int msecs){
+    if(msecs<=0){
+        stop(key);
+        return;
+    }
+
+    // Rounded up, a timeout never fires early
+    qint64 deadline=(_clock.elapsed()+msecs)/_resolution+1;
+    auto it=_deadlines.find(key);
+    if(it!=_deadlines.end()){
+        if(it.value()==deadline) return;
+        _slots[int(it.value()%SlotCount)].remove(key);
+        it.value()=deadline;
+    } else {
+        if(_deadlines.isEmpty()){
+            _current=_now();
+            _timer->start();
+        }
+        _deadlines.insert(key, deadline);
+    }
+    _slots[int(deadline%SlotCount)].insert(key);
+}
+
+void TimerWheel::stop(QObject *key){
+    auto it=_deadlines.find(key);
+    if(it==_deadlines.end()) return;
+    _slots[int(it.value()%SlotCount)].remove(key);
+    _deadlines.erase(it);
+    if(_deadlines.isEmpty()) _timer->stop();
+}
+
+bool TimerWheel::isActive(QObject *key) const { return _deadlines.contains(key); }
+
+void TimerWheel::_tick(){
+    // Catches up on every tick missed while the event loop was busy
+    qint64 now=_now();
+    while(_current<now && !_deadlines.isEmpty()){
+        _current++;
+        QSet<QObject*> &slot=_slots[int(_current%SlotCount)];
+        if(slot.isEmpty()) continue;
+
+        QList<QObject*> due;
+        foreach(QObject *key, slot){
+            if(_deadlines.value(key)<=_current) due << key;
+        }
+        foreach(QObject *key, due){
+            // A handler may have stopped or restarted a key which was due, it is only looked up, never dereferenced
+            auto it=_deadlines.find(key);
+            if(it==_deadlines.end() || it.value()>_current) continue;
+            _deadlines.erase(it);
+            slot.remove(key);
+            emit expired(key);
+        }
+    }
+    if(_deadlines.isEmpty()) _timer->stop();
+}
+
+qint64 TimerWheel::_now() const { return _clock.elapsed()/_resolution; }
@@ -0,0 +1,61 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QElapsedTimer>
+
+class QTimer;
+
+/**
+ * @private
+ * @brief Timeouts for any number of objects driven by a single timer.
+ * @details Deadlines are rounded up to the wheel's resolution and each key sits in the slot of the tick it expires
+ * on, so starting, restarting and stopping a timeout is a hash lookup and a set insertion whatever the number of
+ * keys, and restarting within the same tick does nothing at all. Deadlines further out than one turn of the wheel
+ * stay in their slot until the turn they are due. The timer only runs while a timeout is pending. Not thread-safe,
+ * the wheel is used from the thread it lives in.
+ */
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Construct a TimerWheel.
+     * @param resolution The length of a tick in milliseconds, timeouts fire up to this much late.
+     * @param parent A parent object.
+     */
+    explicit TimerWheel(int resolution, QObject *parent=0);
+
+    /// @brief Start or restart the timeout of key, a timeout of 0 or less stops it.
+    void start(QObject *key, int msecs);
+
+    /// @brief Stop the timeout of key, if any. Keys must be stopped before they are deleted.
+    void stop(QObject *key);
+
+    /// @brief Whether key has a timeout pending.
+    bool isActive(QObject *key) const;
+
+signals:
+    /// @brief The timeout of key has passed, it is no longer active.
+    void expired(QObject *key);
+
+private slots:
+    void _tick();
+
+private:
+    enum { SlotCount=256 };
+
+    qint64 _now() const;
+
+    int _resolution;
+    QTimer *_timer;
+    QElapsedTimer _clock;
+    qint64 _current;                    // The last tick processed
+    QVector<QSet<QObject*> > _slots;
+    QHash<QObject*, qint64> _deadlines; // The tick each key expires on
+};
+
+#endif // TIMERWHEEL_H
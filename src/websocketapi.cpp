@@ -2,21 +2,81 @@
 
 #include <QWebSocketServer>
 #include <QWebSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
 
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QCborValue>
+#include <QCborMap>
+#include <QCborArray>
 
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QPointer>
 #include <QDebug>
 
-WebSocketApi::WebSocketApi(QObject *parent){
-    WebSocketApi(QHostAddress::Any, 0, parent);
+#include "jsonwriter.h"
+#include "timerwheel.h"
+#ifdef QWEBAPI_DEFLATE
+#include "deflatewebsocket.h"
+#endif
+
+// Timeouts fire up to this many milliseconds late, in exchange for costing nothing per connection
+static const int TimeoutResolution=250;
+
+// Appends a CBOR item head, the major type in the top three bits followed by the argument
+static void cborHead(QByteArray &out, quint8 major, quint64 value){
+    major<<=5;
+    if(value<24) out+=char(major|value);
+    else if(value<=0xff){ out+=char(major|24); out+=char(value); }
+    else if(value<=0xffff){ out+=char(major|25); for(int i=1; i>=0; i--) out+=char(value>>(i*8)); }
+    else if(value<=0xffffffffu){ out+=char(major|26); for(int i=3; i>=0; i--) out+=char(value>>(i*8)); }
+    else { out+=char(major|27); for(int i=7; i>=0; i--) out+=char(value>>(i*8)); }
+}
+
+static void cborText(QByteArray &out, const QByteArray &text){
+    cborHead(out, 3, quint64(text.size()));
+    out+=text;
+}
+
+static void cborInt(QByteArray &out, qint64 value){
+    if(value>=0) cborHead(out, 0, quint64(value));
+    else cborHead(out, 1, quint64(-1-value));
 }
 
+WebSocketApi::WebSocketApi(QObject *parent): WebSocketApi(QHostAddress::Any, 0, parent){}
+
 WebSocketApi::WebSocketApi(QHostAddress address, qint16 port, QObject *parent)
     : AbstractApi(parent),
-      _socketServer(new QWebSocketServer("WebSocketApi", QWebSocketServer::NonSecureMode, this))
+      _socketServer(new QWebSocketServer("WebSocketApi", QWebSocketServer::NonSecureMode, this)),
+      _tcpServer(Q_NULLPTR),
+      _compression(false),
+      _windowBits(15),
+      _contextTakeover(true),
+      _autoSubscribe(true),
+      _flushTimer(new QTimer(this)),
+      _coalesceInterval(-1),
+      _defaultMinInterval(0),
+      _maxPendingBytes(1024*1024),
+      _slowClientPolicy(Conflate),
+      _metricsTimer(Q_NULLPTR),
+      _timeouts(new TimerWheel(TimeoutResolution, this)),
+      _handshakeTimeout(10000),
+      _idleTimeout(0),
+      _maxMessageSize(16*1024*1024)
 {
+    _clock.start();
+    _buffer.reserve(1024); // Reserved capacity survives resize(0), so the buffer is reused between notifications
+    _flushTimer->setSingleShot(true);
+    connect(_flushTimer, SIGNAL(timeout()), SLOT(_flush()));
+    connect(_timeouts, SIGNAL(expired(QObject*)), SLOT(_expired(QObject*)));
+#if QT_VERSION>=QT_VERSION_CHECK(5, 14, 0)
+    _socketServer->setHandshakeTimeout(_handshakeTimeout);
+#endif
+
     if(!_socketServer->listen(address, port)){
         qCritical() << "Failed to start listening";
         return;
@@ -26,47 +86,361 @@ WebSocketApi::WebSocketApi(QHostAddress address, qint16 port, QObject *parent)
 
     connect(_socketServer, SIGNAL(newConnection()), SLOT(_newConnection()));
     connect(_socketServer, SIGNAL(closed()), SIGNAL(closed()));
-    connect(this, SIGNAL(_signalEmitted(QString,QVariant)), SLOT(_sendSignal(QString,QVariant)));
+    connect(this, SIGNAL(_signalEmitted(QString,QStringList,QVariant)), SLOT(_sendSignal(QString,QStringList,QVariant)));
 }
 
 WebSocketApi::~WebSocketApi(){
     _socketServer->close();
+    if(_tcpServer) _tcpServer->close();
     qDeleteAll(_clients.begin(), _clients.end());
 }
 
+bool WebSocketApi::autoSubscribe() const { return _autoSubscribe; }
+
+void WebSocketApi::setAutoSubscribe(bool enabled){ _autoSubscribe=enabled; }
+
+int WebSocketApi::coalesceInterval() const { return _coalesceInterval; }
+
+void WebSocketApi::setCoalesceInterval(int msecs){ _coalesceInterval=qMax(-1, msecs); }
+
+double WebSocketApi::maxRate(const QString &method) const {
+    int minInterval=method.isEmpty() ? _defaultMinInterval : _minInterval(method);
+    return minInterval>0 ? 1000.0/minInterval : 0;
+}
+
+void WebSocketApi::setMaxRate(double hz, const QString &method){
+    int minInterval=hz>0 ? qMax(1, qRound(1000.0/hz)) : 0;
+    if(method.isEmpty()) _defaultMinInterval=minInterval;
+    else _minIntervals[method]=minInterval;
+}
+
+qint64 WebSocketApi::maxPendingBytes() const { return _maxPendingBytes; }
+
+void WebSocketApi::setMaxPendingBytes(qint64 bytes){ _maxPendingBytes=qMax(Q_INT64_C(0), bytes); }
+
+WebSocketApi::SlowClientPolicy WebSocketApi::slowClientPolicy() const { return _slowClientPolicy; }
+
+void WebSocketApi::setSlowClientPolicy(SlowClientPolicy policy){ _slowClientPolicy=policy; }
+
+QList<WebSocketApi::ClientStatistics> WebSocketApi::clientStatistics() const {
+    QList<ClientStatistics> statistics;
+    foreach(QObject *client, _clients){
+        ClientStatistics stats;
+#ifdef QWEBAPI_DEFLATE
+        if(DeflateWebSocket *socket=qobject_cast<DeflateWebSocket*>(client)){
+            stats.peerAddress=socket->peerAddress();
+            stats.peerPort=socket->peerPort();
+        } else
+#endif
+        {
+            QWebSocket *socket=static_cast<QWebSocket*>(client);
+            stats.peerAddress=socket->peerAddress();
+            stats.peerPort=socket->peerPort();
+        }
+        const Outbound outbound=_outbound.value(client);
+        stats.queuedBytes=_bytesToWrite(client);
+        stats.backlog=outbound.backlog.count();
+        stats.droppedMessages=outbound.dropped;
+        statistics << stats;
+    }
+    return statistics;
+}
+
+int WebSocketApi::maxConnections() const { return _limiter.maxConnections(); }
+
+void WebSocketApi::setMaxConnections(int count){ _limiter.setMaxConnections(count); }
+
+int WebSocketApi::maxConnectionsPerHost() const { return _limiter.maxConnectionsPerHost(); }
+
+void WebSocketApi::setMaxConnectionsPerHost(int count){ _limiter.setMaxConnectionsPerHost(count); }
+
+int WebSocketApi::handshakeTimeout() const { return _handshakeTimeout; }
+
+void WebSocketApi::setHandshakeTimeout(int msecs){
+    _handshakeTimeout=qMax(0, msecs);
+#if QT_VERSION>=QT_VERSION_CHECK(5, 14, 0)
+    _socketServer->setHandshakeTimeout(_handshakeTimeout>0 ? _handshakeTimeout : -1);
+#endif
+}
+
+int WebSocketApi::idleTimeout() const { return _idleTimeout; }
+
+void WebSocketApi::setIdleTimeout(int msecs){ _idleTimeout=qMax(0, msecs); }
+
+qint64 WebSocketApi::maxMessageSize() const { return _maxMessageSize; }
+
+void WebSocketApi::setMaxMessageSize(qint64 bytes){ _maxMessageSize=qMax(Q_INT64_C(1), bytes); }
+
+bool WebSocketApi::compression() const { return _compression; }
+
+void WebSocketApi::setCompression(bool enabled, int windowBits, bool contextTakeover){
+#ifdef QWEBAPI_DEFLATE
+    _windowBits=qBound(9, windowBits, 15);
+    _contextTakeover=contextTakeover;
+    if(enabled==_compression) return;
+
+    // Only one of the two servers listens at a time, the other takes over the same address and port
+    if(enabled){
+        if(!_tcpServer){
+            _tcpServer=new QTcpServer(this);
+            connect(_tcpServer, SIGNAL(newConnection()), SLOT(_newTcpConnection()));
+        }
+        QHostAddress address=_socketServer->serverAddress();
+        quint16 port=_socketServer->serverPort();
+        _socketServer->close();
+        if(!_tcpServer->listen(address, port)){
+            qCritical() << "Failed to start listening";
+            _socketServer->listen(address, port);
+            return;
+        }
+    } else {
+        QHostAddress address=_tcpServer->serverAddress();
+        quint16 port=_tcpServer->serverPort();
+        _tcpServer->close();
+        if(!_socketServer->listen(address, port)){
+            qCritical() << "Failed to start listening";
+            return;
+        }
+    }
+    _compression=enabled;
+#else
+    Q_UNUSED(windowBits)
+    Q_UNUSED(contextTakeover)
+    if(enabled) qWarning() << "WebSocketApi: permessage-deflate requires building with CONFIG+=qwebapi_deflate";
+#endif
+}
+
 void WebSocketApi::_newConnection(){
     QWebSocket *socket=_socketServer->nextPendingConnection();
+    if(!_admit(socket, socket->peerAddress())) return;
+#if QT_VERSION>=QT_VERSION_CHECK(5, 15, 0)
+    socket->setMaxAllowedIncomingMessageSize(quint64(_maxMessageSize));
+#endif
+    _addClient(socket);
+}
+
+void WebSocketApi::_newTcpConnection(){
+#ifdef QWEBAPI_DEFLATE
+    while(_tcpServer->hasPendingConnections()){
+        DeflateWebSocket *socket=new DeflateWebSocket(_tcpServer->nextPendingConnection(), _windowBits, _contextTakeover, this);
+        // Counted from before the handshake, so that connections which never complete one are limited too
+        if(!_admit(socket, socket->peerAddress())) continue;
+        socket->setMaxMessageSize(_maxMessageSize);
+
+        // It only becomes a client once the handshake succeeds but must be cleaned up either way
+        connect(socket, SIGNAL(connected()), SLOT(_clientConnected()));
+        connect(socket, SIGNAL(disconnected()), SLOT(_disconnected()));
+        _timeouts->start(socket, _handshakeTimeout);
+    }
+#endif
+}
+
+void WebSocketApi::_clientConnected(){
+    _addClient(sender());
+}
+
+bool WebSocketApi::_admit(QObject *socket, const QHostAddress &address){
+    ApiMetrics::Rejection reason;
+    if(!_limiter.acquire(address, &reason)){
+        if(_metrics) _metrics->connectionRejected(ApiMetrics::WebSocket, reason);
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        _close(socket);
+        return false;
+    }
+    _peers.insert(socket, address);
+    return true;
+}
+
+void WebSocketApi::_addClient(QObject *socket){
     connect(socket, SIGNAL(textMessageReceived(QString)), SLOT(_processText(QString)));
     connect(socket, SIGNAL(binaryMessageReceived(QByteArray)), SLOT(_processBinary(QByteArray)));
-    connect(socket, SIGNAL(disconnected()), SLOT(_disconnected()));
+    connect(socket, SIGNAL(bytesWritten(qint64)), SLOT(_bytesWritten()));
+    connect(socket, SIGNAL(disconnected()), SLOT(_disconnected()), Qt::UniqueConnection);
     _clients << socket;
+    _outbound.insert(socket, Outbound());
+    if(_metrics) _metrics->connectionOpened(ApiMetrics::WebSocket);
+    _timeouts->start(socket, _idleTimeout); // Also ends any handshake timeout
+
+    if(_autoSubscribe){
+        _subscribers["*"].insert(socket);
+        _subscriptions[socket].insert("*");
+    }
+}
+
+void WebSocketApi::_sendText(QObject *client, const QString &message){
+#ifdef QWEBAPI_DEFLATE
+    if(DeflateWebSocket *socket=qobject_cast<DeflateWebSocket*>(client)){
+        socket->sendTextMessage(message);
+        return;
+    }
+#endif
+    static_cast<QWebSocket*>(client)->sendTextMessage(message);
+}
+
+void WebSocketApi::_sendBinary(QObject *client, const QByteArray &message){
+#ifdef QWEBAPI_DEFLATE
+    if(DeflateWebSocket *socket=qobject_cast<DeflateWebSocket*>(client)){
+        socket->sendBinaryMessage(message);
+        return;
+    }
+#endif
+    static_cast<QWebSocket*>(client)->sendBinaryMessage(message);
+}
+
+qint64 WebSocketApi::_bytesToWrite(QObject *client) const {
+#ifdef QWEBAPI_DEFLATE
+    if(DeflateWebSocket *socket=qobject_cast<DeflateWebSocket*>(client)) return socket->bytesToWrite();
+#endif
+    return static_cast<QWebSocket*>(client)->bytesToWrite();
+}
+
+bool WebSocketApi::_holdBack(QObject *client, const QString &methodName, const QVariant &value){
+    if(_maxPendingBytes<=0) return false;
+
+    // Once a backlog exists everything joins it, so a newer value is never overtaken by an older one
+    Outbound &outbound=_outbound[client];
+    if(outbound.backlog.isEmpty() && _bytesToWrite(client)<_maxPendingBytes) return false;
+
+    switch(_slowClientPolicy){
+    case Drop:
+        outbound.dropped++;
+        if(_metrics) _metrics->notificationsDropped(1);
+        break;
+    case Conflate: {
+        auto held=outbound.backlog.find(methodName);
+        if(held==outbound.backlog.end()) outbound.backlog.insert(methodName, value);
+        else {
+            *held=value;
+            outbound.dropped++;
+            if(_metrics) _metrics->notificationsDropped(1);
+        }
+        break;
+    }
+    case Disconnect:
+        outbound.dropped++;
+        if(_metrics) _metrics->notificationsDropped(1);
+        qWarning() << "WebSocketApi: disconnecting slow client" << client;
+        _close(client);
+        break;
+    }
+    return true;
 }
 
 void WebSocketApi::_processText(QString message){
-    QWebSocket *socket=dynamic_cast<QWebSocket*>(sender());
-    socket->sendTextMessage(_parseMessage(message));
+    QObject *socket=sender();
+    if(_idleTimeout>0) _timeouts->start(socket, _idleTimeout);
+
+    // Notifications follow the encoding of the client's latest request
+    _cborClients.remove(socket);
+    QByteArray response=_parseMessage(socket, message);
+    if(response.isEmpty()) return;
+
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    _sendText(socket, QString::fromUtf8(response));
+    if(_metrics) _metrics->recordStage(ApiMetrics::Send, timer.nsecsElapsed());
 }
 
-QString WebSocketApi::_parseMessage(QString message){
-    QJsonDocument jdoc=QJsonDocument::fromJson(message.toLatin1());
-    if(!jdoc.isObject()) return _toError(PARSE_ERROR);
+void WebSocketApi::_processBinary(QByteArray message){
+    QObject *socket=sender();
+    if(_idleTimeout>0) _timeouts->start(socket, _idleTimeout);
 
-    QJsonObject jobj=jdoc.object();
-    if(!(jobj.contains("jsonrpc") && jobj.contains("id") && jobj.contains("method")))
-        return _toError(INVALID_REQUEST);
+    // A client which talks CBOR is answered, and notified, in CBOR until it next sends a text frame
+    _cborClients.insert(socket);
+    QByteArray response=_parseCbor(socket, message);
+    if(response.isEmpty()) return;
 
-    QJsonValue jsonrpc=jobj["jsonrpc"];
-    if(!(jsonrpc.isString() && jsonrpc.toString()=="2.0"))
-        return _toError(INVALID_REQUEST);
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    _sendBinary(socket, response);
+    if(_metrics) _metrics->recordStage(ApiMetrics::Send, timer.nsecsElapsed());
+}
+
+QByteArray WebSocketApi::_parseMessage(QObject *client, QString message){
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    QJsonParseError error;
+    QJsonDocument jdoc=QJsonDocument::fromJson(message.toUtf8(), &error);
+    if(_metrics) _metrics->recordStage(ApiMetrics::Parse, timer.nsecsElapsed());
+    if(error.error!=QJsonParseError::NoError) return _toError(PARSE_ERROR, NullId, Json);
+    if(jdoc.isObject()) return _processRequest(client, jdoc.object(), Json);
+    if(!jdoc.isArray() || jdoc.array().isEmpty()) return _toError(INVALID_REQUEST, NullId, Json);
+    return _processBatch(client, jdoc.array(), Json);
+}
+
+QByteArray WebSocketApi::_parseCbor(QObject *client, const QByteArray &message){
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    QCborParserError error;
+    QCborValue cbor=QCborValue::fromCbor(message, &error);
+    if(_metrics) _metrics->recordStage(ApiMetrics::Parse, timer.nsecsElapsed());
+    if(error.error!=QCborError::NoError) return _toError(PARSE_ERROR, NullId, Cbor);
 
+    // Requests are a handful of small items, the converted map shares the request handling with JSON
+    if(cbor.isMap()) return _processRequest(client, cbor.toMap().toJsonObject(), Cbor);
+    if(!cbor.isArray() || cbor.toArray().isEmpty()) return _toError(INVALID_REQUEST, NullId, Cbor);
+    return _processBatch(client, cbor.toArray().toJsonArray(), Cbor);
+}
+
+QByteArray WebSocketApi::_processBatch(QObject *client, const QJsonArray &jrequests, Encoding encoding){
+    // Every entry is processed in order and all responses go back in a single frame
+    QSharedPointer<Batch> batch(new Batch);
+    _batch=batch;
+    foreach(const QJsonValue &jrequest, jrequests){
+        QByteArray response=jrequest.isObject() ? _processRequest(client, jrequest.toObject(), encoding)
+                                                : _toError(INVALID_REQUEST, NullId, encoding);
+        if(!response.isEmpty()) batch->responses << response;
+    }
+    _batch.clear();
+
+    // Deferred members finish later, the last of them sends the batch
+    if(batch->pending) return QByteArray();
+    return _joinBatch(batch->responses, encoding);
+}
+
+QByteArray WebSocketApi::_joinBatch(const QList<QByteArray> &responses, Encoding encoding){
+    QList<QByteArray> answered;
+    foreach(const QByteArray &response, responses){
+        if(!response.isEmpty()) answered << response;
+    }
+    if(answered.isEmpty()) return QByteArray(); // Nothing but notifications
+
+    QByteArray batch;
+    if(encoding==Cbor){
+        cborHead(batch, 4, quint64(answered.count()));
+        foreach(const QByteArray &response, answered) batch+=response;
+    } else {
+        batch="["+answered.join(',')+"]";
+    }
+    return batch;
+}
+
+QByteArray WebSocketApi::_processRequest(QObject *client, const QJsonObject &jobj, Encoding encoding){
+    // Errors echo the id whenever it can be read, even if the rest of the request is invalid
     QJsonValue jid=jobj["id"];
-    if(!jid.isDouble() && jid.toDouble()>0) return _toError(INVALID_REQUEST);
-    int id=jid.toInt();
+    int id=jid.isDouble() ? jid.toInt() : int(NullId);
+    if(!(jobj.contains("jsonrpc") && jobj.contains("method")))
+        return _toError(INVALID_REQUEST, id, encoding);
+
+    QJsonValue jsonrpc=jobj["jsonrpc"];
+    if(!(jsonrpc.isString() && jsonrpc.toString()=="2.0"))
+        return _toError(INVALID_REQUEST, id, encoding);
 
     QJsonValue jmethod=jobj["method"];
-    if(!jmethod.isString()) return _toError(INVALID_REQUEST);
+    if(!jmethod.isString()) return _toError(INVALID_REQUEST, id, encoding);
     QString method=jmethod.toString();
 
+    // A request without an id is a notification, it is carried out but never answered
+    if(!jobj.contains("id")){
+        _dispatch(client, method, jobj, 0, encoding);
+        return QByteArray();
+    }
+
+    if(!jid.isDouble()) return _toError(INVALID_REQUEST, NullId, encoding);
+    return _dispatch(client, method, jobj, id, encoding);
+}
+
+QByteArray WebSocketApi::_dispatch(QObject *client, const QString &method, const QJsonObject &jobj, int id, Encoding encoding){
     QVariant arg;
     QVariantList args;
     if(jobj.contains("params")){
@@ -75,92 +449,479 @@ QString WebSocketApi::_parseMessage(QString message){
         else arg=jparams.toVariant();
     }
 
-    auto mbits=method.split(".");
-    if(mbits.count()!=2) return _toError(METHOD_NOT_FOUND, id);
-
-    auto clazz=mbits[0], prop=mbits[1];
-    if(_apiInfo.contains(clazz)){
-        ApiInfo info=_apiInfo[clazz];
-        if(info.properties.contains(prop)){
-            auto mprop=info.properties[prop].prop;
-            auto obj=info.obj.value<QObject*>();
-
-            if(arg.isNull()&&args.isEmpty()){
-                if(mprop.isReadable()) return _toResponse(mprop.read(obj), id);
-                else return _toError(METHOD_NOT_FOUND, id);
-            } else {
-                if(args.count()>1) return _toError(INVALID_PARAMS, id);
-                else if(!args.isEmpty()) arg=args[0];
-                arg.convert(mprop.type());
-                bool ok=mprop.write(obj,arg);
-                if(!ok) return _toError(INTERNAL_ERROR, id);
-                return _toResponse("OK",id);
+    if(method=="subscribe" || method=="unsubscribe") return _subscribe(client, method, arg, args, id, encoding);
+    if(method.endsWith(".*")) return _dispatchObject(method, arg, args, id, encoding);
+
+    // Notifications are carried out but never answered, not even once deferred work finishes
+    bool reply=jobj.contains("id");
+    const ApiRoute *route=_route(method);
+    if(!route){
+        const ApiCall *call=_call(method);
+        if(call) return _dispatchCall(client, call, arg, args, id, reply, encoding);
+        return _toError(METHOD_NOT_FOUND, id, encoding);
+    }
+
+    const QMetaProperty &mprop=route->prop;
+    QObject *obj=route->obj;
+
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    QByteArray response;
+    bool ok=true;
+    if(arg.isNull()&&args.isEmpty()){
+        ok=mprop.isReadable();
+        if(ok && route->threadSafe && !route->cache){
+            _defer(client, _readDeferred(route), encoding, [this, id, reply, encoding](const QVariant &result){
+                return reply ? _toResponse(_encode(result, encoding), id, encoding) : QByteArray();
+            });
+        }
+        else if(ok) response=_toResponse(encoding==Cbor ? _readCbor(route) : _readJson(route), id, encoding);
+        else response=_toError(METHOD_NOT_FOUND, id, encoding);
+    } else if(args.count()>1){
+        ok=false;
+        response=_toError(INVALID_PARAMS, id, encoding);
+    } else {
+        if(!args.isEmpty()) arg=args[0];
+        arg.convert(mprop.type());
+        if(route->threadSafe){
+            _defer(client, _writeDeferred(route, arg), encoding, [this, id, reply, encoding](const QVariant &result){
+                if(!reply) return QByteArray();
+                if(!result.toBool()) return _toError(INTERNAL_ERROR, id, encoding);
+                return _toResponse(_encode("OK", encoding), id, encoding);
+            });
+        } else {
+            ok=_write(obj, mprop, arg);
+            if(!ok) response=_toError(INTERNAL_ERROR, id, encoding);
+            else response=_toResponse(_encode("OK", encoding), id, encoding);
+        }
+    }
+
+    if(_metrics){
+        qint64 nsecs=timer.nsecsElapsed();
+        _metrics->recordStage(ApiMetrics::Dispatch, nsecs);
+        _metrics->recordRoute(_metricsSlot(route), nsecs, !ok);
+    }
+    return response;
+}
+
+QByteArray WebSocketApi::_dispatchObject(const QString &method, const QVariant &arg, const QVariantList &args, int id,
+                                         Encoding encoding){
+    const ApiObject *object=_object(method.left(method.size()-2));
+    if(!object) return _toError(METHOD_NOT_FOUND, id, encoding);
+
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    QByteArray response;
+    bool ok=true;
+    if(arg.isNull()&&args.isEmpty()){
+        // Every readable property as one object
+        response=_toResponse(encoding==Cbor ? _toCbor(_readObject(object)) : _readObjectJson(object), id, encoding);
+    } else {
+        QVariant values=args.count()==1 ? args[0] : arg;
+        ok=values.type()==QVariant::Map && _writeObject(object, values.toMap());
+        if(!ok) response=_toError(INVALID_PARAMS, id, encoding);
+        else response=_toResponse(_encode("OK", encoding), id, encoding);
+    }
+
+    if(_metrics){
+        qint64 nsecs=timer.nsecsElapsed();
+        _metrics->recordStage(ApiMetrics::Dispatch, nsecs);
+        _metrics->recordRoute(_metricsSlot(object), nsecs, !ok);
+    }
+    return response;
+}
+
+QByteArray WebSocketApi::_dispatchCall(QObject *client, const ApiCall *call, const QVariant &arg, const QVariantList &args,
+                                       int id, bool reply, Encoding encoding){
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+
+    // Params given by name are matched to the parameter names, anything else is positional
+    QVariant result;
+    bool ok;
+    if(arg.type()==QVariant::Map) ok=_invoke(call, arg.toMap(), &result);
+    else ok=_invoke(call, arg.isNull() ? args : QVariantList() << arg, &result);
+
+    QByteArray response;
+    QFuture<QVariant> future;
+    if(!ok) response=_toError(INVALID_PARAMS, id, encoding);
+    else if(_isDeferred(result, &future)){
+        // Answered whenever the work finishes, which may well be after later requests
+        _defer(client, future, encoding, [this, id, reply, encoding](const QVariant &result){
+            if(!reply) return QByteArray();
+            return _toResponse(_encode(result.isValid() ? result : QVariant("OK"), encoding), id, encoding);
+        });
+    }
+    else response=_toResponse(_encode(result.isValid() ? result : QVariant("OK"), encoding), id, encoding);
+
+    if(_metrics){
+        qint64 nsecs=timer.nsecsElapsed();
+        _metrics->recordStage(ApiMetrics::Dispatch, nsecs);
+        _metrics->recordRoute(_metricsSlot(call), nsecs, !ok);
+    }
+    return response;
+}
+
+void WebSocketApi::_defer(QObject *client, const QFuture<QVariant> &future, Encoding encoding,
+                          std::function<QByteArray(const QVariant &result)> respond){
+    QPointer<QObject> guard(client);
+    QSharedPointer<Batch> batch=_batch;
+    int index=-1;
+    if(batch){
+        // Holds the member's place in the batch, the watcher fills it in
+        index=batch->responses.count();
+        batch->responses << QByteArray();
+        batch->pending++;
+    }
+
+    QFutureWatcher<QVariant> *watcher=new QFutureWatcher<QVariant>(this);
+    connect(watcher, &QFutureWatcherBase::finished, this, [this, watcher, guard, encoding, respond, batch, index](){
+        watcher->deleteLater();
+        QByteArray response=respond(watcher->future().resultCount() ? watcher->result() : QVariant());
+        if(batch){
+            batch->responses[index]=response;
+            if(--batch->pending) return;
+            response=_joinBatch(batch->responses, encoding);
+        }
+        if(response.isEmpty() || !guard || !_clients.contains(guard)) return;
+        _sendResponse(guard, response, encoding);
+    });
+    watcher->setFuture(future);
+}
+
+void WebSocketApi::_sendResponse(QObject *client, const QByteArray &response, Encoding encoding){
+    QElapsedTimer timer;
+    if(_metrics) timer.start();
+    if(encoding==Cbor) _sendBinary(client, response);
+    else _sendText(client, QString::fromUtf8(response));
+    if(_metrics) _metrics->recordStage(ApiMetrics::Send, timer.nsecsElapsed());
+}
+
+QByteArray WebSocketApi::_subscribe(QObject *client, const QString &method, const QVariant &arg, const QVariantList &args,
+                                    int id, Encoding encoding){
+    QVariantList params=args;
+    if(params.isEmpty()) params << arg;
+
+    QStringList topics;
+    foreach(const QVariant &value, params){
+        if(value.type()!=QVariant::String || !_isTopic(value.toString())) return _toError(INVALID_PARAMS, id, encoding);
+        topics << value.toString();
+    }
+
+    QSet<QString> &subscriptions=_subscriptions[client];
+    foreach(const QString &topic, topics){
+        if(method=="subscribe"){
+            _subscribers[topic].insert(client);
+            subscriptions.insert(topic);
+        } else {
+            auto subscribers=_subscribers.find(topic);
+            if(subscribers!=_subscribers.end()){
+                subscribers->remove(client);
+                if(subscribers->isEmpty()) _subscribers.erase(subscribers);
             }
+            subscriptions.remove(topic);
         }
     }
-    return _toError(METHOD_NOT_FOUND, id);
+    if(subscriptions.isEmpty()) _subscriptions.remove(client);
+    return _toResponse(_encode("OK", encoding), id, encoding);
 }
 
-QString WebSocketApi::_toError(JsonRpcError error, int id){
-    QJsonObject jresponse;
-    jresponse["jsonrpc"]=2.0;
-    if(id>0) jresponse["id"]=id;
+bool WebSocketApi::_isTopic(const QString &topic) const {
+    if(topic=="*") return true;
+
+    // "Class.signal" or "Class.*" for every instance, "Class.objectName.signal" or "Class.objectName.*" for one
+    int dot=topic.indexOf('.'), last=topic.lastIndexOf('.');
+    if(dot<0) return false;
+    const ApiInfo *info=_classInfo(topic.left(dot));
+    if(!info) return false;
+    if(last!=dot && !_object(topic.left(last))) return false;
 
-    QJsonObject jdata;
-    jdata["code"]=error;
-    jdata["message"]=JsonRpcErrorStr[error];
-    jresponse["error"]=jdata;
+    QString signalName=topic.mid(last+1);
+    return signalName=="*" || info->sig2Prop.contains(signalName);
+}
 
-    return QJsonDocument(jresponse).toJson();
+QByteArray WebSocketApi::_encode(const QVariant &value, Encoding encoding){
+    return encoding==Cbor ? _toCbor(value) : _toJson(value);
 }
 
-QString WebSocketApi::_toResponse(QVariant result, int id){
-    QJsonObject jresponse;
-    jresponse["jsonrpc"]="2.0";
-    jresponse["id"]=id;
+QByteArray WebSocketApi::_toError(JsonRpcError error, int id, Encoding encoding){
+    if(_metrics) _metrics->recordRpcError(error);
+    if(encoding==Cbor){
+        QCborMap cresponse;
+        cresponse[QLatin1String("jsonrpc")]=QLatin1String("2.0");
+        cresponse[QLatin1String("id")]=id==NullId ? QCborValue(QCborValue::Null) : QCborValue(id);
 
-    if(result.type()==QVariant::String) jresponse["result"]=result.toString();
-    else if(result.type()==QVariant::Int) jresponse["result"]=result.toInt();
-    else if(result.type()==QVariant::Double) jresponse["result"]=result.toDouble();
-    else jresponse["result"]="Invalid";
+        QCborMap cdata;
+        cdata[QLatin1String("code")]=int(error);
+        cdata[QLatin1String("message")]=JsonRpcErrorStr[error];
+        cresponse[QLatin1String("error")]=cdata;
+        return cresponse.toCborValue().toCbor();
+    }
+
+    QByteArray response;
+    JsonWriter writer(&response);
+    writer.beginObject();
+    writer.key("jsonrpc");
+    writer.value("2.0");
+    // A request whose id could not be read is answered with a null id, as JSON RPC 2.0 requires
+    writer.key("id");
+    if(id==NullId) writer.null();
+    else writer.value(id);
+    writer.key("error");
+    writer.beginObject();
+    writer.key("code");
+    writer.value(int(error));
+    writer.key("message");
+    writer.value(JsonRpcErrorStr[error]);
+    writer.endObject();
+    writer.endObject();
+    return response;
+}
+
+QByteArray WebSocketApi::_toResponse(const QByteArray &result, int id, Encoding encoding){
+    // The result is already serialised, so the envelope is assembled around it
+    if(encoding==Cbor){
+        QByteArray response;
+        cborHead(response, 5, 3);
+        cborText(response, "jsonrpc");
+        cborText(response, "2.0");
+        cborText(response, "id");
+        cborInt(response, id);
+        cborText(response, "result");
+        return response+result;
+    }
 
-    return QJsonDocument(jresponse).toJson();
+    QByteArray response;
+    response.reserve(32+result.size());
+    JsonWriter writer(&response);
+    writer.beginObject();
+    writer.key("jsonrpc");
+    writer.value("2.0");
+    writer.key("id");
+    writer.value(id);
+    writer.key("result");
+    writer.raw(result);
+    writer.endObject();
+    return response;
 }
 
-QString WebSocketApi::_toNotification(QString method, QVariant params){
-    QJsonObject jnot;
-    jnot["jsonrpc"]="2.0";
-    jnot["method"]=method;
+void WebSocketApi::_toNotification(QByteArray *out, const QString &method, const QVariant &params, Encoding encoding){
+    if(encoding==Cbor){
+        cborHead(*out, 5, params.isNull() ? 2 : 3);
+        cborText(*out, "jsonrpc");
+        cborText(*out, "2.0");
+        cborText(*out, "method");
+        cborText(*out, method.toUtf8());
+        if(!params.isNull()){
+            cborText(*out, "params");
+            out->append(_toCbor(params));
+        }
+        return;
+    }
 
+    JsonWriter writer(out);
+    writer.beginObject();
+    writer.key("jsonrpc");
+    writer.value("2.0");
+    writer.key("method");
+    writer.value(method);
     if(!params.isNull()){
-        if(params.type()==QVariant::List) jnot["params"]=QJsonArray::fromVariantList(params.toList());
-        else if(params.type()==QVariant::String) jnot["params"]=params.toString();
-        else if(params.type()==QVariant::Int) jnot["params"]=params.toInt();
-        else if(params.type()==QVariant::Double) jnot["params"]=params.toDouble();
-        else jnot["params"]="Invalid";
+        writer.key("params");
+        writer.value(params);
+    }
+    writer.endObject();
+}
+
+void WebSocketApi::_sendSignal(QString methodName, QStringList topics, QVariant value){
+    int minInterval=_minInterval(methodName);
+    if(_coalesceInterval<0 && minInterval==0){
+        _notify(methodName, topics, value);
+        return;
+    }
+
+    // Last value wins, a change which is superseded before it is due is never sent
+    qint64 now=_clock.elapsed();
+    Pending &pending=_pending[methodName];
+    pending.value=value;
+    pending.topics=topics;
+    if(!pending.queued){
+        qint64 due=now+qMax(0, _coalesceInterval);
+        if(minInterval>0 && pending.sent) due=qMax(due, pending.lastSent+minInterval);
+
+        if(_coalesceInterval<0 && due<=now){
+            pending.value=QVariant();
+            pending.sent=true;
+            pending.lastSent=now;
+            _notify(methodName, topics, value);
+            return;
+        }
+        pending.queued=true;
+        pending.due=due;
     }
 
-    return QJsonDocument(jnot).toJson();
+    int delay=int(pending.due-now);
+    if(!_flushTimer->isActive() || _flushTimer->remainingTime()>delay) _flushTimer->start(delay);
 }
 
-void WebSocketApi::_processBinary(QByteArray message){
-    QWebSocket *socket=dynamic_cast<QWebSocket*>(sender());
-    Q_UNUSED(socket);
-    qDebug() << "Binary Message:" << message;
+void WebSocketApi::_flush(){
+    qint64 now=_clock.elapsed(), next=-1;
+    for(auto it=_pending.begin(); it!=_pending.end(); ++it){
+        if(!it->queued) continue;
+        if(it->due>now){
+            next=next<0 ? it->due : qMin(next, it->due);
+            continue;
+        }
+
+        QVariant value=it->value;
+        it->value=QVariant();
+        it->queued=false;
+        it->sent=true;
+        it->lastSent=now;
+        _notify(it.key(), it->topics, value);
+    }
+    if(next>=0) _flushTimer->start(int(next-now));
 }
 
-void WebSocketApi::_sendSignal(QString methodName, QVariant value){
-    // Notification style...
-    QString message=_toNotification(methodName, value);
-    foreach(QWebSocket* client, _clients){
-        client->sendTextMessage(message);
+int WebSocketApi::_minInterval(const QString &methodName) const {
+    if(_minIntervals.isEmpty()) return _defaultMinInterval;
+    return _minIntervals.value(methodName, _defaultMinInterval);
+}
+
+void WebSocketApi::_notify(const QString &methodName, const QStringList &topics, const QVariant &value){
+    // Subscribers to the notification itself, to every notification of its object, of its class and to everything.
+    // The registry builds the wildcard topics once per object.
+    const QSet<QObject*> *sets[4]={Q_NULLPTR, Q_NULLPTR, Q_NULLPTR, Q_NULLPTR};
+    int count=0;
+    auto exact=_subscribers.constFind(methodName);
+    if(exact!=_subscribers.constEnd()) sets[count++]=&exact.value();
+    for(int i=0; i<topics.size() && i<2; i++){
+        auto wildcard=_subscribers.constFind(topics.at(i));
+        if(wildcard!=_subscribers.constEnd()) sets[count++]=&wildcard.value();
+    }
+    auto all=_subscribers.constFind("*");
+    if(all!=_subscribers.constEnd()) sets[count++]=&all.value();
+    if(count==0) return; // Nobody is interested, don't even serialise
+
+    // A client may be subscribed through more than one topic but only receives the notification once
+    QSet<QObject*> clients;
+    if(count==1) clients=*sets[0];
+    else for(int i=0; i<count; i++) clients.unite(*sets[i]);
+
+    // Notification style, serialised at most once per encoding
+    QElapsedTimer timer, serializeTimer;
+    if(_metrics) timer.start();
+    int sent=0;
+    QString text;
+    QByteArray cbor;
+    foreach(QObject *client, clients){
+        if(_holdBack(client, methodName, value)) continue;
+        if(_cborClients.contains(client)){
+            if(cbor.isEmpty()){
+                if(_metrics) serializeTimer.start();
+                _toNotification(&cbor, methodName, value, Cbor);
+                if(_metrics) _metrics->recordStage(ApiMetrics::Serialize, serializeTimer.nsecsElapsed());
+            }
+            _sendBinary(client, cbor);
+        } else {
+            if(text.isEmpty()){
+                // QWebSocket only sends text frames from a QString, so the UTF-8 is converted once for all clients
+                if(_metrics) serializeTimer.start();
+                _buffer.resize(0);
+                _toNotification(&_buffer, methodName, value, Json);
+                text=QString::fromUtf8(_buffer);
+                if(_metrics) _metrics->recordStage(ApiMetrics::Serialize, serializeTimer.nsecsElapsed());
+            }
+            _sendText(client, text);
+        }
+        sent++;
     }
+
+    if(_metrics){
+        _metrics->recordStage(ApiMetrics::Send, timer.nsecsElapsed());
+        _metrics->notificationsSent(sent);
+    }
+}
+
+void WebSocketApi::_bytesWritten(){
+    QObject *client=sender();
+    auto outbound=_outbound.find(client);
+    if(outbound==_outbound.end() || outbound->backlog.isEmpty()) return;
+
+    // Wait until the client has drained half its limit, so it isn't flipped in and out of the backlog every write
+    if(_bytesToWrite(client)>_maxPendingBytes/2) return;
+
+    QHash<QString, QVariant> backlog;
+    backlog.swap(outbound->backlog);
+    bool cbor=_cborClients.contains(client);
+    for(auto it=backlog.constBegin(); it!=backlog.constEnd(); ++it){
+        QByteArray notification;
+        _toNotification(&notification, it.key(), it.value(), cbor ? Cbor : Json);
+        if(cbor) _sendBinary(client, notification);
+        else _sendText(client, QString::fromUtf8(notification));
+    }
+    if(_metrics) _metrics->notificationsSent(backlog.count());
+}
+
+void WebSocketApi::setMetrics(ApiMetrics *metrics){
+    AbstractApi::setMetrics(metrics);
+
+    // Queued bytes change as the network drains them, so the gauge is sampled rather than tracked
+    if(!metrics){
+        if(_metricsTimer) _metricsTimer->stop();
+        return;
+    }
+    if(!_metricsTimer){
+        _metricsTimer=new QTimer(this);
+        connect(_metricsTimer, SIGNAL(timeout()), SLOT(_sampleMetrics()));
+    }
+    _metricsTimer->start(1000);
+}
+
+ApiMetrics::Api WebSocketApi::_metricsApi() const { return ApiMetrics::WebSocket; }
+
+void WebSocketApi::_sampleMetrics(){
+    if(!_metrics) return;
+    qint64 bytes=0;
+    foreach(QObject *client, _clients) bytes+=_bytesToWrite(client);
+    _metrics->setOutboundBytes(bytes);
+}
+
+void WebSocketApi::_expired(QObject *socket){
+    // Only clients have outbound state, anything else is still in its opening handshake
+    bool open=_outbound.contains(socket);
+    if(_metrics)
+        _metrics->connectionEvicted(ApiMetrics::WebSocket, open ? ApiMetrics::IdleTimeout : ApiMetrics::HeaderTimeout);
+    _close(socket);
+}
+
+void WebSocketApi::_close(QObject *client){
+#ifdef QWEBAPI_DEFLATE
+    if(DeflateWebSocket *socket=qobject_cast<DeflateWebSocket*>(client)){
+        socket->close();
+        return;
+    }
+#endif
+    static_cast<QWebSocket*>(client)->close(QWebSocketProtocol::CloseCodeGoingAway);
 }
 
 void WebSocketApi::_disconnected(){
-    QWebSocket *socket=dynamic_cast<QWebSocket*>(sender());
+    QObject *socket=sender();
     qDebug() << "Socket disconnected:" << socket;
     if(!socket) return;
-    _clients.removeAll(socket);
+    _timeouts->stop(socket);
+    auto peer=_peers.find(socket);
+    if(peer!=_peers.end()){
+        _limiter.release(peer.value());
+        _peers.erase(peer);
+    }
+    if(_clients.removeAll(socket) && _metrics) _metrics->connectionClosed(ApiMetrics::WebSocket);
+    _cborClients.remove(socket);
+    _outbound.remove(socket);
+    foreach(const QString &topic, _subscriptions.take(socket)){
+        auto subscribers=_subscribers.find(topic);
+        if(subscribers==_subscribers.end()) continue;
+        subscribers->remove(socket);
+        if(subscribers->isEmpty()) _subscribers.erase(subscribers);
+    }
     socket->deleteLater();
 }
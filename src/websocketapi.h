@@ -3,19 +3,70 @@
 
 #include <QObject>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QElapsedTimer>
 #include <QHostAddress>
+#include <QSharedPointer>
+
+#include <functional>
+#include <climits>
 
 #include "abstractapi.h"
+#include "connectionlimiter.h"
 
 class QWebSocketServer;
 class QWebSocket;
+class QTcpServer;
+class QTimer;
+class QJsonObject;
+class QJsonArray;
+class TimerWheel;
 
 /**
  * @brief The WebSocketApi class exposes a JSON RPC API via a WebSocket corresponding to a QObjects properties as defined by the use of Q_PROPERTY.
+ * @details Notifications are only sent to clients which have subscribed to them. A client subscribes by calling the
+ * "subscribe" method with one or more notification names, such as "TestClass.valueChanged", "TestClass.*" for every
+ * notification of a class, "TestClass.ch17.*" for every notification of one named instance or "*" for all
+ * notifications, and stops with "unsubscribe". While autoSubscribe() is true, the default, new clients start out
+ * subscribed to "*".
+ *
+ * The method "TestClass.*", or "TestClass.ch17.*" for a named instance, reads every property as one object when
+ * called without params, and writes every member of an object given as its params in a single step, either all of
+ * them or, if any is invalid, none. Should a setter refuse its value regardless, the members already written are
+ * restored to their previous values.
+ *
+ * Work which finishes later, a method returning a QFuture<QVariant> or a member the class marks as thread-safe, is
+ * answered whenever it is done. Other requests are served in the meantime and may well be answered first, so clients
+ * must match responses to requests by id. A batch holding such a request is answered as a whole, in a single
+ * message, once all of its work is done.
+ *
+ * Requests sent in binary frames are decoded as CBOR (RFC 7049) encoded JSON RPC messages with the same structure as
+ * their JSON equivalents. Such clients are answered, and sent their notifications, in CBOR binary frames until they
+ * next send a text frame, notifications always follow the encoding of a client's latest request.
+ *
+ * Rapidly changing properties can be tamed with setCoalesceInterval() and setMaxRate(). Either way only the latest
+ * value of a property is sent once it is due, intermediate values are dropped rather than queued.
+ *
+ * A client which cannot keep up, such as a stalled browser tab, is not allowed to grow the server's memory without
+ * bound. Once more than maxPendingBytes() are waiting to be written to it, further notifications are handled according
+ * to slowClientPolicy(). Responses to its own requests are always sent.
+ *
+ * Connections beyond maxConnections(), or beyond maxConnectionsPerHost() from one address, are closed as soon as they
+ * arrive. The opening handshake must be completed within handshakeTimeout(), and a client which sends nothing for
+ * idleTimeout() is disconnected if an idle timeout is set. Messages larger than maxMessageSize() close the connection.
+ *
+ * When built with CONFIG+=qwebapi_deflate, setCompression() negotiates the permessage-deflate extension (RFC 7692)
+ * with clients which offer it.
  */
 class WebSocketApi : public AbstractApi //public QObject
 {
     Q_OBJECT
+#ifdef QWEBAPI_TESTING
+    friend class QWebApiBenchmark;
+    friend class QWebApiTest;
+#endif
 public:
     /**
      * @brief JSON RPC Error Codes
@@ -32,6 +83,27 @@ public:
     };
     Q_ENUMS(JsonRpcError)
 
+    /**
+     * @brief What happens to notifications for a client with more than maxPendingBytes() waiting to be written.
+     */
+    enum SlowClientPolicy {
+        Drop,      ///< Notifications are discarded until the client has caught up.
+        Conflate,  ///< Only the latest value of each notification is kept and sent once the client has caught up.
+        Disconnect ///< The client is disconnected.
+    };
+    Q_ENUMS(SlowClientPolicy)
+
+    /**
+     * @brief Outbound statistics for a connected client.
+     */
+    typedef struct ClientStatistics {
+        QHostAddress peerAddress;
+        quint16 peerPort;
+        qint64 queuedBytes;      ///< Bytes waiting to be written to the client.
+        int backlog;             ///< Notifications currently held back by the Conflate policy.
+        quint64 droppedMessages; ///< Notifications discarded, or superseded while held back, for this client.
+    } ClientStatistics;
+
     /**
      * @brief Construct a WebSocketApi object.
      * @details This constructor will create an object with address QHostAddress::Any and the next available port.
@@ -49,16 +121,216 @@ public:
     WebSocketApi(QHostAddress address, qint16 port, QObject *parent=0);
     ~WebSocketApi();
 
+    /**
+     * @brief Whether new clients are subscribed to all notifications when they connect.
+     */
+    bool autoSubscribe() const;
+
+    /**
+     * @brief Set whether new clients are subscribed to all notifications when they connect.
+     * @param enabled When false clients only receive the notifications they subscribe to. The default is true.
+     */
+    void setAutoSubscribe(bool enabled);
+
+    /**
+     * @brief The window in milliseconds over which notifications are coalesced, -1 if they are sent immediately.
+     */
+    int coalesceInterval() const;
+
+    /**
+     * @brief Coalesce notifications so that only the latest value of each property is sent.
+     * @param msecs Notifications are held for this long and only the last value emitted in that time is sent.
+     * 0 holds them until control returns to the event loop, -1 (the default) sends every notification immediately.
+     */
+    void setCoalesceInterval(int msecs);
+
+    /**
+     * @brief The maximum rate in Hz at which notifications are sent, 0 if unlimited.
+     * @param method A notification name such as "TestClass.valueChanged" or empty for the default.
+     */
+    double maxRate(const QString &method=QString()) const;
+
+    /**
+     * @brief Limit the rate at which notifications are sent.
+     * @details A notification emitted sooner than 1/hz seconds after the previous one is held back and only the
+     * latest value is sent once the interval has passed.
+     * @param hz The maximum rate or 0 for unlimited, the default.
+     * @param method A notification name such as "TestClass.valueChanged" or empty to set the default for all.
+     */
+    void setMaxRate(double hz, const QString &method=QString());
+
+    /**
+     * @brief The number of unwritten bytes beyond which a client is considered slow, 0 if unlimited.
+     */
+    qint64 maxPendingBytes() const;
+
+    /**
+     * @brief Set the number of unwritten bytes beyond which a client is considered slow.
+     * @param bytes The limit, the default is 1MiB. 0 sends every notification regardless.
+     */
+    void setMaxPendingBytes(qint64 bytes);
+
+    /**
+     * @brief How notifications for slow clients are handled.
+     */
+    SlowClientPolicy slowClientPolicy() const;
+
+    /**
+     * @brief Set how notifications for slow clients are handled.
+     * @param policy The policy, the default is Conflate.
+     */
+    void setSlowClientPolicy(SlowClientPolicy policy);
+
+    /**
+     * @brief Outbound statistics for every connected client.
+     */
+    QList<ClientStatistics> clientStatistics() const;
+
+    /**
+     * @brief The number of clients which may be connected at once, 0 if unlimited.
+     */
+    int maxConnections() const;
+
+    /**
+     * @brief Set the number of clients which may be connected at once, any more are disconnected on arrival.
+     * @param count The limit, the default is 0 for unlimited.
+     */
+    void setMaxConnections(int count);
+
+    /**
+     * @brief The number of clients which may be connected at once from any one address, 0 if unlimited.
+     */
+    int maxConnectionsPerHost() const;
+
+    /**
+     * @brief Set the number of clients which may be connected at once from any one address.
+     * @details Any more are disconnected on arrival. Bear in mind that many clients may share an address behind a
+     * proxy or NAT.
+     * @param count The limit, the default is 0 for unlimited.
+     */
+    void setMaxConnectionsPerHost(int count);
+
+    /**
+     * @brief The time in milliseconds within which a client must complete the opening handshake.
+     */
+    int handshakeTimeout() const;
+
+    /**
+     * @brief Set the time in milliseconds within which a client must complete the opening handshake.
+     * @details Needs Qt 5.14 or later unless compression() is enabled.
+     * @param msecs The handshake timeout, the default is 10000.
+     */
+    void setHandshakeTimeout(int msecs);
+
+    /**
+     * @brief The time in milliseconds after which a client which has sent nothing is disconnected, 0 if never.
+     */
+    int idleTimeout() const;
+
+    /**
+     * @brief Set the time in milliseconds after which a client which has sent nothing is disconnected.
+     * @details Clients which only listen for notifications are disconnected too, so they should send something, such
+     * as a "subscribe" call, more often than this.
+     * @param msecs The idle timeout, the default is 0 which never disconnects idle clients.
+     */
+    void setIdleTimeout(int msecs);
+
+    /**
+     * @brief The largest message accepted from a client, in bytes.
+     */
+    qint64 maxMessageSize() const;
+
+    /**
+     * @brief Set the largest message accepted from a client, larger messages close the connection.
+     * @details Applies to clients which connect afterwards. Needs Qt 5.15 or later unless compression() is enabled.
+     * @param bytes The limit, the default is 16777216.
+     */
+    void setMaxMessageSize(qint64 bytes);
+
+    void setMetrics(ApiMetrics *metrics) override;
+
+    /**
+     * @brief Whether permessage-deflate compression is offered to clients.
+     */
+    bool compression() const;
+
+    /**
+     * @brief Negotiate permessage-deflate compression with clients which offer it.
+     * @details Only available when QWebApi is built with CONFIG+=qwebapi_deflate, which links against zlib. Connections
+     * are then accepted and framed by QWebApi itself rather than QWebSocketServer. Clients which do not offer the
+     * extension are served uncompressed. Already open connections are unaffected.
+     * @param enabled Whether to offer compression, the default is false.
+     * @param windowBits The LZ77 window used for messages sent to clients, 9 to 15. Each compressed connection needs
+     * roughly (1 << (windowBits+2)) bytes for its compressor.
+     * @param contextTakeover Keep the compressor history between messages, which compresses similar notifications far
+     * better at the cost of keeping that memory for the lifetime of the connection.
+     */
+    void setCompression(bool enabled, int windowBits=15, bool contextTakeover=true);
+
+protected:
+    /// @private
+    ApiMetrics::Api _metricsApi() const override;
+
 private slots:
     void _newConnection();
+    void _newTcpConnection();
+    void _clientConnected();
     void _processText(QString message);
     void _processBinary(QByteArray message);
-    void _sendSignal(QString methodName, QVariant value);
+    void _sendSignal(QString methodName, QStringList topics, QVariant value);
+    void _flush();
+    void _bytesWritten();
+    void _sampleMetrics();
+    void _expired(QObject *socket);
     void _disconnected();
 
 private:
     QWebSocketServer *_socketServer;
-    QList<QWebSocket*> _clients;
+    QTcpServer *_tcpServer;
+    bool _compression;
+    int _windowBits;
+    bool _contextTakeover;
+    QList<QObject*> _clients;
+    QSet<QObject*> _cborClients;
+    QHash<QString, QSet<QObject*> > _subscribers;
+    QHash<QObject*, QSet<QString> > _subscriptions;
+    bool _autoSubscribe;
+
+    typedef struct Pending {
+        Pending(): due(0), lastSent(0), queued(false), sent(false){}
+        QVariant value;
+        QStringList topics;
+        qint64 due;
+        qint64 lastSent;
+        bool queued;
+        bool sent;
+    } Pending;
+
+    QTimer *_flushTimer;
+    QElapsedTimer _clock;
+    QHash<QString, Pending> _pending;
+    QHash<QString, int> _minIntervals;
+    int _coalesceInterval;
+    int _defaultMinInterval;
+    QByteArray _buffer;
+
+    typedef struct Outbound {
+        Outbound(): dropped(0){}
+        QHash<QString, QVariant> backlog; // Latest value of each notification held back from a slow client
+        quint64 dropped;
+    } Outbound;
+
+    QHash<QObject*, Outbound> _outbound;
+    qint64 _maxPendingBytes;
+    SlowClientPolicy _slowClientPolicy;
+    QTimer *_metricsTimer;
+
+    ConnectionLimiter _limiter;
+    QHash<QObject*, QHostAddress> _peers; // Address each admitted connection is counted against
+    TimerWheel *_timeouts;
+    int _handshakeTimeout;
+    int _idleTimeout;
+    qint64 _maxMessageSize;
 
     const QMap<int,QString> JsonRpcErrorStr{
         {PARSE_ERROR, "Invalid JSON was received by the server."},
@@ -68,10 +340,46 @@ private:
         {INTERNAL_ERROR, "Internal JSON-RPC error."},
     };
 
-    QString _parseMessage(QString message);
-    QString _toError(JsonRpcError error, int id=-1);
-    QString _toResponse(QVariant result, int id);
-    QString _toNotification(QString method, QVariant params=0);
+    enum Encoding { Json, Cbor };
+    enum { NullId=INT_MIN }; // The id of a request which has none that can be read, answered as "id": null
+
+    typedef struct Batch {
+        Batch(): pending(0){}
+        QList<QByteArray> responses; // In request order, deferred members hold their place until they finish
+        int pending;                 // Deferred members yet to finish
+    } Batch;
+
+    QSharedPointer<Batch> _batch; // The batch being processed, deferred work joins it rather than answering alone
+
+    QByteArray _parseMessage(QObject *client, QString message);
+    QByteArray _parseCbor(QObject *client, const QByteArray &message);
+    QByteArray _processBatch(QObject *client, const QJsonArray &jrequests, Encoding encoding);
+    QByteArray _joinBatch(const QList<QByteArray> &responses, Encoding encoding);
+    QByteArray _processRequest(QObject *client, const QJsonObject &jobj, Encoding encoding);
+    QByteArray _dispatch(QObject *client, const QString &method, const QJsonObject &jobj, int id, Encoding encoding);
+    QByteArray _dispatchObject(const QString &method, const QVariant &arg, const QVariantList &args, int id,
+                               Encoding encoding);
+    QByteArray _dispatchCall(QObject *client, const ApiCall *call, const QVariant &arg, const QVariantList &args,
+                             int id, bool reply, Encoding encoding);
+    void _defer(QObject *client, const QFuture<QVariant> &future, Encoding encoding,
+                std::function<QByteArray(const QVariant &result)> respond);
+    void _sendResponse(QObject *client, const QByteArray &response, Encoding encoding);
+    QByteArray _subscribe(QObject *client, const QString &method, const QVariant &arg, const QVariantList &args,
+                          int id, Encoding encoding);
+    bool _isTopic(const QString &topic) const;
+    int _minInterval(const QString &methodName) const;
+    void _notify(const QString &methodName, const QStringList &topics, const QVariant &value);
+    QByteArray _encode(const QVariant &value, Encoding encoding);
+    QByteArray _toError(JsonRpcError error, int id, Encoding encoding);
+    QByteArray _toResponse(const QByteArray &result, int id, Encoding encoding);
+    void _toNotification(QByteArray *out, const QString &method, const QVariant &params, Encoding encoding);
+    bool _admit(QObject *socket, const QHostAddress &address);
+    void _addClient(QObject *socket);
+    void _close(QObject *client);
+    void _sendText(QObject *client, const QString &message);
+    void _sendBinary(QObject *client, const QByteArray &message);
+    bool _holdBack(QObject *client, const QString &methodName, const QVariant &value);
+    qint64 _bytesToWrite(QObject *client) const;
 };
 
 #endif // WEBSOCKETAPI_H
@@ -0,0 +1,57 @@
+#ifndef TESTOBJECT_H
+#define TESTOBJECT_H
+
+#include <QObject>
+#include <QThread>
+
+/**
+ * @brief The object exposed by the tests, with properties answered immediately and others deferred to the thread pool.
+ */
+class TestObject : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("ThreadSafe", "slow,threshold")
+    Q_PROPERTY(int value READ value WRITE setValue NOTIFY valueChanged)
+    Q_PROPERTY(int slow READ slow)
+    Q_PROPERTY(int threshold READ threshold WRITE setThreshold)
+
+public:
+    explicit TestObject(QObject *parent=0): QObject(parent), _value(7), _threshold(0){}
+
+    int value() const { return _value; }
+
+    /// @brief Takes long enough that anything not deferred would be answered first.
+    int slow() const {
+        QThread::msleep(100);
+        return 42;
+    }
+
+    int threshold() const { return _threshold; }
+    void setThreshold(int threshold){ _threshold=threshold; }
+
+    /// @brief Overloads told apart by their number of arguments.
+    Q_INVOKABLE int add(int a, int b) const { return a+b; }
+    Q_INVOKABLE double add(double a, double b, double c) const { return a+b+c; }
+
+    /// @brief Overloads told apart by whether the argument converts, tried in the order declared.
+    Q_INVOKABLE QString kind(int number) const { Q_UNUSED(number) return "int"; }
+    Q_INVOKABLE QString kind(const QString &text) const { Q_UNUSED(text) return "string"; }
+
+    Q_INVOKABLE uint unsignedValue(uint value) const { return value; }
+
+signals:
+    void valueChanged(int value);
+
+public slots:
+    void setValue(int value){
+        if(_value==value) return;
+        _value=value;
+        emit valueChanged(_value);
+    }
+
+private:
+    int _value;
+    int _threshold;
+};
+
+#endif // TESTOBJECT_H
@@ -0,0 +1,21 @@
+QT += core testlib
+QT -= gui
+
+# Grants the tests access to the internals they check
+DEFINES += QWEBAPI_TESTING
+
+include(../src/qwebapi.pri)
+
+TARGET = tst_qwebapi
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+HEADERS += \
+    testobject.h
+
+SOURCES += \
+    tst_qwebapi.cpp
+
+DESTDIR=$$PWD/build
+MOC_DIR=$$PWD/.moc
+OBJECTS_DIR=$$PWD/.obj
@@ -0,0 +1,973 @@
+#include <QtTest>
+#include <QTcpSocket>
+#include <QWebSocket>
+#include <QWebSocketServer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCborValue>
+#include <QCborMap>
+#include <QCborArray>
+
+#ifdef QWEBAPI_DEFLATE
+#include <zlib.h>
+#endif
+
+#include "httpserver.h"
+#include "restapi.h"
+#include "websocketapi.h"
+#include "timerwheel.h"
+#include "apimetrics.h"
+#include "testobject.h"
+
+/**
+ * @brief Edge cases of HTTP parsing, connection handling and JSON RPC framing, driven over loopback where it matters.
+ */
+class QWebApiTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void splitRequest();
+    void pipelinedRequests();
+    void oversizedHeaders_data();
+    void oversizedHeaders();
+    void chunkedBody();
+    void expectContinue();
+    void headerTimeout();
+    void connectionLimit();
+    void responseHead();
+
+    void etagRevalidation();
+    void restWrite();
+    void signalArguments();
+    void restWriteDeferred();
+    void bulkWrite();
+    void namedInstances();
+    void sharedRegistry();
+    void eventsSnapshot();
+    void eventsStream();
+
+    void errorIds_data();
+    void errorIds();
+    void batchJson();
+    void batchCbor();
+    void cborSwitch();
+    void batchDeferred();
+    void callOverloads_data();
+    void callOverloads();
+    void subscribeTopics();
+    void coalesceAndMaxRate();
+    void slowClients_data();
+    void slowClients();
+    void deflateFraming();
+
+    void timerWheelExpiry();
+    void prometheus();
+
+private:
+    typedef struct Response {
+        int code;
+        QByteArray body;
+    } Response;
+
+    QTcpSocket *_connect();
+    QList<Response> _read(QTcpSocket *socket, int count);
+    HttpResponse _request(RestApi *api, const QByteArray &method, const QByteArray &path,
+                          const QByteArray &body=QByteArray(), const QByteArray &headers=QByteArray());
+
+    HttpServer *_server;
+};
+
+void QWebApiTest::init(){
+    _server=new HttpServer("QWebApiTest", this);
+    _server->addHandler("/", [](const HttpRequest &request, HttpResponse *response){
+        // Echoes what was parsed, so the tests see exactly what the server made of the request
+        response->body=QByteArray(request.method.data(), request.method.size())+" "
+                       +QByteArray(request.path.data(), request.path.size())+" "
+                       +QByteArray(request.body, request.bodyLength);
+    });
+    QVERIFY(_server->listen(QHostAddress::LocalHost, 0));
+}
+
+void QWebApiTest::cleanup(){
+    delete _server;
+}
+
+QTcpSocket *QWebApiTest::_connect(){
+    QTcpSocket *socket=new QTcpSocket(_server); // Closed along with the server after each test
+    socket->connectToHost(QHostAddress::LocalHost, _server->serverPort());
+    socket->waitForConnected(5000);
+    return socket;
+}
+
+QList<QWebApiTest::Response> QWebApiTest::_read(QTcpSocket *socket, int count){
+    // The server runs on this thread, so the event loop is spun rather than blocking on the socket
+    QList<Response> responses;
+    QByteArray buffer;
+    QElapsedTimer timer;
+    timer.start();
+    while(responses.count()<count && timer.elapsed()<5000){
+        QTest::qWait(10);
+        buffer+=socket->readAll();
+        forever {
+            int end=buffer.indexOf("\r\n\r\n");
+            if(end<0 || responses.count()==count) break;
+            int length=0;
+            foreach(const QByteArray &line, buffer.left(end).split('\n')){
+                if(line.toLower().startsWith("content-length:")) length=line.mid(15).trimmed().toInt();
+            }
+            if(buffer.size()<end+4+length) break;
+
+            Response response;
+            response.code=buffer.mid(9, 3).toInt();
+            response.body=buffer.mid(end+4, length);
+            responses << response;
+            buffer.remove(0, end+4+length);
+        }
+    }
+    return responses;
+}
+
+HttpResponse QWebApiTest::_request(RestApi *api, const QByteArray &method, const QByteArray &path,
+                                   const QByteArray &body, const QByteArray &headers){
+    // Parsed and handled as a worker would, a deferred response is completed once its work is done
+    QByteArray raw=method+" "+path+" HTTP/1.1\r\nHost: localhost\r\n"+headers
+                   +"Content-Length: "+QByteArray::number(body.size())+"\r\n\r\n"+body;
+    HttpRequest request;
+    bool chunked=false;
+    HttpResponse response;
+    if(HttpWorker::_parse(raw.constData(), raw.size(), 0, &request, &chunked)<0){
+        response.code=400;
+        return response;
+    }
+    api->_handle(request, &response);
+    if(response.complete){
+        response.future.waitForFinished();
+        auto complete=response.complete;
+        response.complete=Q_NULLPTR;
+        complete(response.future.resultCount() ? response.future.result() : QVariant(), &response);
+    }
+    return response;
+}
+
+void QWebApiTest::splitRequest(){
+    // Headers trickling in a byte at a time are resumed where the last scan stopped
+    QTcpSocket *socket=_connect();
+    QByteArray request="GET /split/path HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n";
+    for(int i=0; i<request.size(); i++){
+        socket->write(request.mid(i, 1));
+        socket->flush();
+        QTest::qWait(1);
+    }
+
+    QList<Response> responses=_read(socket, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 200);
+    QCOMPARE(responses.at(0).body, QByteArray("GET /split/path "));
+}
+
+void QWebApiTest::pipelinedRequests(){
+    QTcpSocket *socket=_connect();
+    socket->write("GET /one HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                  "PUT /two HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3\r\n\r\nabc"
+                  "GET /three HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    QList<Response> responses=_read(socket, 3);
+    QCOMPARE(responses.count(), 3);
+    QCOMPARE(responses.at(0).body, QByteArray("GET /one "));
+    QCOMPARE(responses.at(1).body, QByteArray("PUT /two abc"));
+    QCOMPARE(responses.at(2).body, QByteArray("GET /three "));
+}
+
+void QWebApiTest::oversizedHeaders_data(){
+    QTest::addColumn<QByteArray>("request");
+    QByteArray big(2048, 'a');
+    QTest::newRow("complete") << "GET / HTTP/1.1\r\nHost: localhost\r\nX-Big: "+big+"\r\n\r\n";
+    QTest::newRow("incomplete") << "GET / HTTP/1.1\r\nHost: localhost\r\nX-Big: "+big;
+}
+
+void QWebApiTest::oversizedHeaders(){
+    QFETCH(QByteArray, request);
+    _server->setMaxHeaderSize(1024);
+    QTcpSocket *socket=_connect();
+    socket->write(request);
+
+    QList<Response> responses=_read(socket, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 431);
+    QTRY_COMPARE(socket->state(), QAbstractSocket::UnconnectedState);
+}
+
+void QWebApiTest::chunkedBody(){
+    // Split mid chunk, and followed by a pipelined request which decoding in place must not disturb
+    QTcpSocket *socket=_connect();
+    QByteArray request="POST /chunked HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n"
+                       "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n"
+                       "GET /after HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    for(int i=0; i<request.size(); i+=7){
+        socket->write(request.mid(i, 7));
+        socket->flush();
+        QTest::qWait(1);
+    }
+
+    QList<Response> responses=_read(socket, 2);
+    QCOMPARE(responses.count(), 2);
+    QCOMPARE(responses.at(0).body, QByteArray("POST /chunked hello world"));
+    QCOMPARE(responses.at(1).body, QByteArray("GET /after "));
+}
+
+void QWebApiTest::expectContinue(){
+    QTcpSocket *socket=_connect();
+    socket->write("PUT /continue HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\nExpect: 100-continue\r\n\r\n");
+
+    QList<Response> responses=_read(socket, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 100);
+
+    socket->write("hello");
+    responses=_read(socket, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 200);
+    QCOMPARE(responses.at(0).body, QByteArray("PUT /continue hello"));
+}
+
+void QWebApiTest::headerTimeout(){
+    _server->setHeaderTimeout(300);
+    QTcpSocket *socket=_connect();
+    socket->write("GET /slow HTTP/1.1\r\nHost: localhost\r\n");
+
+    QList<Response> responses=_read(socket, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 408);
+    QTRY_COMPARE(socket->state(), QAbstractSocket::UnconnectedState);
+}
+
+void QWebApiTest::connectionLimit(){
+    _server->setMaxConnectionsPerHost(1);
+    QTcpSocket *first=_connect();
+    first->write("GET /first HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    QCOMPARE(_read(first, 1).count(), 1);
+
+    QTcpSocket *second=_connect();
+    QList<Response> responses=_read(second, 1);
+    QCOMPARE(responses.count(), 1);
+    QCOMPARE(responses.at(0).code, 503);
+    QTRY_COMPARE(second->state(), QAbstractSocket::UnconnectedState);
+    QCOMPARE(first->state(), QAbstractSocket::ConnectedState);
+}
+
+void QWebApiTest::etagRevalidation(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    HttpResponse response=_request(&api, "GET", "/TestObject/value");
+    QCOMPARE(response.code, 200);
+    int start=response.headers.indexOf("ETag: ");
+    QVERIFY(start>=0);
+    start+=6;
+    QByteArray etag=response.headers.mid(start, response.headers.indexOf("\r\n", start)-start);
+    QVERIFY(etag.startsWith('"') && etag.endsWith('"'));
+    QVERIFY(response.headers.contains("Cache-Control: no-cache\r\n"));
+
+    // An unchanged value is answered without a body, whether matched exactly, within a list or by "*"
+    response=_request(&api, "GET", "/TestObject/value", QByteArray(), "If-None-Match: "+etag+"\r\n");
+    QCOMPARE(response.code, 304);
+    QVERIFY(response.body.isEmpty());
+    QCOMPARE(_request(&api, "GET", "/TestObject/value", QByteArray(), "If-None-Match: \"x\", "+etag+"\r\n").code, 304);
+    QCOMPARE(_request(&api, "GET", "/TestObject/value", QByteArray(), "If-None-Match: *\r\n").code, 304);
+    QCOMPARE(_request(&api, "GET", "/TestObject/value", QByteArray(), "If-None-Match: \"x\"\r\n").code, 200);
+
+    // A change invalidates the old tag
+    object.setValue(8);
+    response=_request(&api, "GET", "/TestObject/value", QByteArray(), "If-None-Match: "+etag+"\r\n");
+    QCOMPARE(response.code, 200);
+    QCOMPARE(response.body, QByteArray("8"));
+    QVERIFY(!response.headers.contains(etag));
+
+    // Without a NOTIFY signal a change could go unnoticed, so such properties are never tagged
+    response=_request(&api, "GET", "/TestObject/threshold", QByteArray(), "If-None-Match: *\r\n");
+    QCOMPARE(response.code, 200);
+    QVERIFY(!response.headers.contains("ETag"));
+}
+
+void QWebApiTest::responseHead(){
+    HttpResponseWriter writer("qwebapi-test");
+    HttpResponse response;
+    response.body="hello";
+    bool withBody;
+    QByteArray head=writer.head(response, true, &withBody);
+    QVERIFY(head.startsWith("HTTP/1.1 200 OK\r\nServer: qwebapi-test\r\nDate: "));
+    QVERIFY(head.contains("\r\nConnection: keep-alive\r\n"));
+    QVERIFY(head.contains("\r\nContent-Length: 5\r\n"));
+    QVERIFY(withBody);
+    QVERIFY(head.endsWith("\r\n\r\nhello"));
+
+    // The IMF-fixdate of RFC 7231, in English and GMT whatever the locale and time zone
+    int start=head.indexOf("Date: ")+6;
+    QString date=QString::fromLatin1(head.mid(start, head.indexOf("\r\n", start)-start));
+    QRegularExpression format("^(Mon|Tue|Wed|Thu|Fri|Sat|Sun), \\d\\d (Jan|Feb|Mar|Apr|May|Jun|Jul|Aug|Sep|Oct|Nov|Dec) "
+                              "\\d{4} \\d\\d:\\d\\d:\\d\\d GMT$");
+    QVERIFY2(format.match(date).hasMatch(), qPrintable(date));
+    QDateTime sent=QLocale::c().toDateTime(date.left(date.size()-4), "ddd, dd MMM yyyy hh:mm:ss");
+    sent.setTimeSpec(Qt::UTC);
+    QVERIFY(qAbs(sent.secsTo(QDateTime::currentDateTimeUtc()))<=2);
+
+    // Each status has its own line, a 304 has neither type nor length
+    response.code=404;
+    QVERIFY(writer.head(response, false, &withBody).startsWith("HTTP/1.1 404 Not Found\r\n"));
+    QVERIFY(writer.head(response, false, &withBody).contains("\r\nConnection: close\r\n"));
+    response.code=304;
+    response.body.clear();
+    head=writer.head(response, true, &withBody);
+    QVERIFY(head.startsWith("HTTP/1.1 304 Not Modified\r\n"));
+    QVERIFY(!head.contains("content-type") && !head.contains("Content-Length"));
+    QVERIFY(!withBody);
+
+    // Large bodies are written after the head rather than copied into it
+    response.code=200;
+    response.body=QByteArray(4096, 'x');
+    head=writer.head(response, true, &withBody);
+    QVERIFY(!withBody);
+    QVERIFY(head.endsWith("\r\nContent-Length: 4096\r\n\r\n"));
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    writer.write(&buffer, response, true);
+    QVERIFY(buffer.data().endsWith("\r\n\r\n"+response.body));
+}
+
+void QWebApiTest::restWrite(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    HttpResponse response=_request(&api, "PUT", "/TestObject/value", "12");
+    QCOMPARE(response.code, 200);
+    QCOMPARE(object.value(), 12);
+
+    // Nothing is written when the value does not convert, and read-only properties are refused outright
+    QCOMPARE(_request(&api, "PUT", "/TestObject/value", "twelve").code, 400);
+    QCOMPARE(object.value(), 12);
+    QCOMPARE(_request(&api, "PUT", "/TestObject/slow", "1").code, 405);
+}
+
+void QWebApiTest::signalArguments(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    QCOMPARE(_request(&api, "GET", "/TestObject/value").body, QByteArray("7"));
+
+    // The value the signal carries goes straight into the cache, the getter is not called again
+    emit object.valueChanged(99);
+    QCOMPARE(object.value(), 7);
+    QCOMPARE(_request(&api, "GET", "/TestObject/value").body, QByteArray("99"));
+
+    // Across threads only the argument is queued with the notification
+    QThread thread;
+    object.moveToThread(&thread);
+    thread.start();
+    QMetaObject::invokeMethod(&object, "setValue", Qt::QueuedConnection, Q_ARG(int, 5));
+    QTRY_COMPARE(_request(&api, "GET", "/TestObject/value").body, QByteArray("5"));
+    thread.quit();
+    QVERIFY(thread.wait(5000));
+}
+
+void QWebApiTest::restWriteDeferred(){
+    // Written on the thread pool, the response waits for the write's result
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    HttpResponse response=_request(&api, "PUT", "/TestObject/threshold", "5");
+    QCOMPARE(response.code, 200);
+    QCOMPARE(object.threshold(), 5);
+    QCOMPARE(_request(&api, "PUT", "/TestObject/threshold", "five").code, 400);
+    QCOMPARE(object.threshold(), 5);
+}
+
+void QWebApiTest::bulkWrite(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    // One bad member, unknown, read-only or of the wrong type, and none of the others are written either
+    QCOMPARE(_request(&api, "PUT", "/TestObject", "{\"value\":1,\"threshold\":\"x\"}").code, 400);
+    QCOMPARE(_request(&api, "PATCH", "/TestObject", "{\"value\":1,\"slow\":2}").code, 400);
+    QCOMPARE(_request(&api, "PUT", "/TestObject", "{\"value\":1,\"nope\":2}").code, 400);
+    QCOMPARE(object.value(), 7);
+    QCOMPARE(object.threshold(), 0);
+
+    QSignalSpy changed(&object, SIGNAL(valueChanged(int)));
+    QCOMPARE(_request(&api, "PATCH", "/TestObject", "{\"value\":1,\"threshold\":2}").code, 200);
+    QCOMPARE(object.value(), 1);
+    QCOMPARE(object.threshold(), 2);
+    QCOMPARE(changed.count(), 1);
+
+    QJsonObject jobject=QJsonDocument::fromJson(_request(&api, "GET", "/TestObject").body).object();
+    QCOMPARE(jobject.value("value").toInt(), 1);
+    QCOMPARE(jobject.value("threshold").toInt(), 2);
+    QCOMPARE(jobject.value("slow").toInt(), 42);
+}
+
+void QWebApiTest::namedInstances(){
+    TestObject object, named, dotted, slashed;
+    named.setObjectName("a");
+    named.setValue(1);
+    dotted.setObjectName("b.c");
+    slashed.setObjectName("d/e");
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    api.addObject<TestObject*>(&named);
+
+    // Names which would be split into another object's path are refused
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("not adding.*must not contain"));
+    api.addObject<TestObject*>(&dotted);
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("not adding.*must not contain"));
+    api.addObject<TestObject*>(&slashed);
+
+    QCOMPARE(_request(&api, "GET", "/TestObject/value").body, QByteArray("7"));
+    QCOMPARE(_request(&api, "GET", "/TestObject/a/value").body, QByteArray("1"));
+    QCOMPARE(_request(&api, "GET", "/TestObject/b.c/value").code, 404);
+    QCOMPARE(_request(&api, "GET", "/TestObject/b/c/value").code, 404);
+    QCOMPARE(_request(&api, "GET", "/TestObject/d/e/value").code, 404);
+
+    // The same class and name takes over the routes, the object replaced no longer updates them
+    TestObject replacement;
+    replacement.setObjectName("a");
+    replacement.setValue(5);
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("Replacing"));
+    api.addObject<TestObject*>(&replacement);
+    QCOMPARE(_request(&api, "GET", "/TestObject/a/value").body, QByteArray("5"));
+    named.setValue(9);
+    QCOMPARE(_request(&api, "GET", "/TestObject/a/value").body, QByteArray("5"));
+    replacement.setValue(6);
+    QCOMPARE(_request(&api, "GET", "/TestObject/a/value").body, QByteArray("6"));
+    QCOMPARE(_request(&api, "PUT", "/TestObject/a/value", "8").code, 200);
+    QCOMPARE(replacement.value(), 8);
+    QCOMPARE(named.value(), 9);
+}
+
+void QWebApiTest::sharedRegistry(){
+    TestObject object, other;
+    other.setObjectName("b");
+    ApiRegistry registry;
+    registry.addObject<TestObject*>(&object);
+    RestApi rest(QHostAddress::LocalHost, 0);
+    WebSocketApi socket(QHostAddress::LocalHost, 0);
+    rest.setRegistry(&registry);
+    socket.setRegistry(&registry);
+
+    QCOMPARE(_request(&rest, "GET", "/TestObject/value").body, QByteArray("7"));
+    QJsonObject jresponse=QJsonDocument::fromJson(
+                socket._parseMessage(Q_NULLPTR, "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":1}")).object();
+    QCOMPARE(jresponse.value("result").toInt(), 7);
+
+    // A change is dispatched once by the registry and reaches both APIs
+    QSignalSpy dispatched(&registry, SIGNAL(_signalEmitted(QString,QStringList,QVariant)));
+    QSignalSpy restNotified(&rest, SIGNAL(_routesNotified(int)));
+    QSignalSpy socketNotified(&socket, SIGNAL(_signalEmitted(QString,QStringList,QVariant)));
+    object.setValue(3);
+    QCOMPARE(dispatched.count(), 1);
+    QCOMPARE(restNotified.count(), 1);
+    QCOMPARE(socketNotified.count(), 1);
+    QCOMPARE(_request(&rest, "GET", "/TestObject/value").body, QByteArray("3"));
+
+    // Nothing may be added while any API serves the registry from worker threads, however many do
+    rest.setWorkerThreads(2);
+    RestApi *concurrent=new RestApi(QHostAddress::LocalHost, 0);
+    concurrent->setRegistry(&registry);
+    concurrent->setWorkerThreads(2);
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("must be added before worker threads"));
+    registry.addObject<TestObject*>(&other);
+    QCOMPARE(_request(&rest, "GET", "/TestObject/b/value").code, 404);
+
+    rest.setWorkerThreads(0);
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("must be added before worker threads"));
+    registry.addObject<TestObject*>(&other);
+    QCOMPARE(_request(&rest, "GET", "/TestObject/b/value").code, 404);
+
+    delete concurrent;
+    registry.addObject<TestObject*>(&other);
+    QCOMPARE(_request(&rest, "GET", "/TestObject/b/value").body, QByteArray("7"));
+}
+
+void QWebApiTest::eventsSnapshot(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    // Named properties start with their current value, without an id
+    HttpResponse response=_request(&api, "GET", "/events?props=TestObject.value");
+    QCOMPARE(response.code, 200);
+    QCOMPARE(response.topics, QList<QByteArray>() << "TestObject.value");
+    QCOMPARE(response.body, QByteArray("event: TestObject.value\ndata: 7\n\n"));
+    QCOMPARE(_request(&api, "GET", "/events?props=TestObject.missing").code, 404);
+
+    // Every property starts with the values already cached and nothing is read to fill the rest
+    TestObject fresh;
+    RestApi all(QHostAddress::LocalHost, 0);
+    all.addObject<TestObject*>(&fresh);
+    response=_request(&all, "GET", "/events");
+    QCOMPARE(response.topics, QList<QByteArray>() << "*");
+    QVERIFY(response.body.isEmpty());
+    QCOMPARE(_request(&all, "GET", "/TestObject/value").body, QByteArray("7"));
+    QCOMPARE(_request(&all, "GET", "/events").body, QByteArray("event: TestObject.value\ndata: 7\n\n"));
+}
+
+void QWebApiTest::eventsStream(){
+    TestObject object;
+    RestApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    QTcpSocket socket;
+    socket.connectToHost(QHostAddress::LocalHost, api._server->serverPort());
+    QVERIFY(socket.waitForConnected(5000));
+    socket.write("GET /events?props=TestObject.value HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    QByteArray received;
+    QTRY_VERIFY((received+=socket.readAll()).contains("data: 7\n\n"));
+    QVERIFY(received.startsWith("HTTP/1.1 200"));
+    QVERIFY(received.contains("content-type: text/event-stream"));
+
+    // Changes are numbered from 1, each event carries the value the signal announced
+    object.setValue(8);
+    object.setValue(9);
+    QTRY_VERIFY((received+=socket.readAll()).contains("id: 2\nevent: TestObject.value\ndata: 9\n\n"));
+    QVERIFY(received.contains("id: 1\nevent: TestObject.value\ndata: 8\n\n"));
+}
+
+void QWebApiTest::errorIds_data(){
+    QTest::addColumn<QString>("message");
+    QTest::addColumn<QJsonValue>("id");
+    QTest::newRow("parse error") << "{\"jsonrpc\":" << QJsonValue(QJsonValue::Null);
+    QTest::newRow("no method") << "{\"jsonrpc\":\"2.0\",\"id\":5}" << QJsonValue(5);
+    QTest::newRow("string id") << "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":\"a\"}"
+                               << QJsonValue(QJsonValue::Null);
+    QTest::newRow("id 0") << "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.missing\",\"id\":0}" << QJsonValue(0);
+}
+
+void QWebApiTest::errorIds(){
+    QFETCH(QString, message);
+    QFETCH(QJsonValue, id);
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    // Every error carries an id, null whenever the request's own id could not be read
+    QJsonObject jresponse=QJsonDocument::fromJson(api._parseMessage(Q_NULLPTR, message)).object();
+    QVERIFY(jresponse.contains("error"));
+    QVERIFY(jresponse.contains("id"));
+    QCOMPARE(jresponse.value("id"), id);
+}
+
+void QWebApiTest::batchJson(){
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    // Notifications drop out of the batch, an invalid entry is answered in its place
+    QByteArray response=api._parseMessage(Q_NULLPTR, "[{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":1},"
+                                                     "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.setValue\",\"params\":[8]},"
+                                                     "5,"
+                                                     "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":2}]");
+    QJsonArray jresponses=QJsonDocument::fromJson(response).array();
+    QCOMPARE(jresponses.count(), 3);
+    QCOMPARE(jresponses.at(0).toObject().value("result").toInt(), 7);
+    QVERIFY(jresponses.at(1).toObject().contains("error"));
+    QCOMPARE(jresponses.at(2).toObject().value("id").toInt(), 2);
+    QCOMPARE(jresponses.at(2).toObject().value("result").toInt(), 8);
+
+    response=api._parseMessage(Q_NULLPTR, "[{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.setValue\",\"params\":[9]}]");
+    QVERIFY(response.isEmpty());
+    QCOMPARE(api._parseMessage(Q_NULLPTR, "[]"), api._toError(WebSocketApi::INVALID_REQUEST, WebSocketApi::NullId, WebSocketApi::Json));
+}
+
+void QWebApiTest::batchCbor(){
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    QCborArray requests;
+    for(int id=1; id<=2; id++){
+        QCborMap request;
+        request.insert(QStringLiteral("jsonrpc"), QStringLiteral("2.0"));
+        request.insert(QStringLiteral("method"), QStringLiteral("TestObject.value"));
+        request.insert(QStringLiteral("id"), id);
+        requests.append(request);
+    }
+
+    QCborParserError error;
+    QCborValue response=QCborValue::fromCbor(api._parseCbor(Q_NULLPTR, QCborValue(requests).toCbor()), &error);
+    QCOMPARE(error.error, QCborError::NoError);
+    QVERIFY(response.isArray());
+    QCborArray responses=response.toArray();
+    QCOMPARE(responses.size(), 2);
+    for(int i=0; i<2; i++){
+        QCOMPARE(responses.at(i).toMap().value(QStringLiteral("id")).toInteger(), qint64(i+1));
+        QCOMPARE(responses.at(i).toMap().value(QStringLiteral("result")).toInteger(), qint64(7));
+    }
+}
+
+void QWebApiTest::cborSwitch(){
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    QWebSocket client;
+    QSignalSpy texts(&client, SIGNAL(textMessageReceived(QString)));
+    QSignalSpy binaries(&client, SIGNAL(binaryMessageReceived(QByteArray)));
+    client.open(QUrl("ws://127.0.0.1:"+QString::number(api._socketServer->serverPort())));
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+
+    // Notifications follow whichever encoding the client last sent a request in
+    QCborMap request;
+    request.insert(QStringLiteral("jsonrpc"), QStringLiteral("2.0"));
+    request.insert(QStringLiteral("method"), QStringLiteral("TestObject.value"));
+    request.insert(QStringLiteral("id"), 1);
+    client.sendBinaryMessage(QCborValue(request).toCbor());
+    QTRY_COMPARE(binaries.count(), 1);
+    object.setValue(1);
+    QTRY_COMPARE(binaries.count(), 2);
+    QCborMap notification=QCborValue::fromCbor(binaries.at(1).at(0).toByteArray()).toMap();
+    QCOMPARE(notification.value(QStringLiteral("method")).toString(), QString("TestObject.valueChanged"));
+
+    client.sendTextMessage("{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":2}");
+    QTRY_COMPARE(texts.count(), 1);
+    object.setValue(2);
+    QTRY_COMPARE(texts.count(), 2);
+    QJsonObject jnotification=QJsonDocument::fromJson(texts.at(1).at(0).toString().toUtf8()).object();
+    QCOMPARE(jnotification.value("method").toString(), QString("TestObject.valueChanged"));
+    QCOMPARE(jnotification.value("params").toInt(), 2);
+    QCOMPARE(binaries.count(), 2);
+}
+
+void QWebApiTest::callOverloads_data(){
+    QTest::addColumn<QByteArray>("request");
+    QTest::addColumn<QVariant>("result");
+
+    // A null result stands for INVALID_PARAMS
+    QTest::newRow("two arguments") << QByteArray("\"TestObject.add\",\"params\":[1,2]") << QVariant(3);
+    QTest::newRow("three arguments") << QByteArray("\"TestObject.add\",\"params\":[1,2,0.5]") << QVariant(3.5);
+    QTest::newRow("four arguments") << QByteArray("\"TestObject.add\",\"params\":[1,2,3,4]") << QVariant();
+    QTest::newRow("named") << QByteArray("\"TestObject.add\",\"params\":{\"b\":2,\"a\":1}") << QVariant(3);
+    QTest::newRow("misnamed") << QByteArray("\"TestObject.add\",\"params\":{\"a\":1,\"c\":2}") << QVariant();
+    QTest::newRow("whole number") << QByteArray("\"TestObject.kind\",\"params\":[3]") << QVariant("int");
+    QTest::newRow("fraction") << QByteArray("\"TestObject.kind\",\"params\":[3.5]") << QVariant("string");
+    QTest::newRow("text") << QByteArray("\"TestObject.kind\",\"params\":[\"x\"]") << QVariant("string");
+    QTest::newRow("unsigned max") << QByteArray("\"TestObject.unsignedValue\",\"params\":[4294967295]") << QVariant(4294967295.0);
+    QTest::newRow("unsigned overflow") << QByteArray("\"TestObject.unsignedValue\",\"params\":[4294967296]") << QVariant();
+    QTest::newRow("unsigned negative") << QByteArray("\"TestObject.unsignedValue\",\"params\":[-1]") << QVariant();
+}
+
+void QWebApiTest::callOverloads(){
+    QFETCH(QByteArray, request);
+    QFETCH(QVariant, result);
+
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    QJsonObject jresponse=QJsonDocument::fromJson(
+                api._parseMessage(Q_NULLPTR, QString::fromUtf8("{\"jsonrpc\":\"2.0\",\"method\":"+request+",\"id\":1}"))).object();
+    if(result.isNull()){
+        QCOMPARE(jresponse.value("error").toObject().value("code").toInt(), int(WebSocketApi::INVALID_PARAMS));
+        return;
+    }
+    QCOMPARE(jresponse.value("result").toVariant(), QJsonValue::fromVariant(result).toVariant());
+}
+
+void QWebApiTest::batchDeferred(){
+    // The slow read finishes on the thread pool long after the other one, both still arrive in one array in order
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+
+    QWebSocket client;
+    QSignalSpy messages(&client, SIGNAL(textMessageReceived(QString)));
+    client.open(QUrl("ws://127.0.0.1:"+QString::number(api._socketServer->serverPort())));
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+
+    client.sendTextMessage("[{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.slow\",\"id\":1},"
+                           "{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":2}]");
+    QTRY_COMPARE(messages.count(), 1);
+    QTest::qWait(200);
+    QCOMPARE(messages.count(), 1);
+
+    QJsonArray jresponses=QJsonDocument::fromJson(messages.at(0).at(0).toString().toUtf8()).array();
+    QCOMPARE(jresponses.count(), 2);
+    QCOMPARE(jresponses.at(0).toObject().value("id").toInt(), 1);
+    QCOMPARE(jresponses.at(0).toObject().value("result").toInt(), 42);
+    QCOMPARE(jresponses.at(1).toObject().value("id").toInt(), 2);
+    QCOMPARE(jresponses.at(1).toObject().value("result").toInt(), 7);
+}
+
+void QWebApiTest::subscribeTopics(){
+    TestObject object, named;
+    named.setObjectName("a");
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.setAutoSubscribe(false);
+    api.addObject<TestObject*>(&object);
+    api.addObject<TestObject*>(&named);
+
+    QWebSocket client;
+    QSignalSpy messages(&client, SIGNAL(textMessageReceived(QString)));
+    client.open(QUrl("ws://127.0.0.1:"+QString::number(api._socketServer->serverPort())));
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+    auto message=[&messages](int i){ return QJsonDocument::fromJson(messages.at(i).at(0).toString().toUtf8()).object(); };
+
+    client.sendTextMessage("{\"jsonrpc\":\"2.0\",\"method\":\"subscribe\",\"params\":[\"Nope.*\"],\"id\":1}");
+    QTRY_COMPARE(messages.count(), 1);
+    QCOMPARE(message(0).value("error").toObject().value("code").toInt(), int(WebSocketApi::INVALID_PARAMS));
+
+    // Only the named instance
+    client.sendTextMessage("{\"jsonrpc\":\"2.0\",\"method\":\"subscribe\",\"params\":[\"TestObject.a.*\"],\"id\":2}");
+    QTRY_COMPARE(messages.count(), 2);
+    QCOMPARE(message(1).value("result").toString(), QString("OK"));
+    object.setValue(1);
+    named.setValue(2);
+    QTRY_COMPARE(messages.count(), 3);
+    QCOMPARE(message(2).value("method").toString(), QString("TestObject.a.valueChanged"));
+    QCOMPARE(message(2).value("params").toInt(), 2);
+
+    // Every instance of the class, a change matching both topics is only sent once
+    client.sendTextMessage("{\"jsonrpc\":\"2.0\",\"method\":\"subscribe\",\"params\":[\"TestObject.*\"],\"id\":3}");
+    QTRY_COMPARE(messages.count(), 4);
+    object.setValue(3);
+    named.setValue(4);
+    QTRY_COMPARE(messages.count(), 6);
+    QCOMPARE(message(4).value("method").toString(), QString("TestObject.valueChanged"));
+    QCOMPARE(message(5).value("method").toString(), QString("TestObject.a.valueChanged"));
+    QTest::qWait(50);
+    QCOMPARE(messages.count(), 6);
+
+    client.sendTextMessage("{\"jsonrpc\":\"2.0\",\"method\":\"unsubscribe\",\"params\":[\"TestObject.*\",\"TestObject.a.*\"],\"id\":4}");
+    QTRY_COMPARE(messages.count(), 7);
+    QCOMPARE(message(6).value("result").toString(), QString("OK"));
+    object.setValue(5);
+    named.setValue(6);
+    QTest::qWait(50);
+    QCOMPARE(messages.count(), 7);
+}
+
+void QWebApiTest::coalesceAndMaxRate(){
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    api.setCoalesceInterval(50);
+
+    QWebSocket client;
+    QSignalSpy messages(&client, SIGNAL(textMessageReceived(QString)));
+    client.open(QUrl("ws://127.0.0.1:"+QString::number(api._socketServer->serverPort())));
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+    auto params=[&messages](int i){
+        return QJsonDocument::fromJson(messages.at(i).at(0).toString().toUtf8()).object().value("params").toInt();
+    };
+
+    // Changes within the window are sent once, as the latest value
+    object.setValue(1);
+    object.setValue(2);
+    object.setValue(3);
+    QCOMPARE(messages.count(), 0);
+    QTRY_COMPARE(messages.count(), 1);
+    QCOMPARE(params(0), 3);
+    QTest::qWait(100);
+    QCOMPARE(messages.count(), 1);
+
+    // The first change goes out at once, later ones wait out the interval and only the latest is sent
+    api.setCoalesceInterval(-1);
+    api.setMaxRate(10, "TestObject.valueChanged");
+    QCOMPARE(api.maxRate("TestObject.valueChanged"), 10.0);
+    QCOMPARE(api.maxRate(), 0.0);
+    QTest::qWait(100);
+    QElapsedTimer timer;
+    timer.start();
+    object.setValue(10);
+    QTRY_COMPARE(messages.count(), 2);
+    QCOMPARE(params(1), 10);
+    object.setValue(11);
+    object.setValue(12);
+    QTRY_COMPARE(messages.count(), 3);
+    QVERIFY(timer.elapsed()>=90);
+    QCOMPARE(params(2), 12);
+    QTest::qWait(150);
+    QCOMPARE(messages.count(), 3);
+}
+
+void QWebApiTest::slowClients_data(){
+    QTest::addColumn<int>("policy");
+    QTest::addColumn<QVariantList>("received");
+    QTest::addColumn<int>("dropped");
+    QTest::newRow("drop") << int(WebSocketApi::Drop) << (QVariantList() << 1) << 2;
+    QTest::newRow("conflate") << int(WebSocketApi::Conflate) << (QVariantList() << 1 << 3) << 1;
+    QTest::newRow("disconnect") << int(WebSocketApi::Disconnect) << QVariantList() << 0;
+}
+
+void QWebApiTest::slowClients(){
+    QFETCH(int, policy);
+    QFETCH(QVariantList, received);
+    QFETCH(int, dropped);
+
+    // Anything still queued makes the client slow, and a frame stays queued until control returns to the event loop
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    api.setMaxPendingBytes(1);
+    api.setSlowClientPolicy(WebSocketApi::SlowClientPolicy(policy));
+
+    QWebSocket client;
+    QSignalSpy messages(&client, SIGNAL(textMessageReceived(QString)));
+    client.open(QUrl("ws://127.0.0.1:"+QString::number(api._socketServer->serverPort())));
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+    QTRY_COMPARE(api.clientStatistics().count(), 1);
+
+    if(policy==WebSocketApi::Disconnect) QTest::ignoreMessage(QtWarningMsg, QRegularExpression("disconnecting slow client"));
+    object.setValue(1);
+    object.setValue(2);
+    if(policy==WebSocketApi::Disconnect){
+        QTRY_COMPARE(client.state(), QAbstractSocket::UnconnectedState);
+        QTRY_COMPARE(api.clientStatistics().count(), 0);
+        return;
+    }
+    object.setValue(3);
+
+    // Conflated notifications follow once the backlog has drained, as their latest value
+    QTRY_COMPARE(messages.count(), received.count());
+    QTest::qWait(50);
+    QCOMPARE(messages.count(), received.count());
+    for(int i=0; i<received.count(); i++){
+        QJsonObject jnotification=QJsonDocument::fromJson(messages.at(i).at(0).toString().toUtf8()).object();
+        QCOMPARE(jnotification.value("params").toInt(), received.at(i).toInt());
+    }
+    WebSocketApi::ClientStatistics statistics=api.clientStatistics().first();
+    QCOMPARE(statistics.droppedMessages, quint64(dropped));
+    QCOMPARE(statistics.backlog, 0);
+    QCOMPARE(client.state(), QAbstractSocket::ConnectedState);
+}
+
+void QWebApiTest::deflateFraming(){
+#ifdef QWEBAPI_DEFLATE
+    TestObject object;
+    WebSocketApi api(QHostAddress::LocalHost, 0);
+    api.addObject<TestObject*>(&object);
+    api.setCompression(true);
+
+    QTcpSocket socket;
+    socket.connectToHost(QHostAddress::LocalHost, api._tcpServer->serverPort());
+    QVERIFY(socket.waitForConnected(5000));
+    socket.write("GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Extensions: permessage-deflate\r\n\r\n");
+
+    QByteArray received;
+    QTRY_VERIFY((received+=socket.readAll()).contains("\r\n\r\n"));
+    int end=received.indexOf("\r\n\r\n");
+    QVERIFY(received.startsWith("HTTP/1.1 101"));
+    QVERIFY(received.left(end).contains("permessage-deflate"));
+    received.remove(0, end+4);
+
+    // A compressed message loses the trailing empty block of its sync flush (RFC 7692 7.2.1)
+    QByteArray message="{\"jsonrpc\":\"2.0\",\"method\":\"TestObject.value\",\"id\":3}";
+    z_stream deflater;
+    memset(&deflater, 0, sizeof(deflater));
+    QCOMPARE(deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY), Z_OK);
+    QByteArray payload(256, 0);
+    deflater.next_in=reinterpret_cast<Bytef*>(message.data());
+    deflater.avail_in=uInt(message.size());
+    deflater.next_out=reinterpret_cast<Bytef*>(payload.data());
+    deflater.avail_out=uInt(payload.size());
+    QCOMPARE(deflate(&deflater, Z_SYNC_FLUSH), Z_OK);
+    payload.resize(payload.size()-int(deflater.avail_out)-4);
+    deflateEnd(&deflater);
+
+    // Client frames are masked, RSV1 marks the message as compressed
+    QByteArray frame;
+    const char mask[4]={ 0x12, 0x34, 0x56, 0x78 };
+    frame.append(char(0xC1)).append(char(0x80|payload.size())).append(mask, 4);
+    for(int i=0; i<payload.size(); i++) frame.append(char(payload.at(i)^mask[i%4]));
+    socket.write(frame);
+
+    QTRY_VERIFY((received+=socket.readAll()).size()>=2 && received.size()>=2+(uchar(received.at(1))&0x7F));
+    QCOMPARE(uchar(received.at(0)), uchar(0xC1));
+    int length=uchar(received.at(1));
+    QVERIFY(length<126);
+    QByteArray compressed=received.mid(2, length)+QByteArray("\x00\x00\xff\xff", 4);
+
+    z_stream inflater;
+    memset(&inflater, 0, sizeof(inflater));
+    QCOMPARE(inflateInit2(&inflater, -15), Z_OK);
+    QByteArray response(1024, 0);
+    inflater.next_in=reinterpret_cast<Bytef*>(compressed.data());
+    inflater.avail_in=uInt(compressed.size());
+    inflater.next_out=reinterpret_cast<Bytef*>(response.data());
+    inflater.avail_out=uInt(response.size());
+    QCOMPARE(inflate(&inflater, Z_SYNC_FLUSH), Z_OK);
+    response.resize(response.size()-int(inflater.avail_out));
+    inflateEnd(&inflater);
+
+    QJsonObject jresponse=QJsonDocument::fromJson(response).object();
+    QCOMPARE(jresponse.value("id").toInt(), 3);
+    QCOMPARE(jresponse.value("result").toInt(), 7);
+#else
+    QSKIP("Built without CONFIG+=qwebapi_deflate");
+#endif
+}
+
+void QWebApiTest::timerWheelExpiry(){
+    // A resolution of 1 ms makes a turn of the wheel shorter than the longest timeout
+    TimerWheel wheel(1);
+    QObject a, b, c;
+    QSignalSpy expired(&wheel, SIGNAL(expired(QObject*)));
+    QElapsedTimer timer;
+    timer.start();
+    wheel.start(&a, 20);
+    wheel.start(&b, 20);
+    wheel.start(&c, 400);
+    wheel.stop(&b);
+    QVERIFY(!wheel.isActive(&b));
+
+    QTRY_COMPARE(expired.count(), 1);
+    QCOMPARE(qvariant_cast<QObject*>(expired.at(0).at(0)), &a);
+    QVERIFY(!wheel.isActive(&a));
+    QVERIFY(wheel.isActive(&c));
+
+    // Passing its slot on an earlier turn does not fire it, nor does it ever fire early
+    QTRY_COMPARE_WITH_TIMEOUT(expired.count(), 2, 5000);
+    QCOMPARE(qvariant_cast<QObject*>(expired.at(1).at(0)), &c);
+    QVERIFY(timer.elapsed()>=400);
+
+    wheel.start(&a, 1000);
+    wheel.start(&a, 0);
+    QVERIFY(!wheel.isActive(&a));
+}
+
+void QWebApiTest::prometheus(){
+    ApiMetrics metrics;
+    int slot=metrics.registerRoute(ApiMetrics::Rest, "Test\"Object\\.va\nlue");
+    QVERIFY(slot>=0);
+    QCOMPARE(metrics.registerRoute(ApiMetrics::Rest, "Test\"Object\\.va\nlue"), slot);
+    QVERIFY(metrics.registerRoute(ApiMetrics::WebSocket, "Test\"Object\\.va\nlue")!=slot);
+
+    // Routes which have not been served yet are left out
+    QVERIFY(!metrics.toPrometheus().contains("qwebapi_requests_total{"));
+
+    metrics.recordRoute(slot, 1000, false);
+    metrics.recordRoute(slot, 2000, true);
+    metrics.setOutboundBytes(123);
+    QByteArray out=metrics.toPrometheus();
+    QVERIFY(out.contains("qwebapi_requests_total{api=\"rest\",route=\"Test\\\"Object\\\\.va\\nlue\"} 2\n"));
+    QVERIFY(out.contains("qwebapi_request_errors_total{api=\"rest\",route=\"Test\\\"Object\\\\.va\\nlue\"} 1\n"));
+    QVERIFY(out.contains("qwebapi_outbound_queued_bytes{api=\"websocket\"} 123\n"));
+    QVERIFY(!out.contains("qwebapi_outbound_queued_bytes{api=\"rest\"}"));
+
+    // Every line is a comment or a sample, none are broken by the newline in the route name
+    foreach(const QByteArray &line, out.split('\n')){
+        if(line.isEmpty() || line.startsWith('#')) continue;
+        QVERIFY2(line.startsWith("qwebapi_"), line.constData());
+    }
+}
+
+QTEST_GUILESS_MAIN(QWebApiTest)
+#include "tst_qwebapi.moc"